@@ -65,16 +65,28 @@
 
 #include "httpd.h"
 #include "http_config.h"
+#include "http_connection.h"
 #include "http_log.h"
+#include "http_protocol.h"
+#include "http_vhost.h"
 
 #include "apr.h"
+#include "apr_allocator.h"
+#include "apr_atomic.h"
+#include "apr_lib.h"
+#include "apr_hash.h"
+#include "apr_md5.h"
 #include "apr_strings.h"
 #include "apr_dbd.h"
 #include "apr_portable.h"
 #include "apr_file_io.h"
+#include "apr_thread_proc.h"
+#include "apr_user.h"
 #include "apu.h"
 #include "apu_version.h"
 
+#include "mod_sqltemplate.h"
+
 #if (APU_MAJOR_VERSION < 1) || (APU_MAJOR_VERSION == 1 && APU_MINOR_VERSION < 3)
 #if (APU_HAVE_PGSQL)
 #include <libpq-fe.h>
@@ -90,6 +102,14 @@
 #endif
 #endif
 
+/* with SQLTPL_HAVE_LIBPQ, and linked with libpq, the queries of inner
+   sections on pgsql connections can be sent ahead, see SQLTemplateAsyncConnections
+*/
+#ifdef SQLTPL_HAVE_LIBPQ
+#include <libpq-fe.h>
+#include "apr_poll.h"
+#endif
+
 #ifdef _DEBUG_SQLTPL
 #  define debug(l, x) do { if (l <= _DEBUG_SQLTPL) { x; } } while(0)
 #else
@@ -99,32 +119,99 @@
 extern module AP_MODULE_DECLARE_DATA sqltemplate_module;
 
 
-/* information about DB handles
+/* information about DB handles, and how sections are expanded.
+   the server's one holds the default connection, and the named ones.
 */
 typedef struct {
+  const char *name;        /* SQLTemplateDBConnection name, NULL for the default */
   const char *driver_name;
   const char *params;
   const apr_dbd_driver_t *driver;
   apr_dbd_t *handle;
+  void *kept;              /* sqltpl_dbinfo_t of the kept connection handle is from */
+  int generation;          /* kept ones: the last pass using it */
   apr_pool_t *pool;
+  apr_hash_t *named;       /* SQLTemplateDBConnection: name to dbinfo */
+  int build_tree;          /* hand sections back as directive nodes */
+  int threads;             /* render rows on that many threads */
+  apr_interval_time_t query_timeout; /* per query, 0 for none */
+  apr_interval_time_t budget;        /* for all sections of a pass, 0 for none */
+  int async;               /* libpq connections for queries sent ahead */
+  apr_time_t budget_end;   /* set when the first section runs */
+  const char *fallback_dir;          /* last good output of each section */
+  int vhost_index;         /* pick name-based vhosts from a hash */
+  apr_interval_time_t slow_query;    /* log queries taking longer, 0 for none */
+  int shard_index;         /* SQLTemplateShard index/count: the share of */
+  int shard_count;         /* the rows of ShardBy= sections kept, 0 for all */
+  const char *shared_cache;          /* SQLTemplateSharedCache directory */
+  apr_interval_time_t shared_age;    /* how long its results are used */
+  void *replica;           /* SQLTemplateReplica: sqltpl_dbinfo_t of the copy */
+  apr_array_header_t *replica_tables; /* sqltpl_replica_table_t */
+  int replica_synced;      /* in this pass */
 } sqltpl_dbinfo_t;
 
+/* SQLTemplateReplicaTable: a table copied to the replica.
+*/
+typedef struct {
+  const char *table;
+  const char *key;         /* primary key of the copy, columns separated by commas */
+  const char *change;      /* column growing with each change, or NULL */
+} sqltpl_replica_table_t;
+
 #define BEGIN_SQLRPT "<SQLRepeat"
 #define END_SQLRPT   "</SQLRepeat>"
 
 #define BEGIN_SQLCATSET "<SQLCatSet"
 #define END_SQLCATSET   "</SQLCatSet>"
 
+#define BEGIN_SQLGROUP "<SQLGroup"
+#define END_SQLGROUP   "</SQLGroup>"
+
+#define BEGIN_SQLGROUPROWS "<SQLGroupRows>"
+#define END_SQLGROUPROWS   "</SQLGroupRows>"
+
 #define BEGIN_SQLIF "<SQLIf"
+#define ELSE_SQLIF  "<SQLElse>"
 #define END_SQLIF   "</SQLIf>"
 
 #define BEGIN_SQLSIMPLEIF "<SQLSimpleIf"
 #define END_SQLSIMPLEIF   "</SQLSimpleIf>"
 
+#define BEGIN_SQLDEFINE "<SQLTemplateDefine"
+#define END_SQLDEFINE   "</SQLTemplateDefine>"
+
 
 #define empty_string_p(p) (!(p) || !*(p))
 #define trim(line) while (*(line)==' ' || *(line)=='\t') (line)++
 
+#define could_error(x) do {\
+  const char * errmsg = (x);\
+  if (errmsg) return errmsg;\
+} while (0)
+
+#define could_error_msg(p,m,x) do {\
+  const char * errmsg = (x);\
+  if (errmsg) return apr_psprintf(p, "%s%s", m, errmsg);\
+} while (0)
+
+/* the same for errors of the database, after which a section may fall
+   back to the output it last produced */
+#define could_fail_db(ctx,x) do {\
+  const char * errmsg = (x);\
+  if (errmsg) { (ctx)->db_failed = 1; return errmsg; }\
+} while (0)
+
+/* does line start with token, as a whole word? case-insensitive.
+*/
+static int line_starts_with_token(const char * line, const char * token)
+{
+  size_t len = strlen(token);
+
+  trim(line);
+  return !strncasecmp(line, token, len) &&
+    (!line[len] || line[len]=='>' || apr_isspace(line[len]));
+}
+
 
 /* the fake apr_dbd_get_name function, courtesy of Bojan Smojver and mod_spin */
 #if (APU_MAJOR_VERSION < 1) || (APU_MAJOR_VERSION == 1 && APU_MINOR_VERSION < 3)
@@ -233,6 +320,7 @@ static void *get_dbinfo(apr_pool_t *pool, server_rec *s) {
     // any other initialisation
     dbinfo->driver_name = "";
     dbinfo->params = "";
+    dbinfo->threads = 1;
 
     ap_set_module_config(s->module_config, &sqltemplate_module, dbinfo);
   }
@@ -240,29 +328,200 @@ static void *get_dbinfo(apr_pool_t *pool, server_rec *s) {
   return dbinfo;
 }
 
+/* growable output buffer, rendered templates are appended to it.
+   storage comes from pool and is doubled as needed, so a whole section
+   ends up in a single NUL-terminated string.
+*/
+typedef struct {
+  apr_pool_t *pool;
+  char *data;
+  apr_size_t len;
+  apr_size_t size;
+} sqltpl_buf_t;
+
+static void sqltpl_buf_init(sqltpl_buf_t *buf, apr_pool_t *pool, apr_size_t size)
+{
+  buf->pool = pool;
+  buf->size = size ? size : 256;
+  buf->data = apr_palloc(pool, buf->size);
+  buf->len  = 0;
+  *buf->data = '\0';
+}
+
+/* make room for extra more bytes (plus the terminating NUL).
+*/
+static void sqltpl_buf_reserve(sqltpl_buf_t *buf, apr_size_t extra)
+{
+  char *data;
+  apr_size_t size = buf->size;
+
+  if (buf->len + extra < size) return;
 
+  while (buf->len + extra >= size) size *= 2;
 
-static apr_array_header_t * get_arguments(apr_pool_t * p, const char * line)
+  data = apr_palloc(buf->pool, size);
+  memcpy(data, buf->data, buf->len + 1);
+  buf->data = data;
+  buf->size = size;
+}
+
+static void sqltpl_buf_append(sqltpl_buf_t *buf, const char *s, apr_size_t len)
 {
-  apr_array_header_t * args = apr_array_make(p, 1, sizeof(char *));
-  char * arg, ** new;
+  sqltpl_buf_reserve(buf, len);
+  memcpy(buf->data + buf->len, s, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+}
 
-  trim(line);
-  while (*line) {
-    arg = ap_getword_conf(p, &line);
-    new = apr_array_push(args);
-    *new = arg;
-    trim(line);
+static void sqltpl_buf_puts(sqltpl_buf_t *buf, const char *s)
+{
+  sqltpl_buf_append(buf, s, strlen(s));
+}
+
+
+/* SQLTemplateTraceFile: spans of the time a pass over the configuration
+   spends connecting, querying, fetching rows and rendering them, kept
+   in a ring buffer and written out as Chrome trace events once the
+   configuration has been read, for chrome://tracing or Perfetto. when
+   there are more spans than fit, the newest are kept. spans are taken
+   from any thread, a slot each.
+*/
+#define SQLTPL_TRACE_SPANS 65536
+
+typedef struct {
+  const char *name;        /* what was being done */
+  const char *where;       /* the section or connection, or NULL */
+  int depth;               /* nesting of the section, -1 for none */
+  unsigned long tid;
+  apr_time_t start;
+  apr_time_t end;
+} sqltpl_span_t;
+
+typedef struct {
+  const char *path;
+  sqltpl_span_t *spans;
+  volatile apr_uint32_t next;    /* spans taken so far */
+} sqltpl_trace_t;
+
+/* that of the pass being read, NULL when not tracing */
+static sqltpl_trace_t *sqltpl_trace;
+
+/* the start of a span, 0 when not tracing.
+*/
+static apr_time_t sqltpl_trace_start(void)
+{
+  return sqltpl_trace ? apr_time_now() : 0;
+}
+
+/* record a span started at start, ending now.
+*/
+static void sqltpl_trace_span(const char *name, const char *where, int depth,
+                              apr_time_t start)
+{
+  sqltpl_span_t *span;
+
+  if (!sqltpl_trace || !start) return;
+
+  span = &sqltpl_trace->spans[apr_atomic_inc32(&sqltpl_trace->next) % SQLTPL_TRACE_SPANS];
+  span->name  = name;
+  span->where = where;
+  span->depth = depth;
+#if APR_HAS_THREADS
+  span->tid   = (unsigned long)apr_os_thread_current();
+#else
+  span->tid   = 0;
+#endif
+  span->start = start;
+  span->end   = apr_time_now();
+}
+
+static void sqltpl_buf_json(sqltpl_buf_t *buf, const char *s)
+{
+  char esc[8];
+
+  sqltpl_buf_append(buf, "\"", 1);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      esc[0] = '\\';
+      esc[1] = *s;
+      sqltpl_buf_append(buf, esc, 2);
+    } else if ((unsigned char)*s < 0x20) {
+      apr_snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*s);
+      sqltpl_buf_append(buf, esc, 6);
+    } else {
+      sqltpl_buf_append(buf, s, 1);
+    }
+  }
+  sqltpl_buf_append(buf, "\"", 1);
+}
+
+/* write the spans of the pass to SQLTemplateTraceFile.
+*/
+static void sqltpl_trace_write(apr_pool_t *p, server_rec *s)
+{
+  sqltpl_trace_t *trace = sqltpl_trace;
+  apr_uint32_t i, first = 0, count = trace->next;
+  sqltpl_span_t *span;
+  sqltpl_buf_t out;
+  apr_file_t *file;
+  apr_status_t rv;
+  char *event;
+
+  if (count > SQLTPL_TRACE_SPANS) {
+    first = count - SQLTPL_TRACE_SPANS;
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, s,
+        "SQLTemplateTraceFile: %u oldest spans dropped", first);
+  }
+
+  sqltpl_buf_init(&out, p, 0);
+  sqltpl_buf_puts(&out, "{\"traceEvents\":[");
+  for (i = first; i < count; i++) {
+    span  = &trace->spans[i % SQLTPL_TRACE_SPANS];
+    event = apr_psprintf(p, "%s\n{\"name\":\"%s\",\"cat\":\"sqltemplate\",\"ph\":\"X\","
+        "\"ts\":%" APR_TIME_T_FMT ",\"dur\":%" APR_TIME_T_FMT ",\"pid\":1,\"tid\":%lu,\"args\":{",
+        i > first ? "," : "", span->name, span->start, span->end - span->start, span->tid);
+    sqltpl_buf_puts(&out, event);
+    if (span->where) {
+      sqltpl_buf_puts(&out, "\"where\":");
+      sqltpl_buf_json(&out, span->where);
+    }
+    if (span->depth >= 0) {
+      event = apr_psprintf(p, "%s\"depth\":%d", span->where ? "," : "", span->depth);
+      sqltpl_buf_puts(&out, event);
+    }
+    sqltpl_buf_puts(&out, "}}");
+  }
+  sqltpl_buf_puts(&out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+  rv = apr_file_open(&file, trace->path, APR_FOPEN_CREATE | APR_FOPEN_WRITE | APR_FOPEN_TRUNCATE,
+                     APR_OS_DEFAULT, p);
+  if (rv == APR_SUCCESS) {
+    rv = apr_file_write_full(file, out.data, out.len, NULL);
+    apr_file_close(file);
+  }
+  if (rv != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "mod_sqltemplate: Can't write %s", trace->path);
   }
+}
 
-  return args;
+static apr_status_t sqltpl_trace_reset(void *data)
+{
+  sqltpl_trace = NULL;
+  return APR_SUCCESS;
 }
 
+
 /* get read lines as an array till end_token.
    counts nesting for begin_token/end_token.
    it assumes a line-per-line configuration (thru getline).
    this function could be exported.
    begin_token may be NULL.
+
+   lines are appended to a single slab of text, each one NUL terminated,
+   and only indexed by offset while reading since the slab may move as
+   it grows. it starts at the size of a short line and doubles, so small
+   bodies stay small. tokens are compared in place, so capturing a body
+   takes a handful of allocations whatever its size.
    */
 static char * get_lines_till_end_token(apr_pool_t * p,
     ap_configfile_t * config_file,
@@ -271,55 +530,78 @@ static char * get_lines_till_end_token(apr_pool_t * p,
     const char * where,
     apr_array_header_t ** plines)
 {
-  apr_array_header_t * lines = apr_array_make(p, 1, sizeof(char *));
-  char ** new, * first, * ptr;
+  apr_array_header_t * offsets = apr_array_make(p, 8, sizeof(apr_size_t));
+  apr_array_header_t * lines;
+  sqltpl_buf_t slab;
   char line[MAX_STRING_LEN]; /* sorry, but that is expected by getline. */
-  int section_nesting = 1, any_nesting = 1, line_number = 0;
+  char * ptr;
+  apr_size_t first_len, len,
+    end_len   = strlen(end_token),
+    begin_len = begin_token ? strlen(begin_token) : 0;
+  int section_nesting = 1, any_nesting = 1, line_number = 0, i;
+
+  sqltpl_buf_init(&slab, p, 0);
+
+  for (;;) {
+    if (ap_cfg_getline(line, MAX_STRING_LEN, config_file)) {
+      return apr_psprintf(p, "expected token not found: %s", end_token);
+    }
 
-  while (!ap_cfg_getline(line, MAX_STRING_LEN, config_file)) {
-    ptr = line;
     /* first char? or first non blank? */
     if (*line=='#') continue;
-    first = ap_getword_conf_nc(p, &ptr);
     line_number++;
-    if (first) {
-      /* nesting... */
-      if (!strncmp(first, "</", 2)) {
-        any_nesting--;
-        if (any_nesting<0) {
-          ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING,
-              0, NULL,
-              "bad (negative) nesting on line %d of %s",
-              line_number, where);
-        }
-      }
-      else if (!strncmp(first, "<", 1)) {
-        any_nesting++;
+
+    /* first word, without copying it */
+    for (ptr = line; *ptr && !apr_isspace(*ptr); ptr++);
+    first_len = ptr - line;
+
+    /* nesting... */
+    if (!strncmp(line, "</", 2)) {
+      any_nesting--;
+      if (any_nesting<0) {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING,
+            0, NULL,
+            "bad (negative) nesting on line %d of %s",
+            line_number, where);
       }
+    }
+    else if (*line=='<' && !(first_len == strlen(ELSE_SQLIF) &&
+                             !strncasecmp(line, ELSE_SQLIF, first_len))) {
+      any_nesting++;
+    }
 
-      if (!strcasecmp(first, end_token)) { /* okay! */
-        section_nesting--;
-        if (!section_nesting) {
-          if (any_nesting) {
-            ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING,
-                0, NULL,
-                "bad cumulated nesting (%+d) in %s",
-                any_nesting, where);
-          }
-          *plines = lines;
-          return NULL;
+    if (first_len == end_len && !strncasecmp(line, end_token, end_len)) { /* okay! */
+      section_nesting--;
+      if (!section_nesting) {
+        if (any_nesting) {
+          ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING,
+              0, NULL,
+              "bad cumulated nesting (%+d) in %s",
+              any_nesting, where);
         }
-      }
-      else if (begin_token && !strcasecmp(first, begin_token)) {
-        section_nesting++;
+        break;
       }
     }
-    /* free first. */
-    new  = apr_array_push(lines);
-    *new = apr_psprintf(p, "%s\n", line); /* put '\n' back */
+    else if (begin_token && first_len == begin_len &&
+             !strncasecmp(line, begin_token, begin_len)) {
+      section_nesting++;
+    }
+
+    /* keep it, putting '\n' back, and its NUL */
+    len = strlen(line);
+    *(apr_size_t *)apr_array_push(offsets) = slab.len;
+    sqltpl_buf_append(&slab, line, len);
+    sqltpl_buf_append(&slab, "\n", 2);
   }
 
-  return apr_psprintf(p, "expected token not found: %s", end_token);
+  /* the slab does not move any more */
+  lines = apr_array_make(p, offsets->nelts ? offsets->nelts : 1, sizeof(char *));
+  for (i = 0; i < offsets->nelts; i++) {
+    *(char **)apr_array_push(lines) = slab.data + ((apr_size_t *)offsets->elts)[i];
+  }
+
+  *plines = lines;
+  return NULL;
 }
 
 
@@ -452,826 +734,4763 @@ static ap_configfile_t * make_array_config(apr_pool_t * p,
       array_getch, array_getstr, array_close);
 }
 
-/* replace name by replacement at the beginning of buf of bufsize.
-   returns an error message or NULL.
+/* split the line of rendered text starting at line into a directive name
+   and its arguments, less surrounding blanks. nothing is modified.
+   returns the start of the next line.
 */
-static char * substitute(char * buf, int bufsize,
-                         const int targetlen,
-                         const char * replacement)
+static char *sqltpl_split_directive(char *line,
+                                    char **name, apr_size_t *nlen,
+                                    char **args, apr_size_t *alen)
 {
-    int
-      lbuf  = buf         ? strlen(buf        ) : 0,
-      lrepl = replacement ? strlen(replacement) : 0,
-      shift = lrepl - targetlen,
-      size  = lbuf + shift,
-      i, j;
+  char *end = strchr(line, '\n'), *next, *p;
 
-    if (!lbuf || !targetlen || !replacement) return NULL;
+  next = end ? end + 1 : line + strlen(line);
+  if (!end) end = next;
 
-    debug(4, fprintf(stderr,
-                  "substitute(%s,%d,%s,sh=%d,lbuf=%d,lrepl=%d)\n",
-                  buf,targetlen,replacement, shift, lbuf, lrepl));
+  trim(line);
+  while (end > line && apr_isspace(end[-1])) end--;
+  for (p = line; p < end && !apr_isspace(*p); p++);
+  *name = line;
+  *nlen = p - line;
+
+  while (p < end && apr_isspace(*p)) p++;
+  *args = p;
+  *alen = end - p;
+
+  return next;
+}
 
-    // TODO: escape double quotes
+/* can rendered text become a directive tree without going through httpd's
+   reader? not if some directive has to run while the configuration is
+   read (EXEC_ON_READ: Include, <IfModule>...), if a line is continued or
+   a name is not plain, or if containers do not match. httpd then reads
+   the text as usual, and reports any error itself.
+*/
+static int sqltpl_tree_ok(apr_pool_t *p, char *text)
+{
+  apr_hash_t *seen = apr_hash_make(p);
+  apr_array_header_t *open = apr_array_make(p, 8, sizeof(char *));
+  char *line, *name, *args, *top;
+  const command_rec *cmd;
+  const char *kind;
+  apr_size_t nlen, alen;
+  module *mod;
+
+  for (line = text; *line; ) {
+    line = sqltpl_split_directive(line, &name, &nlen, &args, &alen);
+    if (!nlen || *name == '#') continue;
+
+    if (memchr(name, '$', nlen) || (alen ? args[alen-1] : name[nlen-1]) == '\\') {
+      return 0;
+    }
 
-    if (size >= bufsize) {
-        /* could/should I reallocate? */
-        return "cannot substitute, buffer size too small";
+    if (name[0] == '<' && name[1] == '/') {
+      if (!open->nelts || name[nlen-1] != '>' || alen) return 0;
+      top = *(char **)apr_array_pop(open);
+      if (strncasecmp(top + 1, name + 2, nlen - 3) ||
+          (top[nlen-2] && !apr_isspace(top[nlen-2]))) {
+        return 0;
+      }
+      continue;
     }
 
-    /* shift the end of line */
-    if (shift < 0) {
-        for (i = targetlen; i <= lbuf; i++)
-            buf[i + shift] = buf[i];
-    } else if (shift > 0) {
-        for (i = lbuf; i >= targetlen; i--)
-            buf[i + shift] = buf[i];
+    if (name[0] == '<') {
+      if (!alen || args[alen-1] != '>') return 0;
+      *(char **)apr_array_push(open) = name;
     }
 
-    /* insert the replacement with escapes */
-    j = 0;
-    for (i = 0; i < lrepl; i++, j++)
-    {
-      buf[j] = replacement[i];
+    /* look every name up once */
+    if (!(kind = apr_hash_get(seen, name, nlen))) {
+      mod  = ap_top_module;
+      cmd  = ap_find_command_in_modules(apr_pstrmemdup(p, name, nlen), &mod);
+      kind = (cmd && (cmd->req_override & EXEC_ON_READ)) ? "read" : "walk";
+      apr_hash_set(seen, name, nlen, kind);
     }
+    if (*kind == 'r') return 0;
+  }
 
-    return NULL;
+  return !open->nelts;
 }
 
-
-/**
- * Find next place for substitution.
- */
-/*
- * Algorithm:
- *   do {
- *     target = strstr(buf, "$");
- *   } while (target>buf && *(target-1)=='\\');
- *   if (*(target+1) == '{') {
- *     endbrace = strstr(target+1, '}');
- *     if (!endbrace) {
- *       syntax error;
- *       return NULL;
- *     }
- *     find which tab element this is strcmp()==0 to
- *     if (not in tab) {
- *       warn "Unrecognised variable"
- *       continue;
- *     }
- *     found match, return starting position = target, length = len(match)+3
- *   } elseif (!*(target+1)) {
- *     continue;
- *   } else  {
- *     loop through tab {
- *       if (ap_strstr(target+1, tab[i]) != target+1) {
- *         continue;
- *       }
- *       if (longer than current match) {
- *         save as current match;
- *       }
- *     }
- *   }
- */
-static char * find_next_substitution(const char * buf,
-                                     const apr_array_header_t * args,
-                                     int * replacement_len,
-                                     int * whichone,
-                                     int lineno,
-                                     const char *where)
+/* build httpd's directive tree from rendered text, as its reader would,
+   once sqltpl_tree_ok() has agreed to it. names and arguments are
+   terminated in place rather than copied, so text must last as long as
+   the tree. returns the first top-level node.
+*/
+static ap_directive_t *sqltpl_build_tree(apr_pool_t *p, char *text, const char *where)
 {
-  char *target=NULL;
-  char *found=NULL;
-  char *chosen=NULL;
-  char **tab = (char**)args->elts;
+  ap_directive_t *first = NULL, *last = NULL, *parent = NULL, *node;
+  char *line, *name, *args;
+  apr_size_t nlen, alen;
+  int lineno = 0;
+
+  for (line = text; *line; ) {
+    line = sqltpl_split_directive(line, &name, &nlen, &args, &alen);
+    lineno++;
+    if (!nlen || *name == '#') continue;
+
+    if (name[0] == '<' && name[1] == '/') {
+      last   = parent;
+      parent = parent->parent;
+      continue;
+    }
 
-  do {
-    target = ap_strstr(found?found:buf, "$");
+    name[nlen] = '\0';
+    args[alen] = '\0';
 
-    if (!target || !*target || !*(target+1)) {
-      // no '$', or it's at the end
-      return NULL;
+    node = apr_pcalloc(p, sizeof(ap_directive_t));
+    node->directive = name;
+    node->args      = strstr(args, "${") ? ap_resolve_env(p, args) : args;
+    node->filename  = where;
+    node->line_num  = lineno;
+    node->parent    = parent;
+
+    if (last) {
+      last->next = node;
+    } else if (parent) {
+      parent->first_child = node;
+    } else {
+      first = node;
     }
+    last = node;
 
-    // skip '$'
-    found=target+1;
+    if (*name == '<') {
+      parent = node;
+      last   = NULL;
+    }
+  }
 
-    if (target > buf && *(target-1)=='\\') {
-      // convert "\$" to "$"
-      *whichone=-1;
-      *replacement_len=2;
-      return (target-1);
+  return first;
+}
 
-    } else if (*found == '{') {         // something of the form ${foo}
-      // skip '{'
-      found++;
+/* filters which may follow a variable name: ${col|lower|default:none}
+*/
+typedef enum {
+  SQLTPL_FILTER_QUOTE,     /* wrap in double quotes, escaping embedded ones and backslashes */
+  SQLTPL_FILTER_SQLESCAPE, /* double single quotes, for SQL string literals */
+  SQLTPL_FILTER_LOWER,     /* lower-case the value */
+  SQLTPL_FILTER_DEFAULT    /* replace an empty value by the argument */
+} sqltpl_filter_type_t;
 
-      // find matching '}'
-      char *endbrace = ap_strstr(found, "}");
-      if (!endbrace) {
-        // syntax error
-        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, NULL, "Syntax error: no closing brace on line %d of %s", lineno, where);
-        return NULL;
-      }
+typedef struct {
+  sqltpl_filter_type_t type;
+  const char *arg;
+  apr_size_t arglen;
+} sqltpl_filter_t;
+
+typedef enum {
+  SQLTPL_SEG_TEXT,         /* literal text */
+  SQLTPL_SEG_VAR,          /* column value, passed through the filters */
+  SQLTPL_SEG_IF,           /* carry on if expr holds, else go to jump */
+  SQLTPL_SEG_JUMP,         /* go to jump */
+  SQLTPL_SEG_BLOCK         /* inner SQL section, expanded in place */
+} sqltpl_segment_type_t;
+
+typedef struct sqltpl_expr_t sqltpl_expr_t;
+typedef struct sqltpl_block_t sqltpl_block_t;
+typedef struct sqltpl_part_t sqltpl_part_t;
 
-      int i=0;
-      // find out which variable it is
-      for (i=0; i<args->nelts; i++) {
-        if ((strlen(tab[i]) == endbrace - found) && strncmp(found, tab[i], endbrace - found)==0) {
-          chosen=found;
-          *whichone = i;
-          *replacement_len = strlen(tab[i]) + 3; /* 3 = strlen("${}") */
-          // there will only ever be one
-          break;
-        }
-      }
-    } else {                     // something of the form $foo
-      // find the longest match
-      int i=0;
-      size_t lchosen = 0;
-      for (i = 0; i < args->nelts; i++) {
-        if (ap_strstr(found, tab[i]) == found) {
-          size_t lfound = strlen(tab[i]);
-          if (lchosen < lfound) {
-            chosen = found;
-            lchosen = lfound;
-            *whichone = i;
-            *replacement_len = lfound + 1; /* 1 = strlen("$"); */
-          }
-        }
-      }
-    }
+typedef struct {
+  sqltpl_segment_type_t type;
+  const char *text;
+  apr_size_t len;
+  int level;               /* which enclosing section col belongs to */
+  int col;
+  int nfilters;
+  sqltpl_filter_t *filters;
+  sqltpl_expr_t *expr;
+  int jump;
+  sqltpl_block_t *block;
+} sqltpl_segment_t;
+
+/* a section body, compiled against the column names of its query.
+*/
+typedef struct sqltpl_template_t {
+  apr_array_header_t *segments; /* array of sqltpl_segment_t */
+  apr_array_header_t *siblings; /* sqltpl_block_t *: the inner sections
+                                   outside <SQLIf>, when on two
+                                   connections or more, else NULL */
+} sqltpl_template_t;
 
-    if (chosen) {
-      return target;
-    } else {
-      // warning: unrecognised variable
-      char *varend=target+1;
-      int inbrace=0;
-      do {
-        if (!inbrace && varend==target+1 && *varend=='{') {
-          inbrace=1;
-        }
-        varend++;
-      } while (*varend &&
-               ((inbrace && *(varend-1) != '}') ||
-                (!inbrace && ( (*varend >= 'a' && *varend <= 'z') ||
-                               (*varend >= 'A' && *varend <= 'Z') ||
-                               (*varend >= '0' && *varend <= '9') ||
-                                *varend == '_'
-                             )
-                )
-               )
-              );
-      char varname[varend-target+1];
-      memset(varname, 0, varend-target+1);
-      strncpy(varname, target, varend-target);
-      ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, NULL,
-          "Unrecognised variable %s on line %d of %s", varname, lineno, where);
-      // try again
-    }
-  } while (target && *target);
-  return NULL;
-}
+#define SQLTPL_MAX_DEPTH 16
 
+/* the column names visible in a section body: those of its own query,
+   at level depth, and those of the enclosing sections, outermost at 0.
+*/
+typedef struct {
+  int depth;               /* -1 when there are no columns at all */
+  const apr_array_header_t *columns[SQLTPL_MAX_DEPTH];
+  const char *names[SQLTPL_MAX_DEPTH];  /* Name= of the section, or NULL */
+} sqltpl_scope_t;
+
+typedef enum {
+  SQLTPL_BLOCK_REPEAT,
+  SQLTPL_BLOCK_CATSET,
+  SQLTPL_BLOCK_GROUP
+} sqltpl_block_type_t;
+
+/* a body declared once with <SQLTemplateDefine name>, for sections
+   given Use=name. it is compiled once for each set of column names it
+   is expanded against, and that compiled form shared by all of them.
+*/
+typedef struct {
+  sqltpl_block_type_t type;
+  sqltpl_scope_t scope;
+  const sqltpl_dbinfo_t *conf;   /* the server's, and the connection */
+  const sqltpl_dbinfo_t *db;     /* inner sections default to */
+  sqltpl_template_t *tpl[3];
+} sqltpl_compiled_t;
 
+typedef struct {
+  const char *where;
+  apr_array_header_t *contents;
+  apr_array_header_t *compiled;  /* sqltpl_compiled_t */
+} sqltpl_define_t;
 
-/* substitute arguments by replacements in buf of bufsize.
-   returns an error message or NULL.
-   if used is defined, returns the used arguments.
-*/
-static char * substitute_section_args(char * buf, int bufsize,
-                                    const apr_array_header_t * arguments,
-                                    const apr_array_header_t * replacements,
-                                    apr_array_header_t * used,
-                                    int lineno,
-                                    const char *where)
-{
-    char * ptr = buf, * errmsg,
-        ** rtab = (char **)replacements->elts;
-    int whichone = -1;
-
-    if (used) {
-        ap_assert(used->nalloc >= replacements->nelts);
-    }
-    debug(4, fprintf(stderr, "1# %s", buf));
-
-    int len=0;
-    while ((ptr = find_next_substitution(ptr, arguments, &len, &whichone, lineno, where))) {
-      if (whichone<0) {
-        // replace "\$" with "$"
-        debug(4, fprintf(stderr, "substitute("));
-        debug(4, fprintf(stderr, "ptr:\"%s\", ", ptr));
-        debug(4, fprintf(stderr, "buf:%p - ptr:%p + bufsize:%d = %d, ", buf, ptr, bufsize, buf - ptr + bufsize));
-        debug(4, fprintf(stderr, "targetlen:%d, ", len));
-        debug(4, fprintf(stderr, "\"$\""));
-        debug(4, fprintf(stderr, ");\n"));
-
-        errmsg = substitute(ptr, buf - ptr + bufsize, len, "$");
-        if (errmsg) {
-          return errmsg;
-        }
-        ptr+=2;
-      } else {
-        debug(4, fprintf(stderr, "substitute("));
-        debug(4, fprintf(stderr, "ptr:\"%s\", ", ptr));
-        debug(4, fprintf(stderr, "buf:%p - ptr:%p + bufsize:%d = %d, ", buf, ptr, bufsize, buf - ptr + bufsize));
-        debug(4, fprintf(stderr, "targetlen:%d, ", len));
-        debug(4, fprintf(stderr, "rtab[whichone:%d]:\"%s\"", whichone, rtab[whichone]));
-        debug(4, fprintf(stderr, ");\n"));
-
-        errmsg = substitute(ptr, buf - ptr + bufsize, len, rtab[whichone]);
-        if (errmsg) {
-          return errmsg;
-        }
-        ptr += strlen(rtab[whichone]);
-        if (!*rtab[whichone]) {
-          ptr++;
-        }
-        if (used) {
-          used->elts[whichone] = 1;
-        }
-      }
-    }
-    debug(4, fprintf(stderr, "2# %s", buf));
+/* by name, for the configuration being read */
+static apr_hash_t *sqltpl_defines;
 
-    return NULL;
+static apr_status_t sqltpl_defines_reset(void *data)
+{
+  sqltpl_defines = NULL;
+  return APR_SUCCESS;
 }
 
-/* perform substitutions in section contents and
-   return the result as a newly allocated array, if result is defined.
-   may also return an error message.
-   passes used down to substitute_section_args.
+/* an SQL section: a query, and a body expanded for its results.
+ *
+ * sections nested in a body are parsed into blocks of their own when
+ * the body is compiled, and expanded in place for every row, so httpd
+ * only ever reads back the final text. a body is compiled the first
+ * time its block runs, once the column names of its query are known.
+ */
+struct sqltpl_block_t {
+  sqltpl_block_type_t type;
+  const char *where;
+  int depth;                     /* 0 for a section read by httpd */
+  apr_array_header_t *header;    /* sqltpl_template_t *, one per word */
+  int const_query;               /* the query is the same for every run */
+  apr_table_t *options;          /* Name=value words after the query */
+  const char *connection;        /* Connection=, else the enclosing one */
+  const char *name;              /* Name=, for ${name.column} further in */
+  const char *partition_by;      /* PartitionBy=, with Partitions= */
+  int partitions;
+  int max_items;                 /* MaxItems=, 0 for no limit */
+  apr_size_t max_bytes;          /* MaxBytes=, 0 for no limit */
+  const char *shard_by;          /* ShardBy= */
+  sqltpl_define_t *define;       /* Use=, where the body comes from */
+  apr_array_header_t *parts[3];  /* the body, or group head, rows, tail */
+  sqltpl_template_t *tpl[3];     /* the same, compiled */
+  apr_array_header_t *columns;   /* what tpl was compiled against */
+  apr_dbd_prepared_t *stmt;
+#if APR_HAS_THREADS
+  apr_pool_t *fetch_pool;        /* for fetched, cleared on every fetch */
+  sqltpl_part_t *fetched;        /* its rows, fetched along with those of
+                                    the sections next to it, or NULL */
+#endif
+#ifdef SQLTPL_HAVE_LIBPQ
+  PGresult **ahead;              /* sent ahead, per row of the enclosing block */
+  int nahead;
+#endif
+  apr_pool_t *pool;              /* cleared on every run */
+  apr_pool_t *row_pool;          /* cleared on every row */
+  apr_pool_t *group_pool;        /* cleared on every group */
+};
+
+/* expansion state, shared by the blocks of a section.
 */
-static const char * process_content(apr_pool_t * p,
-                                    const apr_array_header_t * contents,
-                                    const apr_array_header_t * arguments,
-                                    const apr_array_header_t * replacements,
-                                    apr_array_header_t * used,
-                                    apr_array_header_t ** result,
-                                    const char *where)
-{
-    char ** new, * errmsg, line[MAX_STRING_LEN];
-    int i;
+typedef struct {
+  server_rec *server;
+  sqltpl_dbinfo_t *dbinfo;       /* the server's */
+  apr_pool_t *pool;              /* compiled templates and blocks */
+  apr_pool_t *conn_pool;         /* connections opened on the way */
+  sqltpl_dbinfo_t *db[SQLTPL_MAX_DEPTH]; /* connection used per level */
+  const apr_array_header_t *columns[SQLTPL_MAX_DEPTH];
+  const char *names[SQLTPL_MAX_DEPTH];
+  const char * const *frames[SQLTPL_MAX_DEPTH]; /* current row per level */
+#ifdef SQLTPL_HAVE_LIBPQ
+  int rowno[SQLTPL_MAX_DEPTH];   /* index of that row, when rows are kept */
+#endif
+  int db_failed;                 /* the error is the database's, or a timeout */
+  int queries;                   /* run so far, for the log */
+  apr_size_t rows;               /* fetched so far, for the log */
+} sqltpl_ctx_t;
 
-    if (result) {
-      *result = apr_array_make(p, 1, sizeof(char *));
-    }
 
-    for (i = 0; i < contents->nelts; i++) {
-      debug(4, fprintf(stderr, "Line %d of %d\n", i+1, contents->nelts));
-      strncpy(line, ((char **)contents->elts)[i], MAX_STRING_LEN - 1);
-      errmsg = substitute_section_args(line, MAX_STRING_LEN, arguments, replacements, used, i+1, where);
-      debug(4, fprintf(stderr, "Line %d of %d done\n", i+1, contents->nelts));
-      if (errmsg) {
-        return errmsg;
-      }
+/* conditions are compiled once to a small stack machine program,
+   which is then run for every row.
+*/
+typedef enum {
+  SQLTPL_OP_COL,           /* push a column value */
+  SQLTPL_OP_STR,           /* push a constant */
+  SQLTPL_OP_TPL,           /* push a rendered template (SQLSimpleIf) */
+  SQLTPL_OP_TRUTH,         /* string to boolean: 1, yes, on, true */
+  SQLTPL_OP_SIMPLE,        /* string to boolean, the SQLSimpleIf way */
+  SQLTPL_OP_EMPTY,         /* -z value */
+  SQLTPL_OP_NONEMPTY,      /* -n value */
+  SQLTPL_OP_EQ,
+  SQLTPL_OP_NE,
+  SQLTPL_OP_LT,
+  SQLTPL_OP_LE,
+  SQLTPL_OP_GT,
+  SQLTPL_OP_GE,
+  SQLTPL_OP_MATCH,         /* value =~ /regex/ */
+  SQLTPL_OP_NOMATCH,       /* value !~ /regex/ */
+  SQLTPL_OP_NOT,
+  SQLTPL_OP_JFALSE,        /* &&: if false keep it and jump, else pop */
+  SQLTPL_OP_JTRUE          /* ||: if true keep it and jump, else pop */
+} sqltpl_op_type_t;
+
+typedef struct {
+  sqltpl_op_type_t type;
+  int level;
+  int col;
+  const char *str;
+  sqltpl_template_t *tpl;
+  ap_regex_t *re;
+  int jump;
+} sqltpl_op_t;
+
+struct sqltpl_expr_t {
+  apr_array_header_t *ops;      /* array of sqltpl_op_t */
+};
 
-      if (result) {
-        new = apr_array_push(*result);
-        *new = apr_pstrdup(p, line);
+#define SQLTPL_EXPR_STACK 32
+
+typedef struct {
+  const char *s;
+  int b;
+} sqltpl_cell_t;
+
+
+/* apply a filter to the value that has just been appended to buf,
+   starting at offset start. works in place, growing buf if needed.
+*/
+static void sqltpl_apply_filter(sqltpl_buf_t *buf, apr_size_t start,
+                                const sqltpl_filter_t *filter)
+{
+  char *p, *q, c;
+  apr_size_t extra = 0;
+
+  switch (filter->type) {
+    case SQLTPL_FILTER_LOWER:
+      for (p = buf->data + start; p < buf->data + buf->len; p++) {
+        *p = apr_tolower(*p);
       }
-    }
-    return NULL;
-}
+      break;
 
+    case SQLTPL_FILTER_DEFAULT:
+      if (buf->len == start) {
+        sqltpl_buf_append(buf, filter->arg, filter->arglen);
+      }
+      break;
 
-// automatic cleanup function, called on pool destruction
-static apr_status_t sqltpl_db_close(void *data) {
-  sqltpl_dbinfo_t *dbinfo = data;
-  if (!dbinfo || !dbinfo->driver || !dbinfo->handle) {
-    // already freed?
-    return APR_SUCCESS;
-  } else {
-    return apr_dbd_close(dbinfo->driver, dbinfo->handle);
+    case SQLTPL_FILTER_QUOTE:
+    case SQLTPL_FILTER_SQLESCAPE:
+      /* httpd reads \ in a quoted argument as an escape too, so a value
+         ending with one would swallow the closing quote */
+      c = (filter->type == SQLTPL_FILTER_QUOTE) ? '"' : '\'';
+      for (p = buf->data + start; p < buf->data + buf->len; p++) {
+        if (*p == c || (c == '"' && *p == '\\')) extra++;
+      }
+      if (filter->type == SQLTPL_FILTER_QUOTE) {
+        extra += 2;
+      }
+      if (!extra) break;
+
+      sqltpl_buf_reserve(buf, extra);
+
+      /* copy backwards, so that nothing needs a temporary copy */
+      p = buf->data + buf->len;
+      q = p + extra;
+      *q = '\0';
+      if (filter->type == SQLTPL_FILTER_QUOTE) *--q = '"';
+      while (p > buf->data + start) {
+        *--q = *--p;
+        if (*p == c || (c == '"' && *p == '\\')) {
+          *--q = (filter->type == SQLTPL_FILTER_QUOTE) ? '\\' : '\'';
+        }
+      }
+      if (filter->type == SQLTPL_FILTER_QUOTE) *--q = '"';
+      buf->len += extra;
+      break;
   }
 }
 
-static const char *sqltemplate_db_connect(apr_pool_t *pool, server_rec *s) {
+/* parse the filters of a ${name|filter|filter:arg} reference.
+   spec points to the first '|', end to the closing brace.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_parse_filters(apr_pool_t *p,
+                                        const char *spec,
+                                        const char *end,
+                                        sqltpl_segment_t *seg)
+{
+  const char *name, *arg;
+  apr_size_t len;
+  int n = 0;
 
-  sqltpl_dbinfo_t *dbinfo = get_dbinfo(pool, s);
-  if (!dbinfo->driver || !dbinfo->params || !*(dbinfo->params) || !dbinfo->driver_name || !*(dbinfo->driver_name)) {
-    return "Database connection not set up - please use SQLTemplateDBDriver and SQLTemplateDBParams";
+  for (arg = spec; arg < end; arg++) {
+    if (*arg == '|') n++;
   }
+  seg->nfilters = n;
+  seg->filters  = n ? apr_pcalloc(p, n * sizeof(sqltpl_filter_t)) : NULL;
+
+  for (n = 0; spec < end; n++) {
+    sqltpl_filter_t *filter = &seg->filters[n];
+
+    name = ++spec;
+    while (spec < end && *spec != '|' && *spec != ':') spec++;
+    len = spec - name;
+
+    arg = NULL;
+    if (*spec == ':') {
+      arg = ++spec;
+      while (spec < end && *spec != '|') spec++;
+      filter->arg    = arg;
+      filter->arglen = spec - arg;
+    }
 
-  debug(2, fprintf(stderr, "Driver: %p\n", dbinfo->driver));
-  debug(2, fprintf(stderr, "Handle: %p\n", dbinfo->handle));
-
-  if (dbinfo->handle) {
-    return NULL;
-  }
+    if (len == 5 && !strncasecmp(name, "quote", 5)) {
+      filter->type = SQLTPL_FILTER_QUOTE;
+    } else if (len == 9 && !strncasecmp(name, "sqlescape", 9)) {
+      filter->type = SQLTPL_FILTER_SQLESCAPE;
+    } else if (len == 5 && !strncasecmp(name, "lower", 5)) {
+      filter->type = SQLTPL_FILTER_LOWER;
+    } else if (len == 7 && !strncasecmp(name, "default", 7)) {
+      filter->type = SQLTPL_FILTER_DEFAULT;
+      if (!arg) {
+        return "filter 'default' needs an argument, as in default:value";
+      }
+    } else {
+      return apr_psprintf(p, "unknown filter '%.*s'", (int)len, name);
+    }
 
-  const char *err;
-  debug(3, fprintf(stderr, "Attempting connect with:\n  driver %s\n  params %s\n", dbinfo->driver_name, dbinfo->params));
-#if (APU_MAJOR_VERSION < 1) || (APU_MAJOR_VERSION == 1 && APU_MINOR_VERSION < 3)
-  apr_status_t rv = apr_dbd_open(dbinfo->driver, pool, dbinfo->params, &dbinfo->handle);
-#else
-  apr_status_t rv = apr_dbd_open_ex(dbinfo->driver, pool, dbinfo->params, &dbinfo->handle, &err);
-#endif
-  debug(2, fprintf(stderr, "Connected\n"));
-  if (rv != APR_SUCCESS) {
-    switch (rv) {
-      case APR_EGENERAL:
-          ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "mod_sqltemplate: Can't connect to %s: %s", dbinfo->driver_name, err);
-          return apr_psprintf(pool, "mod_sqltemplate: Can't connect to %s", dbinfo->driver_name);
-          break;
-      default:
-          return apr_psprintf(pool, "mod_sqltemplate: mod_sqltemplate not compatible with APR in open");
-          break;
+    if (arg && filter->type != SQLTPL_FILTER_DEFAULT) {
+      return apr_psprintf(p, "filter '%.*s' takes no argument", (int)len, name);
     }
   }
 
-  // automatic cleanup
-  apr_pool_cleanup_register(pool, dbinfo, sqltpl_db_close, apr_pool_cleanup_null);
   return NULL;
 }
 
+static void sqltpl_push_text(sqltpl_template_t *tpl, const char *text, apr_size_t len)
+{
+  sqltpl_segment_t *seg;
 
+  if (!len) return;
 
-/* handles: <SQLSimpleIf "truth value">
-*/
-static const char *sqltemplate_simpleif_section(cmd_parms * cmd,
-    void * dummy,
-    const char * arg)
+  seg = apr_array_push(tpl->segments);
+  memset(seg, 0, sizeof(*seg));
+  seg->type = SQLTPL_SEG_TEXT;
+  seg->text = text;
+  seg->len  = len;
+}
+
+static int sqltpl_push_segment(sqltpl_template_t *tpl, sqltpl_segment_type_t type)
 {
-  char *endp = ap_strrchr_c(arg, '>');
-  char *test_value;
-  if (endp == NULL) {
-    return apr_pstrcat(cmd->pool, cmd->cmd->name,
-        "> directive missing closing '>'", NULL);
-  }
+  sqltpl_segment_t *seg = apr_array_push(tpl->segments);
 
-  if (endp) {
-    *endp = '\0';
-  }
+  memset(seg, 0, sizeof(*seg));
+  seg->type = type;
+  return tpl->segments->nelts - 1;
+}
 
-  /* get argument. */
-  test_value = ap_getword_conf(cmd->temp_pool, &arg);
-
-  trim(arg);
-  if (*arg) {
-    return "<SQLSimpleIf> only takes at most one argument";
-  }
-
-  const char *errmsg = NULL;
-  apr_array_header_t * contents=NULL;
+static sqltpl_template_t *sqltpl_template_make(apr_pool_t *p)
+{
+  sqltpl_template_t *tpl = apr_palloc(p, sizeof(sqltpl_template_t));
 
-  const char *location = apr_psprintf(cmd->temp_pool,
-      "line %d of %s",
-      cmd->config_file->line_number,
-      cmd->config_file->name);
+  tpl->segments = apr_array_make(p, 16, sizeof(sqltpl_segment_t));
+  tpl->siblings = NULL;
+  return tpl;
+}
 
-  const char *where = apr_psprintf(cmd->temp_pool, "SQLSimpleIf at %s", location);
+/* find which column of args a variable refers to, at the '$' in text.
+   in the ${...} form, the column name starts skip bytes into the braces.
+   sets *len to the length of the reference, filters included.
+   returns the column index, or -1 if there is no such column.
+*/
+static int sqltpl_find_name(const char *text,
+                            apr_size_t skip,
+                            const apr_array_header_t *args,
+                            apr_size_t *len)
+{
+  char **tab = (char **)args->elts;
+  const char *name = text + 2 + skip, *end;
+  apr_size_t lchosen = 0;
+  int i, chosen = -1;
+
+  if (text[1] == '{') {               /* something of the form ${foo} */
+    end = ap_strchr_c(name, '}');
+    for (i = 0; end && i < args->nelts; i++) {
+      apr_size_t l = strlen(tab[i]);
+      if (!strncmp(name, tab[i], l) && (name[l] == '}' || name[l] == '|')) {
+        *len = end + 1 - text;
+        return i;
+      }
+    }
+  } else {                            /* something of the form $foo */
+    for (i = 0; i < args->nelts; i++) {
+      apr_size_t l = strlen(tab[i]);
+      if (l && l + 1 > lchosen && !strncmp(text + 1, tab[i], l)) {
+        chosen  = i;
+        lchosen = l + 1;
+      }
+    }
+    *len = lchosen;
+  }
 
-  errmsg = get_lines_till_end_token(cmd->temp_pool, cmd->config_file,
-      END_SQLSIMPLEIF, BEGIN_SQLSIMPLEIF,
-      where, &contents);
+  return chosen;
+}
 
-  if (errmsg) {
-    return apr_psprintf(cmd->temp_pool,
-        "%s\n\tcontents error: %s", where, errmsg);
+/* find a variable in scope, from *level inwards: the first level with
+   a matching column wins, and is left in *level. ${name.column} names
+   the level instead, that of the innermost section with Name=name.
+   *rest is set to what follows the column name.
+   returns the column index, or -1 if no level has such a column.
+*/
+static int sqltpl_find_column(const char *text,
+                              const sqltpl_scope_t *scope,
+                              int *level,
+                              apr_size_t *len,
+                              const char **rest)
+{
+  const char *label;
+  apr_size_t l;
+  int col, i;
+
+  if (text[1] == '{') {
+    for (i = scope->depth; i >= 0; i--) {
+      label = scope->names[i];
+      if (!label || strncmp(text + 2, label, l = strlen(label)) || text[2 + l] != '.') {
+        continue;
+      }
+      col = sqltpl_find_name(text, l + 1, scope->columns[i], len);
+      if (col >= 0) {
+        *level = i;
+        *rest  = text + 3 + l + strlen(APR_ARRAY_IDX(scope->columns[i], col, char *));
+        return col;
+      }
+    }
   }
 
-  if (empty_string_p(test_value)) {
-    /* treat empty argument as "false" */
-    return NULL;
+  for (; *level <= scope->depth; (*level)++) {
+    col = sqltpl_find_name(text, 0, scope->columns[*level], len);
+    if (col >= 0) {
+      *rest = text[1] == '{'
+            ? text + 2 + strlen(APR_ARRAY_IDX(scope->columns[*level], col, char *))
+            : text + *len;
+      return col;
+    }
   }
+  return -1;
+}
 
-  debug(1, fprintf(stderr, "SQLSimpleIf at %s:\n", location));
+/* compile a piece of text against the columns in scope, appending its
+ * literal and variable segments to tpl.
+ *
+ * every section level used to substitute its own columns and turn "\$"
+ * into "$", so a variable behind k backslashes belongs to the section
+ * nested k levels deep, or to the first one further in that has such
+ * a column. what no level matches keeps the backslashes that the
+ * levels in scope would not have consumed.
+ * returns an error message or NULL.
+ */
+static const char *sqltpl_compile_text(apr_pool_t *p,
+                                       sqltpl_template_t *tpl,
+                                       const char *text,
+                                       const sqltpl_scope_t *scope,
+                                       int lineno,
+                                       const char *where)
+{
+  const char *lit, *scan, *dollar, *bs, *rest, *end, *errmsg;
+  sqltpl_segment_t *seg;
+  int at, escapes, keep, level;
 
-  int negate = 0;
+  lit = scan = text;
 
-  if (*test_value=='!') {
-    test_value++;
-    negate = !0;
-  }
+  while ((dollar = ap_strchr_c(scan, '$')) != NULL) {
+    apr_size_t lchosen = 0;
+    int chosen;
 
-  int do_include = (atoi(test_value)                      != 0 ||
-                    apr_strnatcasecmp(test_value, "yes" ) == 0 ||
-                    apr_strnatcasecmp(test_value, "on"  ) == 0 ||
-                    apr_strnatcasecmp(test_value, "true") == 0
-                   );
+    scan = dollar + 1;
 
-  if (do_include != negate) {
-    debug(1, display_contents(contents));
-    cmd->config_file = make_array_config(cmd->temp_pool, contents, where, cmd->config_file, &cmd->config_file);
-  } else {
-    debug(1, fprintf(stderr, "[ignored]\n"));
-  }
+    for (bs = dollar; bs > lit && bs[-1] == '\\'; bs--);
+    escapes = dollar - bs;
 
-  return NULL;
-}
+    if (dollar[1] == '{' && !ap_strchr_c(dollar, '}')) {
+      ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, NULL,
+          "Syntax error: no closing brace on line %d of %s", lineno, where);
+      break;
+    }
 
+    level  = escapes;
+    chosen = sqltpl_find_column(dollar, scope, &level, &lchosen, &rest);
 
-/**
- * Check the section command ends with a ">", and consign everything after that
- * to oblivion.
- */
-static const char *sqltpl_sec_open_check(cmd_parms *cmd, const char *arg)
-{
-  char *endp = ap_strrchr_c(arg, '>');
+    if (chosen < 0) {
+      /* leave it as it is, less the backslashes of the levels in scope */
+      keep = escapes > scope->depth + 1 ? escapes - scope->depth - 1 : 0;
+      if (keep < escapes) {
+        sqltpl_push_text(tpl, lit, bs + keep - lit);
+        lit = dollar;
+      }
 
-  if (endp == NULL) {
-    return apr_pstrcat(cmd->pool, cmd->cmd->name,
-        "> directive missing closing '>'", NULL);
-  }
+      /* and warn about anything that looks like a name */
+      if (escapes <= scope->depth &&
+          (dollar[1] == '{' || apr_isalnum(dollar[1]) || dollar[1] == '_')) {
+        end = dollar + 1;
+        if (*end == '{') {
+          end = ap_strchr_c(end, '}') + 1;
+        } else {
+          while (apr_isalnum(*end) || *end == '_') end++;
+        }
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, NULL,
+            "Unrecognised variable %.*s on line %d of %s",
+            (int)(end - dollar), dollar, lineno, where);
+      }
+      continue;
+    }
 
-  /*   endp =~ s/>[^>]*$//   */
-  if (endp) {
-    *endp = '\0';
+    sqltpl_push_text(tpl, lit, bs - lit);
+
+    at  = sqltpl_push_segment(tpl, SQLTPL_SEG_VAR);
+    seg = &APR_ARRAY_IDX(tpl->segments, at, sqltpl_segment_t);
+    seg->level = level;
+    seg->col   = chosen;
+    if (dollar[1] == '{') {
+      if (*rest == '|') {
+        errmsg = sqltpl_parse_filters(p, rest, dollar + lchosen - 1, seg);
+        if (errmsg) {
+          return apr_psprintf(p, "%s on line %d of %s", errmsg, lineno, where);
+        }
+      }
+    }
+
+    lit = scan = dollar + lchosen;
   }
 
+  sqltpl_push_text(tpl, lit, strlen(lit));
   return NULL;
 }
 
 
-#define could_error(x) do {\
-  const char * errmsg = (x);\
-  if (errmsg) return errmsg;\
-} while (0)
-
-#define could_error_msg(p,m,x) do {\
-  const char * errmsg = (x);\
-  if (errmsg) return apr_psprintf(p, "%s%s", m, errmsg);\
-} while (0)
-
-
-/**
- * Perform an SQL query, and return column names if requested.
+/* expression parser for <SQLIf>, a recursive descent over:
  *
- * @param query The SQL to execute
- * @param args  An APR array of arguments for the query
- * @param pool  An APR memory pool that we can use
- * @param dbinfo Information about the database connection
- * @param res    Address of a pointer to fill with query result; pointer may be NULL on entry.
- * @param col_names If not NULL, this array will be filled with the query's column names
+ *   expr    := and ( '||' and )*
+ *   and     := unary ( '&&' unary )*
+ *   unary   := '!' unary | primary
+ *   primary := '(' expr ')' | '-z' operand | '-n' operand
+ *            | operand [ ('=='|'!='|'<'|'<='|'>'|'>=') operand ]
+ *            | operand ('=~'|'!~') ( /regex/[i] | "regex" )
+ *   operand := ${column} | $column | "string" | 'string' | word
  *
- * @return An error message, or NULL if no error.
+ * columns may be preceded by backslashes, as in section bodies, to
+ * refer to the row of an inner section.
+ * comparisons are numeric when both sides are numbers.
  */
-static const char *sqltpl_dbquery(char               *query,
-                                  apr_array_header_t *args,
-                                  apr_pool_t         *pool,
-                                  server_rec         *server,
-                                  sqltpl_dbinfo_t    *dbinfo,
-                                  apr_dbd_results_t **res,
-                                  apr_array_header_t *col_names
-                                 ) {
+typedef struct {
+  apr_pool_t *pool;
+  const char *s;
+  const sqltpl_scope_t *scope;
+  apr_array_header_t *ops;
+  int depth;
+  const char *error;
+} sqltpl_parser_t;
 
-#if 0
-  apr_dbd_prepared_t *stmt;
+#define EXPR_ERROR  -1
+#define EXPR_STRING  0
+#define EXPR_BOOL    1
 
-  fprintf(stderr, "pre-prepare DBINFO: %p %p %p\n", dbinfo->driver, dbinfo->handle, pool);
-  fprintf(stderr, "Preparing query...\n  %s\n", query);
-  apr_status_t rv = apr_dbd_prepare(dbinfo->driver, pool, dbinfo->handle, query, NULL, &stmt);
-  fprintf(stderr, "Prepared.\n  %s\n", query);
-  if (rv) {
-    fprintf(stderr, "DBINFO: %p %p %d\n", dbinfo->driver, dbinfo->handle, rv);
-    const char *dberrmsg = apr_dbd_error(dbinfo->driver, dbinfo->handle, rv);
-    ap_log_error(APLOG_MARK, APLOG_ERR, rv, server,
-                 "DBD: failed to prepare SQL statements: %s",
-                 (dberrmsg ? dberrmsg : "[???]"));
-    return "Failed to prepare SQL statement";
-  }
-  fprintf(stderr, "post-prepare DBINFO: %p %p\n", dbinfo->driver, dbinfo->handle);
-  if (apr_dbd_pselect(dbinfo->driver, pool, dbinfo->handle, res, stmt, 0, args->nelts, (const char**)args->elts) != 0) {
-    ap_log_error(APLOG_MARK, APLOG_ERR, 0, server, "Failed to execute query: %s", query);
-    apr_pool_destroy(pool);
-    return "Failed to execute query";
-  }
-  fprintf(stderr, "post-select DBINFO: %p %p\n", dbinfo->driver, dbinfo->handle);
-#else
-  if (apr_dbd_select(dbinfo->driver, pool, dbinfo->handle, res, query, 0) != 0) {
-    ap_log_error(APLOG_MARK, APLOG_ERR, 0, server, "Failed to execute query: %s", query);
-    return "Failed to execute query";
-  }
-#endif
+static int sqltpl_expr_or(sqltpl_parser_t *ps);
 
-  if (col_names) {
-    int i=0;
-    const char *name;
-#if (APU_MAJOR_VERSION > 1) || (APU_MAJOR_VERSION == 1 && APU_MINOR_VERSION >= 3)
-    for (name = apr_dbd_get_name(dbinfo->driver, *res, i);
-         name != NULL;
-         name = apr_dbd_get_name(dbinfo->driver, *res, ++i)) {
-      char **new = apr_array_push(col_names); *new = apr_psprintf(pool, "%s", name);
-    }
-#else
-    for (name = get_name(dbinfo->driver, pool, *res, i);
-         name != NULL;
-         name = get_name(dbinfo->driver, pool, *res, ++i)) {
-      char **new = apr_array_push(col_names); *new = apr_psprintf(pool, "%s", name);
-    }
-#endif
-    debug(2, display_array(col_names));
+static int sqltpl_expr_error(sqltpl_parser_t *ps, const char *msg)
+{
+  if (!ps->error) {
+    ps->error = *ps->s
+      ? apr_psprintf(ps->pool, "%s near \"%s\"", msg, ps->s)
+      : apr_psprintf(ps->pool, "%s at end of expression", msg);
   }
-
-  return NULL;
+  return EXPR_ERROR;
 }
 
-
-/* handles: <SQLRepeat "SQL statement">
-*/
-static const char *sqltemplate_rpt_section(cmd_parms * cmd,
-    void * dummy,
-    const char * arg)
+static sqltpl_op_t *sqltpl_expr_emit(sqltpl_parser_t *ps,
+                                     sqltpl_op_type_t type,
+                                     int stack_change)
 {
-  const char * where, * location;
-  char * query;
+  sqltpl_op_t *op = apr_array_push(ps->ops);
 
-  could_error(sqltpl_sec_open_check(cmd, arg));
+  memset(op, 0, sizeof(*op));
+  op->type = type;
+  ps->depth += stack_change;
+  if (ps->depth > SQLTPL_EXPR_STACK) {
+    sqltpl_expr_error(ps, "expression too complex");
+  }
+  return op;
+}
 
-  /* get name. */
-  query = ap_getword_conf(cmd->temp_pool, &arg);
+static int sqltpl_expr_accept(sqltpl_parser_t *ps, const char *token)
+{
+  size_t len = strlen(token);
 
-  if (empty_string_p(query)) {
-    return "SQL repeat definition: query not specified";
+  while (apr_isspace(*ps->s)) ps->s++;
+  if (strncmp(ps->s, token, len)) {
+    return 0;
   }
+  ps->s += len;
+  return 1;
+}
 
-  /* get query arguments. */
-  location = apr_psprintf(cmd->temp_pool, "%s:%d", cmd->config_file->name, cmd->config_file->line_number);
-  where    = apr_psprintf(cmd->temp_pool, "SQLRepeat at %s:%d", cmd->config_file->name, cmd->config_file->line_number);
+/* a quoted string, or a /regex/, returned unquoted.
+*/
+static const char *sqltpl_expr_quoted(sqltpl_parser_t *ps)
+{
+  char quote = *ps->s++, *str, *out;
+  const char *in;
 
-  debug(1, fprintf(stderr, "%s:\n", where));
-  debug(2, fprintf(stderr, "Query: %s\n", query));
+  for (in = ps->s; *in && *in != quote; in++) {
+    if (*in == '\\' && in[1] == quote) in++;
+  }
+  if (!*in) {
+    sqltpl_expr_error(ps, "unterminated string");
+    return NULL;
+  }
 
-  apr_array_header_t * query_arguments = get_arguments(cmd->temp_pool, arg);
-  apr_array_header_t * contents=NULL;
+  out = str = apr_palloc(ps->pool, in - ps->s + 1);
+  for (; ps->s < in; ps->s++) {
+    if (*ps->s == '\\' && ps->s[1] == quote) ps->s++;
+    *out++ = *ps->s;
+  }
+  *out = '\0';
+  ps->s++;
+  return str;
+}
 
-  could_error(get_lines_till_end_token(cmd->temp_pool, cmd->config_file, END_SQLRPT, BEGIN_SQLRPT, where, &contents));
+static int sqltpl_expr_operand(sqltpl_parser_t *ps)
+{
+  const char *start, *str, *dollar, *rest;
+  apr_size_t len = 0;
+  sqltpl_op_t *op;
+  int col, level = 0;
 
-  debug(2, display_contents(contents));
+  while (apr_isspace(*ps->s)) ps->s++;
+  start = ps->s;
 
+  for (dollar = ps->s; *dollar == '\\'; dollar++) level++;
 
-  // acquire DB connection
-  could_error_msg(cmd->temp_pool, "Database error: ", sqltemplate_db_connect(cmd->pool, cmd->server));
+  if (*dollar == '$') {
+    col = sqltpl_find_column(dollar, ps->scope, &level, &len, &rest);
+    if (col < 0) {
+      return sqltpl_expr_error(ps, "unknown column");
+    }
+    if (dollar[1] == '{' && *rest == '|') {
+      return sqltpl_expr_error(ps, "filters are not allowed in expressions");
+    }
+    ps->s = dollar + len;
+    op = sqltpl_expr_emit(ps, SQLTPL_OP_COL, 1);
+    op->level = level;
+    op->col   = col;
+    return EXPR_STRING;
+  }
 
-  sqltpl_dbinfo_t *dbinfo = get_dbinfo(cmd->pool, cmd->server);
-  debug(3, fprintf(stderr, "DBINFO: %p %p\n", dbinfo->driver, dbinfo->handle));
-  apr_status_t rv;
+  if (*ps->s == '"' || *ps->s == '\'') {
+    if (!(str = sqltpl_expr_quoted(ps))) {
+      return EXPR_ERROR;
+    }
+  } else {
+    while (*ps->s && !apr_isspace(*ps->s) && !ap_strchr_c("()!=<>&|~", *ps->s)) {
+      ps->s++;
+    }
+    if (ps->s == start) {
+      return sqltpl_expr_error(ps, "operand expected");
+    }
+    str = apr_pstrndup(ps->pool, start, ps->s - start);
+  }
 
-  // prepare the query
+  sqltpl_expr_emit(ps, SQLTPL_OP_STR, 1)->str = str;
+  return EXPR_STRING;
+}
 
-  debug(3, fprintf(stderr, "Preparing sub-pool...\n  %s\n", query));
-  // set up a sub-pool
-  apr_pool_t *prepared_pool;
-  rv = apr_pool_create(&prepared_pool, cmd->pool);
-  if (rv != APR_SUCCESS) {
-    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, cmd->server, "SQLTemplate: Failed to create memory pool");
-    return "Memory error";
+static int sqltpl_expr_regex(sqltpl_parser_t *ps, sqltpl_op_type_t type)
+{
+  const char *pattern;
+  ap_regex_t *re;
+  int flags = AP_REG_EXTENDED | AP_REG_NOSUB;
+
+  while (apr_isspace(*ps->s)) ps->s++;
+  if (*ps->s != '/' && *ps->s != '"' && *ps->s != '\'') {
+    return sqltpl_expr_error(ps, "regular expression expected");
+  }
+  if (!(pattern = sqltpl_expr_quoted(ps))) {
+    return EXPR_ERROR;
+  }
+  if (*ps->s == 'i') {
+    flags |= AP_REG_ICASE;
+    ps->s++;
   }
 
+  if (!(re = ap_pregcomp(ps->pool, pattern, flags))) {
+    return sqltpl_expr_error(ps, apr_psprintf(ps->pool,
+        "invalid regular expression /%s/", pattern));
+  }
 
-  apr_array_header_t *query_fields, *replacements, *newcontents;
-  query_fields = apr_array_make(prepared_pool, 1, sizeof(char*));
-  replacements = apr_array_make(prepared_pool, 1, sizeof(char*));
+  sqltpl_expr_emit(ps, type, 0)->re = re;
+  return EXPR_BOOL;
+}
 
-  apr_dbd_results_t *res = NULL;
-  apr_dbd_row_t *row = NULL;
+/* turn a string into a boolean, where one is needed.
+*/
+static int sqltpl_expr_bool(sqltpl_parser_t *ps, int type)
+{
+  if (type == EXPR_STRING) {
+    sqltpl_expr_emit(ps, SQLTPL_OP_TRUTH, 0);
+    type = EXPR_BOOL;
+  }
+  return type;
+}
 
-  do {
-    const char *errmsg = sqltpl_dbquery(query, query_arguments, prepared_pool, cmd->server, dbinfo, &res, query_fields);
-    if (errmsg) {
-      apr_pool_destroy(prepared_pool);
-      return errmsg;
+static int sqltpl_expr_primary(sqltpl_parser_t *ps)
+{
+  static const struct {
+    const char *token;
+    sqltpl_op_type_t type;
+  } comparisons[] = {
+    { "==", SQLTPL_OP_EQ }, { "!=", SQLTPL_OP_NE },
+    { "<=", SQLTPL_OP_LE }, { ">=", SQLTPL_OP_GE },
+    { "=~", SQLTPL_OP_MATCH }, { "!~", SQLTPL_OP_NOMATCH },
+    { "<",  SQLTPL_OP_LT }, { ">",  SQLTPL_OP_GT },
+    { NULL }
+  };
+  int i, type;
+
+  if (sqltpl_expr_accept(ps, "(")) {
+    type = sqltpl_expr_or(ps);
+    if (type != EXPR_ERROR && !sqltpl_expr_accept(ps, ")")) {
+      return sqltpl_expr_error(ps, "')' expected");
     }
-  } while (0);
-
-  apr_array_header_t *finalcontents = apr_array_make(cmd->temp_pool, 1, sizeof(char*));
-
-  for (rv = apr_dbd_get_row(dbinfo->driver, prepared_pool, res, &row, -1);
-       rv != -1;
-       rv = apr_dbd_get_row(dbinfo->driver, prepared_pool, res, &row, -1)) {
+    return type;
+  }
 
-    if (rv != 0) {
-      ap_log_error(APLOG_MARK, APLOG_ERR, rv, cmd->server, "Error retrieving results from database");
-      apr_pool_destroy(prepared_pool);
-      return "Error retrieving results";
+  if (ps->s[0] == '-' && (ps->s[1] == 'z' || ps->s[1] == 'n') && apr_isspace(ps->s[2])) {
+    type = ps->s[1] == 'z' ? SQLTPL_OP_EMPTY : SQLTPL_OP_NONEMPTY;
+    ps->s += 2;
+    if (sqltpl_expr_operand(ps) == EXPR_ERROR) {
+      return EXPR_ERROR;
     }
+    sqltpl_expr_emit(ps, type, 0);
+    return EXPR_BOOL;
+  }
 
-    debug(3, fprintf(stderr, "Clearing replacements\n"));
-#if (APU_MAJOR_VERSION < 1) || (APU_MAJOR_VERSION == 1 && APU_MINOR_VERSION < 3)
-    replacements->nelts = 0;
-#else
-    apr_array_clear(replacements);
-#endif
+  if (sqltpl_expr_operand(ps) == EXPR_ERROR) {
+    return EXPR_ERROR;
+  }
 
-    debug(2, fprintf(stderr, "Fetching entries\n"));
-    const char *ent;
-    int i;
-    for (i=0; i < query_fields->nelts; i++) {
-      ent = apr_dbd_get_entry(dbinfo->driver, row, i);
-      if (ent) {
-        char **new = apr_array_push(replacements); *new = (char *)ent;
-      } else {
-        char **new = apr_array_push(replacements); *new = apr_pstrdup(cmd->temp_pool, "");
-      }
-    }
+  for (i = 0; comparisons[i].token; i++) {
+    if (sqltpl_expr_accept(ps, comparisons[i].token)) break;
+  }
+  if (!comparisons[i].token) {
+    return EXPR_STRING;
+  }
 
-    debug(2, display_array(replacements));
+  if (comparisons[i].type == SQLTPL_OP_MATCH || comparisons[i].type == SQLTPL_OP_NOMATCH) {
+    return sqltpl_expr_regex(ps, comparisons[i].type);
+  }
 
-    debug(3, fprintf(stderr, "Before "));
-    debug(3, display_contents(contents));
+  if (sqltpl_expr_operand(ps) == EXPR_ERROR) {
+    return EXPR_ERROR;
+  }
+  sqltpl_expr_emit(ps, comparisons[i].type, -1);
+  return EXPR_BOOL;
+}
 
-    debug(4, fprintf(stderr, "processing...\n"));
+static int sqltpl_expr_unary(sqltpl_parser_t *ps)
+{
+  while (apr_isspace(*ps->s)) ps->s++;
 
-    could_error_msg(cmd->temp_pool, "Error while substituting: ", process_content(prepared_pool, contents, query_fields, replacements, NULL, &newcontents, where));
+  if (ps->s[0] == '!' && ps->s[1] != '=' && ps->s[1] != '~') {
+    ps->s++;
+    if (sqltpl_expr_bool(ps, sqltpl_expr_unary(ps)) == EXPR_ERROR) {
+      return EXPR_ERROR;
+    }
+    sqltpl_expr_emit(ps, SQLTPL_OP_NOT, 0);
+    return EXPR_BOOL;
+  }
 
-    debug(3, fprintf(stderr, "After "));
-    debug(3, display_contents(newcontents));
+  return sqltpl_expr_primary(ps);
+}
 
-    // append to final contents
-    apr_array_cat(finalcontents, newcontents);
+/* both && and ||, which short-circuit in the same way.
+*/
+static int sqltpl_expr_chain(sqltpl_parser_t *ps,
+                             const char *token,
+                             sqltpl_op_type_t jump,
+                             int (*operand)(sqltpl_parser_t *))
+{
+  int at, type = operand(ps);
 
+  if (type == EXPR_ERROR) {
+    return EXPR_ERROR;
   }
 
-  if (finalcontents->nelts) {
-    debug(1, fprintf(stderr, "Final "));
-    debug(1, display_contents(finalcontents));
+  while (sqltpl_expr_accept(ps, token)) {
+    if (sqltpl_expr_bool(ps, type) == EXPR_ERROR) {
+      return EXPR_ERROR;
+    }
+    at = ps->ops->nelts;
+    sqltpl_expr_emit(ps, jump, -1);
+    type = sqltpl_expr_bool(ps, operand(ps));
+    if (type == EXPR_ERROR) {
+      return EXPR_ERROR;
+    }
+    APR_ARRAY_IDX(ps->ops, at, sqltpl_op_t).jump = ps->ops->nelts;
+  }
 
-    /* fix??? why is it wrong? should I -- the new one? */
-    cmd->config_file->line_number++;
+  return type;
+}
 
-    cmd->config_file = make_array_config
-        (prepared_pool, finalcontents, where, cmd->config_file, &cmd->config_file);
-  } else {
-    debug(1, fprintf(stderr, "[no query results]\n"));
+static int sqltpl_expr_and(sqltpl_parser_t *ps)
+{
+  return sqltpl_expr_chain(ps, "&&", SQLTPL_OP_JFALSE, sqltpl_expr_unary);
+}
+
+static int sqltpl_expr_or(sqltpl_parser_t *ps)
+{
+  return sqltpl_expr_chain(ps, "||", SQLTPL_OP_JTRUE, sqltpl_expr_and);
+}
+
+/* compile an <SQLIf> expression against the columns in scope.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_expr_compile(apr_pool_t *p,
+                                       const char *text,
+                                       const sqltpl_scope_t *scope,
+                                       sqltpl_expr_t **pexpr)
+{
+  sqltpl_parser_t ps;
+
+  ps.pool  = p;
+  ps.s     = text;
+  ps.scope = scope;
+  ps.ops   = apr_array_make(p, 8, sizeof(sqltpl_op_t));
+  ps.depth = 0;
+  ps.error = NULL;
+
+  if (sqltpl_expr_bool(&ps, sqltpl_expr_or(&ps)) != EXPR_ERROR) {
+    while (apr_isspace(*ps.s)) ps.s++;
+    if (*ps.s) {
+      sqltpl_expr_error(&ps, "unexpected text");
+    }
+  }
+  if (ps.error) {
+    return ps.error;
   }
 
+  *pexpr = apr_palloc(p, sizeof(sqltpl_expr_t));
+  (*pexpr)->ops = ps.ops;
   return NULL;
 }
 
+/* truth value of a string: a non-zero number, "yes", "on" or "true".
+*/
+static int sqltpl_truth(const char *value)
+{
+  return (atoi(value)                      != 0 ||
+          apr_strnatcasecmp(value, "yes" ) == 0 ||
+          apr_strnatcasecmp(value, "on"  ) == 0 ||
+          apr_strnatcasecmp(value, "true") == 0
+         );
+}
 
-/* handles: <SQLCatSet "SQL statement">
+/* truth value the <SQLSimpleIf> way: empty is false, and a leading '!'
+   negates.
 */
-static const char *sqltemplate_catset_section(cmd_parms * cmd,
-    void * dummy,
-    const char * arg)
+static int sqltpl_simple_truth(const char *value)
 {
-  const char *where, *location;
-  char *query, *sep;
+  int negate = 0;
 
-  could_error(sqltpl_sec_open_check(cmd, arg));
+  if (empty_string_p(value)) {
+    /* treat empty argument as "false" */
+    return 0;
+  }
 
-  /* get seperator. */
-  sep = ap_getword_conf(cmd->temp_pool, &arg);
+  if (*value=='!') {
+    value++;
+    negate = !0;
+  }
 
+  return sqltpl_truth(value) != negate;
+}
 
-  /* get query. */
-  query = ap_getword_conf(cmd->temp_pool, &arg);
+static int sqltpl_is_number(const char *s)
+{
+  if (*s == '-' || *s == '+') s++;
+  if (!apr_isdigit(*s)) return 0;
+  while (apr_isdigit(*s)) s++;
+  if (*s == '.') {
+    s++;
+    while (apr_isdigit(*s)) s++;
+  }
+  return !*s;
+}
 
-  if (empty_string_p(query)) {
-    return "SQLCatSet definition: query not specified";
+static int sqltpl_compare(const char *a, const char *b)
+{
+  if (sqltpl_is_number(a) && sqltpl_is_number(b)) {
+    double da = strtod(a, NULL), db = strtod(b, NULL);
+    return (da > db) - (da < db);
   }
+  return strcmp(a, b);
+}
 
+static const char *sqltpl_render(sqltpl_ctx_t *ctx,
+                                 sqltpl_buf_t *buf,
+                                 const sqltpl_template_t *tpl);
 
-  /* get query arguments. */
-  location = apr_psprintf(cmd->temp_pool, "%s:%d", cmd->config_file->name, cmd->config_file->line_number);
-  where    = apr_psprintf(cmd->temp_pool, "SQLCatSet at %s:%d", cmd->config_file->name, cmd->config_file->line_number);
+/* run an expression for the current rows of ctx, which may be NULL if
+   it refers to no column. scratch is only used for templates
+   (SQLSimpleIf), and is left for the caller to truncate.
+*/
+static int sqltpl_expr_eval(sqltpl_ctx_t *ctx,
+                            const sqltpl_expr_t *expr,
+                            sqltpl_buf_t *scratch)
+{
+  sqltpl_cell_t stack[SQLTPL_EXPR_STACK];
+  const sqltpl_op_t *ops = (const sqltpl_op_t *)expr->ops->elts, *op;
+  apr_size_t start;
+  int pc, sp = 0, cmp;
+
+  for (pc = 0; pc < expr->ops->nelts; pc++) {
+    op = &ops[pc];
+    switch (op->type) {
+      case SQLTPL_OP_COL:
+        stack[sp++].s = ctx->frames[op->level][op->col];
+        break;
+      case SQLTPL_OP_STR:
+        stack[sp++].s = op->str;
+        break;
+      case SQLTPL_OP_TPL:
+        start = scratch->len;
+        /* a template of text and variables only, which cannot fail */
+        sqltpl_render(ctx, scratch, op->tpl);
+        stack[sp++].s = scratch->data + start;
+        break;
+      case SQLTPL_OP_TRUTH:
+        stack[sp-1].b = sqltpl_truth(stack[sp-1].s);
+        break;
+      case SQLTPL_OP_SIMPLE:
+        stack[sp-1].b = sqltpl_simple_truth(stack[sp-1].s);
+        break;
+      case SQLTPL_OP_EMPTY:
+        stack[sp-1].b = !*stack[sp-1].s;
+        break;
+      case SQLTPL_OP_NONEMPTY:
+        stack[sp-1].b = !!*stack[sp-1].s;
+        break;
+      case SQLTPL_OP_EQ:
+      case SQLTPL_OP_NE:
+      case SQLTPL_OP_LT:
+      case SQLTPL_OP_LE:
+      case SQLTPL_OP_GT:
+      case SQLTPL_OP_GE:
+        sp--;
+        cmp = sqltpl_compare(stack[sp-1].s, stack[sp].s);
+        stack[sp-1].b = (op->type == SQLTPL_OP_EQ) ? cmp == 0
+                      : (op->type == SQLTPL_OP_NE) ? cmp != 0
+                      : (op->type == SQLTPL_OP_LT) ? cmp <  0
+                      : (op->type == SQLTPL_OP_LE) ? cmp <= 0
+                      : (op->type == SQLTPL_OP_GT) ? cmp >  0
+                      :                              cmp >= 0;
+        break;
+      case SQLTPL_OP_MATCH:
+        stack[sp-1].b = !ap_regexec(op->re, stack[sp-1].s, 0, NULL, 0);
+        break;
+      case SQLTPL_OP_NOMATCH:
+        stack[sp-1].b = !!ap_regexec(op->re, stack[sp-1].s, 0, NULL, 0);
+        break;
+      case SQLTPL_OP_NOT:
+        stack[sp-1].b = !stack[sp-1].b;
+        break;
+      case SQLTPL_OP_JFALSE:
+      case SQLTPL_OP_JTRUE:
+        if (!stack[sp-1].b == (op->type == SQLTPL_OP_JFALSE)) {
+          pc = op->jump - 1;
+        } else {
+          sp--;
+        }
+        break;
+    }
+  }
+
+  return stack[0].b;
+}
+
+
+/* the argument of a section opening line, without the closing '>'.
+*/
+static const char *sqltpl_section_arg(apr_pool_t *p,
+                                      const char *line,
+                                      const char *token,
+                                      char **arg)
+{
+  const char *endp;
+
+  trim(line);
+  line += strlen(token);
+  endp = ap_strrchr_c(line, '>');
+  if (!endp) {
+    return apr_pstrcat(p, token, "> directive missing closing '>'", NULL);
+  }
+
+  *arg = apr_pstrndup(p, line, endp - line);
+  return NULL;
+}
+
+/* the SQL sections, indexed by sqltpl_block_type_t.
+*/
+static const struct {
+  const char *begin;
+  const char *end;
+  int nwords;              /* words before the query arguments */
+  const char *missing;
+} sqltpl_sections[] = {
+  { BEGIN_SQLRPT,    END_SQLRPT,    1,
+    "SQL repeat definition: query not specified" },
+  { BEGIN_SQLCATSET, END_SQLCATSET, 2,
+    "SQLCatSet definition: query not specified" },
+  { BEGIN_SQLGROUP,  END_SQLGROUP,  2,
+    "SQLGroup definition: key column or query not specified" },
+  { NULL }
+};
+
+/* which SQL section line begins (or ends, if end is set), or -1.
+*/
+static int sqltpl_section_type(const char *line, int end)
+{
+  int i;
+
+  for (i = 0; sqltpl_sections[i].begin; i++) {
+    if (line_starts_with_token(line, end ? sqltpl_sections[i].end
+                                         : sqltpl_sections[i].begin)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* section options, Name=value words anywhere after the query. any other
+   word is an argument of the query.
+*/
+static const char * const sqltpl_option_names[] = {
+  "Connection",            /* a SQLTemplateDBConnection name */
+  "Name",                  /* for ${name.column} in inner sections */
+  "PartitionBy",           /* SQLRepeat: integer key to cut the query on */
+  "Partitions",            /* SQLRepeat: into that many ranges */
+  "MaxItems",              /* SQLCatSet: rows per line at most */
+  "MaxBytes",              /* SQLCatSet: bytes per rendered line at most */
+  "ShardBy",               /* column deciding the SQLTemplateShard of a row */
+  "Use",                   /* a <SQLTemplateDefine> name, for the body */
+  NULL
+};
+
+/* if word is an option, record it in options and return 1.
+*/
+static int sqltpl_section_option(apr_table_t *options, const char *word)
+{
+  const char *eq = ap_strchr_c(word, '=');
+  int i;
+
+  if (!eq) return 0;
+
+  for (i = 0; sqltpl_option_names[i]; i++) {
+    if (strlen(sqltpl_option_names[i]) == (apr_size_t)(eq - word) &&
+        !strncasecmp(word, sqltpl_option_names[i], eq - word)) {
+      apr_table_setn(options, sqltpl_option_names[i], eq + 1);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static const char *sqltpl_block_make(apr_pool_t *p,
+                                     sqltpl_block_type_t type,
+                                     const char *arg,
+                                     apr_array_header_t *contents,
+                                     const sqltpl_scope_t *scope,
+                                     int lineno,
+                                     const char *where,
+                                     sqltpl_block_t **pblock);
+
+/* compile section contents against the column names of the query.
+ *
+ * variables are written ${name}, ${name|filter...} or $name, in which
+ * case the longest matching column name is used. "\$" stands for a
+ * literal "$", so that "\${name}" survives for an inner section.
+ * unrecognised variables are left alone, with a warning.
+ *
+ * <SQLIf expr> ... [<SQLElse> ...] </SQLIf> and <SQLSimpleIf value>
+ * blocks become conditional jumps, evaluated for every row. inner SQL
+ * sections become blocks, with a header compiled here and a body
+ * compiled when they first run.
+ *
+ * this is done once per section: rendering a row only walks the
+ * segments, without scanning the text again.
+ * returns an error message or NULL.
+ */
+static const char *sqltpl_compile(apr_pool_t *p,
+                                  const apr_array_header_t *contents,
+                                  const sqltpl_scope_t *scope,
+                                  sqltpl_template_t **ptpl,
+                                  const char *where)
+{
+  typedef struct {
+    int segment;      /* pending IF or JUMP */
+    int simple;       /* opened by SQLSimpleIf */
+  } open_if_t;
+
+  sqltpl_template_t *tpl = sqltpl_template_make(p);
+  apr_array_header_t *open = apr_array_make(p, 4, sizeof(open_if_t));
+  const char *line, *errmsg;
+  char *arg;
+  sqltpl_segment_t *seg;
+  open_if_t *top;
+  char **tab = (char **)contents->elts;
+  int lineno, at, type;
+
+  for (lineno = 0; lineno < contents->nelts; lineno++) {
+    line = tab[lineno];
+
+    if ((type = sqltpl_section_type(line, 0)) >= 0) {
+      /* an inner section, up to its matching end */
+      apr_array_header_t *body;
+      int first = lineno, nesting = 1;
+
+      if (scope->depth + 1 >= SQLTPL_MAX_DEPTH) {
+        return apr_psprintf(p, "SQL sections nested too deeply on line %d of %s", lineno + 1, where);
+      }
+
+      while (++lineno < contents->nelts) {
+        if (sqltpl_section_type(tab[lineno], 0) >= 0) {
+          nesting++;
+        } else if (sqltpl_section_type(tab[lineno], 1) >= 0 && !--nesting) {
+          break;
+        }
+      }
+      if (lineno == contents->nelts || sqltpl_section_type(tab[lineno], 1) != type) {
+        return apr_psprintf(p, "%s> without %s on line %d of %s",
+            sqltpl_sections[type].begin, sqltpl_sections[type].end, first + 1, where);
+      }
+
+      body = apr_array_make(p, lineno - first, sizeof(char *));
+      for (at = first + 1; at < lineno; at++) {
+        *(char **)apr_array_push(body) = tab[at];
+      }
+
+      could_error_msg(p, apr_pstrcat(p, where, ": ", NULL),
+          sqltpl_section_arg(p, line, sqltpl_sections[type].begin, &arg));
+
+      at = sqltpl_push_segment(tpl, SQLTPL_SEG_BLOCK);
+      could_error(sqltpl_block_make(p, type, arg, body, scope, first + 1, where,
+          &APR_ARRAY_IDX(tpl->segments, at, sqltpl_segment_t).block));
+      if (!open->nelts) {
+        if (!tpl->siblings) {
+          tpl->siblings = apr_array_make(p, 2, sizeof(sqltpl_block_t *));
+        }
+        *(sqltpl_block_t **)apr_array_push(tpl->siblings) =
+            APR_ARRAY_IDX(tpl->segments, at, sqltpl_segment_t).block;
+      }
+      continue;
+    } else if (line_starts_with_token(line, BEGIN_SQLIF)) {
+      could_error_msg(p, apr_pstrcat(p, where, ": ", NULL), sqltpl_section_arg(p, line, BEGIN_SQLIF, &arg));
+
+      at = sqltpl_push_segment(tpl, SQLTPL_SEG_IF);
+      errmsg = sqltpl_expr_compile(p, arg, scope,
+          &APR_ARRAY_IDX(tpl->segments, at, sqltpl_segment_t).expr);
+      if (errmsg) {
+        return apr_psprintf(p, "<SQLIf> %s on line %d of %s", errmsg, lineno + 1, where);
+      }
+
+      top = apr_array_push(open);
+      top->segment = at;
+      top->simple  = 0;
+      continue;
+    } else if (line_starts_with_token(line, BEGIN_SQLSIMPLEIF)) {
+      sqltpl_expr_t *expr = apr_palloc(p, sizeof(sqltpl_expr_t));
+      sqltpl_op_t *op;
+      const char *value;
+
+      could_error_msg(p, apr_pstrcat(p, where, ": ", NULL), sqltpl_section_arg(p, line, BEGIN_SQLSIMPLEIF, &arg));
+      value = ap_getword_conf(p, (const char **)&arg);
+      trim(arg);
+      if (*arg) {
+        return apr_psprintf(p, "<SQLSimpleIf> only takes at most one argument, on line %d of %s", lineno + 1, where);
+      }
+
+      /* render the value, then test it */
+      expr->ops = apr_array_make(p, 2, sizeof(sqltpl_op_t));
+      op = apr_array_push(expr->ops);
+      memset(op, 0, sizeof(*op));
+      op->type = SQLTPL_OP_TPL;
+      op->tpl  = sqltpl_template_make(p);
+      could_error(sqltpl_compile_text(p, op->tpl, value, scope, lineno + 1, where));
+      op = apr_array_push(expr->ops);
+      memset(op, 0, sizeof(*op));
+      op->type = SQLTPL_OP_SIMPLE;
+
+      at = sqltpl_push_segment(tpl, SQLTPL_SEG_IF);
+      APR_ARRAY_IDX(tpl->segments, at, sqltpl_segment_t).expr = expr;
+
+      top = apr_array_push(open);
+      top->segment = at;
+      top->simple  = 1;
+      continue;
+    } else if (line_starts_with_token(line, ELSE_SQLIF)) {
+      top = open->nelts ? &APR_ARRAY_IDX(open, open->nelts - 1, open_if_t) : NULL;
+      if (!top || APR_ARRAY_IDX(tpl->segments, top->segment, sqltpl_segment_t).type != SQLTPL_SEG_IF) {
+        return apr_psprintf(p, "unexpected " ELSE_SQLIF " on line %d of %s", lineno + 1, where);
+      }
+
+      at = sqltpl_push_segment(tpl, SQLTPL_SEG_JUMP);
+      APR_ARRAY_IDX(tpl->segments, top->segment, sqltpl_segment_t).jump = at + 1;
+      top->segment = at;
+      continue;
+    } else if (line_starts_with_token(line, END_SQLIF) ||
+               line_starts_with_token(line, END_SQLSIMPLEIF)) {
+      int simple = line_starts_with_token(line, END_SQLSIMPLEIF);
+
+      top = open->nelts ? &APR_ARRAY_IDX(open, open->nelts - 1, open_if_t) : NULL;
+      if (!top || top->simple != simple) {
+        return apr_psprintf(p, "unexpected %s on line %d of %s",
+            simple ? END_SQLSIMPLEIF : END_SQLIF, lineno + 1, where);
+      }
+
+      seg = &APR_ARRAY_IDX(tpl->segments, top->segment, sqltpl_segment_t);
+      seg->jump = tpl->segments->nelts;
+      apr_array_pop(open);
+      continue;
+    }
+
+    could_error(sqltpl_compile_text(p, tpl, line, scope, lineno + 1, where));
+  }
+
+  if (open->nelts) {
+    return apr_psprintf(p, "%s without %s in %s",
+        APR_ARRAY_IDX(open, 0, open_if_t).simple ? BEGIN_SQLSIMPLEIF : BEGIN_SQLIF,
+        APR_ARRAY_IDX(open, 0, open_if_t).simple ? END_SQLSIMPLEIF : END_SQLIF,
+        where);
+  }
+
+  /* sections all on the same connection are fetched one after the
+     other anyway */
+  for (at = 1; tpl->siblings && at < tpl->siblings->nelts; at++) {
+    const char *a = APR_ARRAY_IDX(tpl->siblings, 0, sqltpl_block_t *)->connection,
+               *b = APR_ARRAY_IDX(tpl->siblings, at, sqltpl_block_t *)->connection;
+    if (!a != !b || (a && strcmp(a, b))) break;
+  }
+  if (tpl->siblings && at >= tpl->siblings->nelts) {
+    tpl->siblings = NULL;
+  }
+
+  *ptpl = tpl;
+  return NULL;
+}
+
+static const char *sqltpl_block_run(sqltpl_ctx_t *ctx,
+                                    sqltpl_block_t *block,
+                                    sqltpl_buf_t *out);
+
+#if APR_HAS_THREADS
+static const char *sqltpl_fetch_siblings(sqltpl_ctx_t *ctx,
+                                         const sqltpl_template_t *tpl);
+#endif
+
+/* render a compiled template for the current rows of ctx, appending to
+   buf. filters work directly on the output, no temporary copies are
+   made. inner sections run their queries and are expanded in place.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_render(sqltpl_ctx_t *ctx,
+                                 sqltpl_buf_t *buf,
+                                 const sqltpl_template_t *tpl)
+{
+  const sqltpl_segment_t *segs = (const sqltpl_segment_t *)tpl->segments->elts, *seg;
+  const char *value;
+  apr_size_t start;
+  int i = 0, j;
+
+#if APR_HAS_THREADS
+  if (tpl->siblings) {
+    could_error(sqltpl_fetch_siblings(ctx, tpl));
+  }
+#endif
+
+  while (i < tpl->segments->nelts) {
+    seg = &segs[i++];
+    switch (seg->type) {
+      case SQLTPL_SEG_TEXT:
+        sqltpl_buf_append(buf, seg->text, seg->len);
+        break;
+
+      case SQLTPL_SEG_VAR:
+        start = buf->len;
+        value = ctx->frames[seg->level][seg->col];
+        sqltpl_buf_append(buf, value, strlen(value));
+        for (j = 0; j < seg->nfilters; j++) {
+          sqltpl_apply_filter(buf, start, &seg->filters[j]);
+        }
+        break;
+
+      case SQLTPL_SEG_IF:
+        /* the end of buf is free to use while evaluating */
+        start = buf->len;
+        if (!sqltpl_expr_eval(ctx, seg->expr, buf)) {
+          i = seg->jump;
+        }
+        buf->len = start;
+        buf->data[start] = '\0';
+        break;
+
+      case SQLTPL_SEG_JUMP:
+        i = seg->jump;
+        break;
+
+      case SQLTPL_SEG_BLOCK:
+        could_error(sqltpl_block_run(ctx, seg->block, buf));
+        break;
+    }
+  }
+
+  return NULL;
+}
+
+
+// automatic cleanup function, called on pool destruction
+static apr_status_t sqltpl_db_close(void *data) {
+  sqltpl_dbinfo_t *dbinfo = data;
+  apr_dbd_t *handle;
+  if (!dbinfo || !dbinfo->driver || !dbinfo->handle) {
+    // already freed?
+    return APR_SUCCESS;
+  } else {
+    handle = dbinfo->handle;
+    dbinfo->handle = NULL;
+    return apr_dbd_close(dbinfo->driver, handle);
+  }
+}
+
+/* statements making the server give up on a query by itself, for the
+   drivers that can: the checks made between rows cannot interrupt a
+   query that has not returned yet. they take milliseconds, 0 for none.
+*/
+static const struct {
+  const char *driver;
+  const char *statement;
+} sqltpl_timeout_statements[] = {
+  { "pgsql", "SET statement_timeout = %" APR_INT64_T_FMT },
+  { "mysql", "SET SESSION max_execution_time = %" APR_INT64_T_FMT },
+  { NULL, NULL }
+};
+
+/* apply SQLTemplateQueryTimeout to a kept connection, unless it already
+   has that one.
+*/
+static void sqltpl_db_timeout(apr_pool_t *pool, server_rec *s, sqltpl_dbinfo_t *kept)
+{
+  sqltpl_dbinfo_t *conf = get_dbinfo(pool, s);
+  int i, nrows;
+
+  if (kept->query_timeout == conf->query_timeout) {
+    return;
+  }
+
+  for (i = 0; sqltpl_timeout_statements[i].driver; i++) {
+    if (!strcasecmp(kept->driver_name, sqltpl_timeout_statements[i].driver)) {
+      if (apr_dbd_query(kept->driver, kept->handle, &nrows,
+              apr_psprintf(pool, sqltpl_timeout_statements[i].statement,
+                           (apr_int64_t)apr_time_as_msec(conf->query_timeout)))) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+            "mod_sqltemplate: Can't set a query timeout on %s: %s", kept->driver_name,
+            apr_dbd_error(kept->driver, kept->handle, 0));
+      }
+      break;
+    }
+  }
+  kept->query_timeout = conf->query_timeout;
+}
+
+/* what each pass over the configuration leaves behind, logged after
+   it so that growth from one generation to the next shows. it is kept
+   in the process pool, which outlives the module across restarts.
+*/
+typedef struct {
+  int generation;
+  apr_hash_t *kept;              /* sqltpl_dbinfo_t, the kept connections */
+  apr_hash_t *pq;                /* sqltpl_pq_t, with libpq */
+  int sections[3];               /* per sqltpl_block_type_t, this generation */
+  apr_size_t bytes[3];           /* of output left in the configuration pool */
+  int first_handles;             /* open after the first generation */
+} sqltpl_acct_t;
+
+static sqltpl_acct_t *sqltpl_acct(server_rec *s)
+{
+  apr_pool_t *ppool = s->process->pool;
+  sqltpl_acct_t *acct = NULL;
+
+  apr_pool_userdata_get((void **)&acct, "mod_sqltemplate_acct", ppool);
+  if (!acct) {
+    acct = apr_pcalloc(ppool, sizeof(sqltpl_acct_t));
+    acct->kept = apr_hash_make(ppool);
+    acct->pq   = apr_hash_make(ppool);
+    apr_pool_userdata_setn(acct, "mod_sqltemplate_acct", NULL, ppool);
+  }
+  return acct;
+}
+
+/* connections outlive the configuration pool: they are kept in the
+   process pool, one per connection name, driver and parameters, each in
+   a pool of its own. a later pass over the configuration reuses one if
+   it still answers, else it is closed and opened again. those no pass
+   uses any more are closed after it, see sqltpl_db_sweep.
+*/
+static sqltpl_dbinfo_t *sqltpl_db_kept(apr_pool_t *p, server_rec *s,
+                                       const sqltpl_dbinfo_t *dbinfo)
+{
+  apr_pool_t *ppool = s->process->pool;
+  sqltpl_dbinfo_t *kept = NULL;
+  const char *key = apr_pstrcat(p, "mod_sqltemplate_conn:", dbinfo->name ? dbinfo->name : "",
+                                "\n", dbinfo->driver_name, "\n", dbinfo->params, NULL);
+
+  apr_pool_userdata_get((void **)&kept, key, ppool);
+  if (!kept) {
+    kept = apr_pcalloc(ppool, sizeof(sqltpl_dbinfo_t));
+    key  = apr_pstrdup(ppool, key);
+    apr_pool_userdata_setn(kept, key, NULL, ppool);
+    apr_hash_set(sqltpl_acct(s)->kept, key, APR_HASH_KEY_STRING, kept);
+  }
+  return kept;
+}
+
+static const char *sqltemplate_db_connect(apr_pool_t *pool, server_rec *s,
+                                          sqltpl_dbinfo_t *dbinfo) {
+
+  sqltpl_dbinfo_t *kept;
+
+  if (!dbinfo->driver || !dbinfo->params || !*(dbinfo->params) || !dbinfo->driver_name || !*(dbinfo->driver_name)) {
+    return "Database connection not set up - please use SQLTemplateDBDriver and SQLTemplateDBParams";
+  }
+
+  debug(2, fprintf(stderr, "Driver: %p\n", dbinfo->driver));
+  debug(2, fprintf(stderr, "Handle: %p\n", dbinfo->handle));
+
+  /* unless the kept connection was opened again since: the handle
+     went with its pool */
+  if (dbinfo->handle && ((sqltpl_dbinfo_t *)dbinfo->kept)->handle == dbinfo->handle) {
+    return NULL;
+  }
+
+  kept = sqltpl_db_kept(pool, s, dbinfo);
+  kept->generation = sqltpl_acct(s)->generation + 1;
+  dbinfo->kept = kept;
+  if (kept->handle) {
+    if (apr_dbd_check_conn(kept->driver, kept->pool, kept->handle) == APR_SUCCESS) {
+      debug(2, fprintf(stderr, "Reusing connection\n"));
+      sqltpl_db_timeout(pool, s, kept);
+      dbinfo->handle = kept->handle;
+      return NULL;
+    }
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "mod_sqltemplate: reconnecting to %s", dbinfo->driver_name);
+    apr_pool_destroy(kept->pool);  // closes the handle
+    kept->pool = NULL;
+  }
+
+  apr_pool_create(&kept->pool, s->process->pool);
+  kept->driver_name = apr_pstrdup(kept->pool, dbinfo->driver_name);
+  kept->params      = apr_pstrdup(kept->pool, dbinfo->params);
+  kept->driver      = dbinfo->driver;
+  kept->query_timeout = 0;
+
+  const char *err;
+  apr_time_t traced = sqltpl_trace_start();
+  debug(3, fprintf(stderr, "Attempting connect with:\n  driver %s\n  params %s\n", dbinfo->driver_name, dbinfo->params));
+#if (APU_MAJOR_VERSION < 1) || (APU_MAJOR_VERSION == 1 && APU_MINOR_VERSION < 3)
+  apr_status_t rv = apr_dbd_open(kept->driver, kept->pool, kept->params, &kept->handle);
+#else
+  apr_status_t rv = apr_dbd_open_ex(kept->driver, kept->pool, kept->params, &kept->handle, &err);
+#endif
+  sqltpl_trace_span("connect", dbinfo->name ? dbinfo->name : dbinfo->driver_name, -1, traced);
+  debug(2, fprintf(stderr, "Connected\n"));
+  if (rv != APR_SUCCESS) {
+    kept->handle = NULL;
+    apr_pool_destroy(kept->pool);
+    kept->pool = NULL;
+    switch (rv) {
+      case APR_EGENERAL:
+          ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "mod_sqltemplate: Can't connect to %s: %s", dbinfo->driver_name, err);
+          return apr_psprintf(pool, "mod_sqltemplate: Can't connect to %s", dbinfo->driver_name);
+          break;
+      default:
+          return apr_psprintf(pool, "mod_sqltemplate: mod_sqltemplate not compatible with APR in open");
+          break;
+    }
+  }
+
+  // automatic cleanup, when the process exits or the connection is replaced
+  apr_pool_cleanup_register(kept->pool, kept, sqltpl_db_close, apr_pool_cleanup_null);
+  sqltpl_db_timeout(pool, s, kept);
+  dbinfo->handle = kept->handle;
+  return NULL;
+}
+
+
+
+/* handles: <SQLSimpleIf "truth value">
+*/
+static const char *sqltemplate_simpleif_section(cmd_parms * cmd,
+    void * dummy,
+    const char * arg)
+{
+  char *endp = ap_strrchr_c(arg, '>');
+  char *test_value;
+  if (endp == NULL) {
+    return apr_pstrcat(cmd->pool, cmd->cmd->name,
+        "> directive missing closing '>'", NULL);
+  }
+
+  if (endp) {
+    *endp = '\0';
+  }
+
+  /* get argument. */
+  test_value = ap_getword_conf(cmd->temp_pool, &arg);
+
+  trim(arg);
+  if (*arg) {
+    return "<SQLSimpleIf> only takes at most one argument";
+  }
+
+  const char *errmsg = NULL;
+  apr_array_header_t * contents=NULL;
+
+  const char *location = apr_psprintf(cmd->temp_pool,
+      "line %d of %s",
+      cmd->config_file->line_number,
+      cmd->config_file->name);
+
+  const char *where = apr_psprintf(cmd->temp_pool, "SQLSimpleIf at %s", location);
+
+  errmsg = get_lines_till_end_token(cmd->temp_pool, cmd->config_file,
+      END_SQLSIMPLEIF, BEGIN_SQLSIMPLEIF,
+      where, &contents);
+
+  if (errmsg) {
+    return apr_psprintf(cmd->temp_pool,
+        "%s\n\tcontents error: %s", where, errmsg);
+  }
+
+  debug(1, fprintf(stderr, "SQLSimpleIf at %s:\n", location));
+
+  if (sqltpl_simple_truth(test_value)) {
+    debug(1, display_contents(contents));
+    cmd->config_file = make_array_config(cmd->temp_pool, contents, where, cmd->config_file, &cmd->config_file);
+  } else {
+    debug(1, fprintf(stderr, "[ignored]\n"));
+  }
+
+  return NULL;
+}
+
+
+/* handles: <SQLIf expression> ... [<SQLElse> ...] </SQLIf>
+   outside of any SQL section, where there are no columns to refer to.
+   inside a section, these blocks are compiled with the section contents.
+*/
+static const char *sqltemplate_if_section(cmd_parms * cmd,
+    void * dummy,
+    const char * arg)
+{
+  char *endp = ap_strrchr_c(arg, '>');
+  if (endp == NULL) {
+    return apr_pstrcat(cmd->pool, cmd->cmd->name,
+        "> directive missing closing '>'", NULL);
+  }
+  *endp = '\0';
+
+  const char *errmsg = NULL;
+  apr_array_header_t * contents=NULL, * chosen;
+  sqltpl_scope_t none;
+  sqltpl_expr_t *expr;
+
+  const char *where = apr_psprintf(cmd->temp_pool, "SQLIf at line %d of %s",
+      cmd->config_file->line_number,
+      cmd->config_file->name);
+
+  none.depth = -1;
+  errmsg = sqltpl_expr_compile(cmd->temp_pool, arg, &none, &expr);
+  if (errmsg) {
+    return apr_psprintf(cmd->temp_pool, "%s: %s", where, errmsg);
+  }
+
+  errmsg = get_lines_till_end_token(cmd->temp_pool, cmd->config_file,
+      END_SQLIF, BEGIN_SQLIF,
+      where, &contents);
+
+  if (errmsg) {
+    return apr_psprintf(cmd->temp_pool,
+        "%s\n\tcontents error: %s", where, errmsg);
+  }
+
+  /* keep the lines on the chosen side of a top-level <SQLElse> */
+  int i, nesting = 0, keep = sqltpl_expr_eval(NULL, expr, NULL);
+  int in_else = 0;
+  chosen = apr_array_make(cmd->temp_pool, contents->nelts, sizeof(char *));
+
+  for (i = 0; i < contents->nelts; i++) {
+    const char *line = ((char **)contents->elts)[i];
+
+    if (line_starts_with_token(line, BEGIN_SQLIF)) {
+      nesting++;
+    } else if (line_starts_with_token(line, END_SQLIF)) {
+      nesting--;
+    } else if (!nesting && line_starts_with_token(line, ELSE_SQLIF)) {
+      if (in_else) {
+        return apr_psprintf(cmd->temp_pool, "%s: duplicate " ELSE_SQLIF, where);
+      }
+      in_else = 1;
+      continue;
+    }
+
+    if (keep != in_else) {
+      *(const char **)apr_array_push(chosen) = line;
+    }
+  }
+
+  debug(1, fprintf(stderr, "%s: %s\n", where, keep ? "true" : "false"));
+
+  if (chosen->nelts) {
+    debug(1, display_contents(chosen));
+    cmd->config_file = make_array_config(cmd->temp_pool, chosen, where, cmd->config_file, &cmd->config_file);
+  }
+
+  return NULL;
+}
+
+
+/**
+ * Check the section command ends with a ">", and consign everything after that
+ * to oblivion.
+ */
+static const char *sqltpl_sec_open_check(cmd_parms *cmd, const char *arg)
+{
+  char *endp = ap_strrchr_c(arg, '>');
+
+  if (endp == NULL) {
+    return apr_pstrcat(cmd->pool, cmd->cmd->name,
+        "> directive missing closing '>'", NULL);
+  }
+
+  /*   endp =~ s/>[^>]*$//   */
+  if (endp) {
+    *endp = '\0';
+  }
+
+  return NULL;
+}
+
+
+/* apr_dbd placeholders are printf-like: turn every ? outside quotes
+   into %s, and double any literal %. libpq wants them numbered instead,
+   $1, $2...
+*/
+static const char *sqltpl_placeholders(apr_pool_t *p, const char *query, int numbered)
+{
+  sqltpl_buf_t buf;
+  char quote = 0, num[16];
+  int n = 0;
+
+  sqltpl_buf_init(&buf, p, strlen(query) + 16);
+  for (; *query; query++) {
+    if (quote) {
+      if (*query == quote) quote = 0;
+    } else if (*query == '\'' || *query == '"') {
+      quote = *query;
+    } else if (*query == '?' && numbered) {
+      sqltpl_buf_append(&buf, num, apr_snprintf(num, sizeof(num), "$%d", ++n));
+      continue;
+    } else if (*query == '?') {
+      sqltpl_buf_append(&buf, "%s", 2);
+      continue;
+    }
+    sqltpl_buf_append(&buf, query, 1);
+    if (*query == '%' && !numbered) {
+      sqltpl_buf_append(&buf, query, 1);
+    }
+  }
+
+  return buf.data;
+}
+
+/**
+ * Perform an SQL query, and return column names if requested.
+ *
+ * @param query The SQL to execute, with a ? for every argument
+ * @param nargs The number of arguments
+ * @param args  The arguments for the query, bound through a prepared statement
+ * @param stmt  Address of the statement prepared for query; it is prepared
+ *              in stmt_pool if NULL on entry. Unused without arguments.
+ * @param random Whether to fetch all the results at once, for random access
+ * @param pool  An APR memory pool that we can use
+ * @param dbinfo Information about the database connection
+ * @param res    Address of a pointer to fill with query result; pointer may be NULL on entry.
+ * @param col_names If not NULL, this array will be filled with the query's column names
+ *
+ * @return An error message, or NULL if no error.
+ */
+static const char *sqltpl_dbquery(const char         *query,
+                                  int                 nargs,
+                                  const char        **args,
+                                  apr_dbd_prepared_t **stmt,
+                                  apr_pool_t         *stmt_pool,
+                                  int                 random,
+                                  apr_pool_t         *pool,
+                                  server_rec         *server,
+                                  sqltpl_dbinfo_t    *dbinfo,
+                                  apr_dbd_results_t **res,
+                                  apr_array_header_t *col_names
+                                 ) {
+  int rv;
+
+  if (nargs) {
+    if (!*stmt) {
+      apr_time_t traced = sqltpl_trace_start();
+      debug(2, fprintf(stderr, "Preparing query...\n  %s\n", query));
+      rv = apr_dbd_prepare(dbinfo->driver, stmt_pool, dbinfo->handle,
+                           sqltpl_placeholders(pool, query, 0), NULL, stmt);
+      sqltpl_trace_span("prepare", NULL, -1, traced);
+      if (rv) {
+        const char *dberrmsg = apr_dbd_error(dbinfo->driver, dbinfo->handle, rv);
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
+                     "Failed to prepare query: %s: %s", query,
+                     (dberrmsg ? dberrmsg : "[???]"));
+        *stmt = NULL;
+        return "Failed to prepare query";
+      }
+    }
+    rv = apr_dbd_pselect(dbinfo->driver, pool, dbinfo->handle, res, *stmt, random, nargs, args);
+  } else {
+    rv = apr_dbd_select(dbinfo->driver, pool, dbinfo->handle, res, query, random);
+  }
+
+  if (rv != 0) {
+    ap_log_error(APLOG_MARK, APLOG_ERR, 0, server, "Failed to execute query: %s", query);
+    return "Failed to execute query";
+  }
+
+  if (col_names) {
+    int i=0;
+    const char *name;
+#if (APU_MAJOR_VERSION > 1) || (APU_MAJOR_VERSION == 1 && APU_MINOR_VERSION >= 3)
+    for (name = apr_dbd_get_name(dbinfo->driver, *res, i);
+         name != NULL;
+         name = apr_dbd_get_name(dbinfo->driver, *res, ++i)) {
+      char **new = apr_array_push(col_names); *new = apr_psprintf(pool, "%s", name);
+    }
+#else
+    for (name = get_name(dbinfo->driver, pool, *res, i);
+         name != NULL;
+         name = get_name(dbinfo->driver, pool, *res, ++i)) {
+      char **new = apr_array_push(col_names); *new = apr_psprintf(pool, "%s", name);
+    }
+#endif
+    debug(2, display_array(col_names));
+  }
+
+  return NULL;
+}
+
+
+/* fetch the entries of a row into values, NULLs becoming empty strings.
+*/
+static void sqltpl_fetch_entries(sqltpl_dbinfo_t * dbinfo,
+                                 apr_dbd_row_t * row,
+                                 int nfields,
+                                 apr_array_header_t * values)
+{
+  const char *ent;
+  int i;
+
+#if (APU_MAJOR_VERSION < 1) || (APU_MAJOR_VERSION == 1 && APU_MINOR_VERSION < 3)
+  values->nelts = 0;
+#else
+  apr_array_clear(values);
+#endif
+
+  for (i=0; i < nfields; i++) {
+    ent = apr_dbd_get_entry(dbinfo->driver, row, i);
+    *(const char **)apr_array_push(values) = ent ? ent : "";
+  }
+}
+
+
+/* split the contents of a <SQLGroup> into what comes before, inside and
+   after its <SQLGroupRows> block. inner sections are left alone.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_split_group(apr_pool_t * p,
+                                      const apr_array_header_t * contents,
+                                      apr_array_header_t ** head,
+                                      apr_array_header_t ** rows,
+                                      apr_array_header_t ** tail)
+{
+  char **tab = (char **)contents->elts;
+  apr_array_header_t *current;
+  int i, nesting = 0;
+
+  *head = apr_array_make(p, contents->nelts, sizeof(char *));
+  *rows = apr_array_make(p, contents->nelts, sizeof(char *));
+  *tail = apr_array_make(p, contents->nelts, sizeof(char *));
+  current = *head;
+
+  for (i = 0; i < contents->nelts; i++) {
+    if (sqltpl_section_type(tab[i], 0) >= 0) {
+      nesting++;
+    } else if (sqltpl_section_type(tab[i], 1) >= 0) {
+      nesting--;
+    } else if (!nesting && line_starts_with_token(tab[i], BEGIN_SQLGROUPROWS)) {
+      if (current != *head) {
+        return "only one " BEGIN_SQLGROUPROWS " block is allowed";
+      }
+      current = *rows;
+      continue;
+    } else if (!nesting && line_starts_with_token(tab[i], END_SQLGROUPROWS)) {
+      if (current != *rows) {
+        return END_SQLGROUPROWS " without " BEGIN_SQLGROUPROWS;
+      }
+      current = *tail;
+      continue;
+    }
+    *(char **)apr_array_push(current) = tab[i];
+  }
+
+  if (current != *tail) {
+    return "expected a " BEGIN_SQLGROUPROWS " ... " END_SQLGROUPROWS " block";
+  }
+
+  return NULL;
+}
+
+
+/* make the block of an SQL section, from the argument of its opening
+ * line and its contents.
+ *
+ * the words of the argument are compiled against scope, that of the
+ * enclosing section, with lineno and where locating the opening line.
+ * scope is NULL for a section read by httpd, whose words are taken as
+ * they are, and where is then the description of the section.
+ * returns an error message or NULL.
+ */
+static const char *sqltpl_block_make(apr_pool_t *p,
+                                     sqltpl_block_type_t type,
+                                     const char *arg,
+                                     apr_array_header_t *contents,
+                                     const sqltpl_scope_t *scope,
+                                     int lineno,
+                                     const char *where,
+                                     sqltpl_block_t **pblock)
+{
+  sqltpl_block_t *block = apr_pcalloc(p, sizeof(sqltpl_block_t));
+  sqltpl_template_t *tpl;
+  const char *word;
+  apr_status_t rv;
+  int i;
+
+  block->type   = type;
+  block->depth  = scope ? scope->depth + 1 : 0;
+  block->where  = scope ? apr_psprintf(p, "%s on line %d of %s",
+                                       sqltpl_sections[type].begin + 1, lineno, where)
+                        : where;
+  block->header = apr_array_make(p, 4, sizeof(sqltpl_template_t *));
+  block->options = apr_table_make(p, 2);
+  block->const_query = 1;
+
+  trim(arg);
+  while (*arg) {
+    word = ap_getword_conf(p, &arg);
+    trim(arg);
+
+    /* options are taken as they are, never substituted */
+    if (block->header->nelts >= sqltpl_sections[type].nwords &&
+        sqltpl_section_option(block->options, word)) {
+      continue;
+    }
+
+    tpl  = sqltpl_template_make(p);
+    if (scope) {
+      could_error(sqltpl_compile_text(p, tpl, word, scope, lineno, where));
+    } else {
+      sqltpl_push_text(tpl, word, strlen(word));
+    }
+
+    if (block->header->nelts == sqltpl_sections[type].nwords - 1) {
+      for (i = 0; i < tpl->segments->nelts; i++) {
+        if (APR_ARRAY_IDX(tpl->segments, i, sqltpl_segment_t).type != SQLTPL_SEG_TEXT) {
+          block->const_query = 0;
+        }
+      }
+    }
+
+    *(sqltpl_template_t **)apr_array_push(block->header) = tpl;
+  }
+
+  block->connection = apr_table_get(block->options, "Connection");
+  block->name       = apr_table_get(block->options, "Name");
+  block->shard_by   = apr_table_get(block->options, "ShardBy");
+
+  if (block->header->nelts < sqltpl_sections[type].nwords) {
+    return apr_psprintf(p, "%s: %s", block->where, sqltpl_sections[type].missing);
+  }
+
+  block->partition_by = apr_table_get(block->options, "PartitionBy");
+  if ((word = apr_table_get(block->options, "Partitions")) != NULL) {
+    block->partitions = atoi(word);
+    if (block->partitions < 1) {
+      return apr_psprintf(p, "%s: Partitions must be a positive number", block->where);
+    }
+  }
+  if (!block->partition_by != !block->partitions) {
+    return apr_psprintf(p, "%s: PartitionBy and Partitions go together", block->where);
+  }
+  if (block->partitions && type != SQLTPL_BLOCK_REPEAT) {
+    return apr_psprintf(p, "%s: only SQLRepeat can be partitioned", block->where);
+  }
+
+  if ((word = apr_table_get(block->options, "MaxItems")) != NULL &&
+      (block->max_items = atoi(word)) < 1) {
+    return apr_psprintf(p, "%s: MaxItems must be a positive number", block->where);
+  }
+  if ((word = apr_table_get(block->options, "MaxBytes")) != NULL &&
+      (block->max_bytes = (apr_size_t)apr_atoi64(word)) < 1) {
+    return apr_psprintf(p, "%s: MaxBytes must be a positive number", block->where);
+  }
+  if ((block->max_items || block->max_bytes) && type != SQLTPL_BLOCK_CATSET) {
+    return apr_psprintf(p, "%s: MaxItems and MaxBytes are for SQLCatSet", block->where);
+  }
+
+  if ((word = apr_table_get(block->options, "Use")) != NULL) {
+    block->define = sqltpl_defines ? apr_hash_get(sqltpl_defines, word, APR_HASH_KEY_STRING) : NULL;
+    if (!block->define) {
+      return apr_psprintf(p, "%s: Use=%s without a <SQLTemplateDefine %s> before", block->where, word, word);
+    }
+    for (i = 0; i < contents->nelts; i++) {
+      word = APR_ARRAY_IDX(contents, i, char *);
+      trim(word);
+      if (*word && *word != '\n') {
+        return apr_psprintf(p, "%s: a section with Use= has no body of its own", block->where);
+      }
+    }
+    contents = block->define->contents;
+  }
+
+  if (type == SQLTPL_BLOCK_GROUP) {
+    could_error_msg(p, apr_pstrcat(p, block->where, ": ", NULL),
+        sqltpl_split_group(p, contents, &block->parts[0], &block->parts[1], &block->parts[2]));
+  } else {
+    block->parts[0] = contents;
+  }
+
+  rv = apr_pool_create(&block->pool, p);
+  if (rv == APR_SUCCESS) {
+    rv = apr_pool_create(&block->group_pool, p);
+  }
+  if (rv != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, NULL, "SQLTemplate: Failed to create memory pool");
+    return "Memory error";
+  }
+
+  *pblock = block;
+  return NULL;
+}
+
+static int sqltpl_same_columns(const apr_array_header_t *a,
+                               const apr_array_header_t *b)
+{
+  int i;
+
+  if (a->nelts != b->nelts) return 0;
+  for (i = 0; i < a->nelts; i++) {
+    if (strcmp(APR_ARRAY_IDX(a, i, char *), APR_ARRAY_IDX(b, i, char *))) return 0;
+  }
+  return 1;
+}
+
+/* compile the body of a block given Use=, or take the compiled form of
+   another block using it with the same column names, section names and
+   connections around.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_define_compile(sqltpl_ctx_t *ctx,
+                                         sqltpl_block_t *block,
+                                         const sqltpl_scope_t *scope)
+{
+  sqltpl_define_t *define = block->define;
+  sqltpl_compiled_t *compiled;
+  int i, j;
+
+  for (i = 0; i < define->compiled->nelts; i++) {
+    compiled = &APR_ARRAY_IDX(define->compiled, i, sqltpl_compiled_t);
+    if (compiled->type != block->type || compiled->scope.depth != scope->depth ||
+        compiled->conf != ctx->dbinfo || compiled->db != ctx->db[block->depth]) {
+      continue;
+    }
+    for (j = 0; j <= scope->depth; j++) {
+      if (!sqltpl_same_columns(compiled->scope.columns[j], scope->columns[j]) ||
+          !compiled->scope.names[j] != !scope->names[j] ||
+          (scope->names[j] && strcmp(compiled->scope.names[j], scope->names[j]))) {
+        break;
+      }
+    }
+    if (j > scope->depth) {
+      memcpy(block->tpl, compiled->tpl, sizeof(block->tpl));
+      return NULL;
+    }
+  }
+
+  compiled = apr_array_push(define->compiled);
+  memset(compiled, 0, sizeof(*compiled));
+  compiled->type  = block->type;
+  compiled->scope = *scope;
+  compiled->conf  = ctx->dbinfo;
+  compiled->db    = ctx->db[block->depth];
+  for (i = 0; i < 3 && block->parts[i]; i++) {
+    could_error_msg(ctx->pool, "Error while substituting: ",
+        sqltpl_compile(ctx->pool, block->parts[i], scope, &compiled->tpl[i], define->where));
+  }
+  memcpy(block->tpl, compiled->tpl, sizeof(block->tpl));
+
+  return NULL;
+}
+
+/* compile the body of a block against the column names of its query,
+   and those of the enclosing sections.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_block_compile(sqltpl_ctx_t *ctx,
+                                        sqltpl_block_t *block,
+                                        const apr_array_header_t *columns)
+{
+  sqltpl_scope_t scope;
+  int i;
+
+  block->columns = apr_array_make(ctx->pool, columns->nelts, sizeof(char *));
+  for (i = 0; i < columns->nelts; i++) {
+    *(char **)apr_array_push(block->columns) =
+        apr_pstrdup(ctx->pool, APR_ARRAY_IDX(columns, i, char *));
+  }
+
+  scope.depth = block->depth;
+  for (i = 0; i < block->depth; i++) {
+    scope.columns[i] = ctx->columns[i];
+    scope.names[i]   = ctx->names[i];
+  }
+  scope.columns[block->depth] = block->columns;
+  scope.names[block->depth]   = block->name;
+
+  if (block->define) {
+    return sqltpl_define_compile(ctx, block, &scope);
+  }
+
+  for (i = 0; i < 3 && block->parts[i]; i++) {
+    could_error_msg(ctx->pool, "Error while substituting: ",
+        sqltpl_compile(ctx->pool, block->parts[i], &scope, &block->tpl[i], block->where));
+  }
+
+  return NULL;
+}
+
+/* does a body hold inner sections? their queries run while the results
+   of the outer one are being read, which drivers only allow once these
+   have all been fetched.
+*/
+static int sqltpl_has_sections(const apr_array_header_t *contents)
+{
+  int i;
+
+  for (i = 0; i < contents->nelts; i++) {
+    if (sqltpl_section_type(APR_ARRAY_IDX(contents, i, char *), 0) >= 0) return 1;
+  }
+  return 0;
+}
+
+/* identical column values of the rows kept in memory share one copy.
+   a column is only interned while at most half of its values are new,
+   so that ids and the like do not fill the table for nothing.
+*/
+#define SQLTPL_INTERN_PROBE 64
+
+typedef struct {
+  apr_hash_t *values;
+  apr_pool_t *pool;
+  int *distinct;           /* per column */
+  int rows;
+  int shared;              /* values which were there already */
+  apr_size_t saved;        /* bytes those would have taken */
+} sqltpl_intern_t;
+
+static void sqltpl_intern_init(sqltpl_intern_t *in, apr_pool_t *pool, int ncols)
+{
+  in->values   = apr_hash_make(pool);
+  in->pool     = pool;
+  in->distinct = apr_pcalloc(pool, ncols * sizeof(int));
+  in->rows     = 0;
+  in->shared   = 0;
+  in->saved    = 0;
+}
+
+static const char **sqltpl_intern_row(sqltpl_intern_t *in, const char **values, int ncols)
+{
+  const char **row = apr_palloc(in->pool, ncols * sizeof(char *)), *copy;
+  apr_size_t len;
+  int i;
+
+  in->rows++;
+  for (i = 0; i < ncols; i++) {
+    len = strlen(values[i]);
+    if (in->rows > SQLTPL_INTERN_PROBE && in->distinct[i] > in->rows / 2) {
+      row[i] = apr_pstrmemdup(in->pool, values[i], len);
+    } else if ((copy = apr_hash_get(in->values, values[i], len)) != NULL) {
+      row[i] = copy;
+      in->shared++;
+      in->saved += len + 1;
+    } else {
+      row[i] = copy = apr_pstrmemdup(in->pool, values[i], len);
+      apr_hash_set(in->values, copy, len, copy);
+      in->distinct[i]++;
+    }
+  }
+
+  return row;
+}
+
+#if APR_HAS_THREADS
+
+#define SQLTPL_CHUNK_ROWS 256
+
+/* rows rendered on worker threads. the rows are cut into chunks, which
+   the workers take in turn, each rendering into its own buffer and
+   allocating from its own pool. the chunks are then put together in
+   order, so the output is the same as that of a single thread.
+*/
+typedef struct {
+  const sqltpl_template_t *tpl;
+  int depth;
+  const char * const **rows;
+  int nrows;
+  sqltpl_buf_t *chunks;
+  int nchunks;
+  volatile apr_uint32_t next;    /* next chunk to take */
+} sqltpl_parallel_t;
+
+typedef struct {
+  sqltpl_parallel_t *job;
+  sqltpl_ctx_t ctx;              /* a copy, for the frames of the worker */
+  apr_pool_t *pool;
+  apr_thread_t *thread;
+} sqltpl_worker_t;
+
+static void sqltpl_render_chunks(sqltpl_worker_t *w)
+{
+  sqltpl_parallel_t *job = w->job;
+  apr_uint32_t chunk;
+  int i, end;
+
+  while ((chunk = apr_atomic_inc32(&job->next)) < (apr_uint32_t)job->nchunks) {
+    sqltpl_buf_init(&job->chunks[chunk], w->pool, 0);
+
+    end = (chunk + 1) * SQLTPL_CHUNK_ROWS;
+    if (end > job->nrows) end = job->nrows;
+
+    for (i = chunk * SQLTPL_CHUNK_ROWS; i < end; i++) {
+      w->ctx.frames[job->depth] = job->rows[i];
+      /* no inner sections, so this cannot fail */
+      sqltpl_render(&w->ctx, &job->chunks[chunk], job->tpl);
+    }
+  }
+}
+
+static void * APR_THREAD_FUNC sqltpl_worker(apr_thread_t *thread, void *data)
+{
+  sqltpl_render_chunks(data);
+  apr_thread_exit(thread, APR_SUCCESS);
+  return NULL;
+}
+
+/* render a body without inner sections for all the rows, on up to
+   SQLTemplateThreads threads, the calling one included.
+*/
+static void sqltpl_render_parallel(sqltpl_ctx_t *ctx,
+                                   sqltpl_block_t *block,
+                                   apr_array_header_t *rows,
+                                   sqltpl_buf_t *out)
+{
+  sqltpl_parallel_t job;
+  sqltpl_worker_t *workers;
+  apr_allocator_t *allocator;
+  apr_status_t rv;
+  int i, nworkers;
+
+  job.tpl     = block->tpl[0];
+  job.depth   = block->depth;
+  job.rows    = (const char * const **)rows->elts;
+  job.nrows   = rows->nelts;
+  job.nchunks = (rows->nelts + SQLTPL_CHUNK_ROWS - 1) / SQLTPL_CHUNK_ROWS;
+  job.chunks  = apr_pcalloc(block->pool, job.nchunks * sizeof(sqltpl_buf_t));
+  job.next    = 0;
+
+  nworkers = ctx->dbinfo->threads < job.nchunks ? ctx->dbinfo->threads : job.nchunks;
+  workers  = apr_pcalloc(block->pool, nworkers * sizeof(sqltpl_worker_t));
+
+  for (i = 0; i < nworkers; i++) {
+    workers[i].job = &job;
+    workers[i].ctx = *ctx;
+
+    rv = apr_allocator_create(&allocator);
+    if (rv == APR_SUCCESS) {
+      rv = apr_pool_create_ex(&workers[i].pool, NULL, NULL, allocator);
+      if (rv == APR_SUCCESS) {
+        apr_allocator_owner_set(allocator, workers[i].pool);
+      } else {
+        apr_allocator_destroy(allocator);
+        workers[i].pool = NULL;
+      }
+    }
+    if (rv == APR_SUCCESS && i > 0) {
+      rv = apr_thread_create(&workers[i].thread, NULL, sqltpl_worker, &workers[i], block->pool);
+    }
+    if (rv != APR_SUCCESS) {
+      /* make do with the threads there are */
+      ap_log_error(APLOG_MARK, APLOG_WARNING, rv, ctx->server,
+          "SQLTemplate: could not start all rendering threads");
+      break;
+    }
+  }
+  if (!workers[0].pool) {
+    workers[0].pool = block->pool;
+  }
+
+  debug(1, fprintf(stderr, "%s: %d rows in %d chunks on up to %d threads\n",
+      block->where, job.nrows, job.nchunks, nworkers));
+
+  /* the calling thread does its share, and whatever the others cannot */
+  sqltpl_render_chunks(&workers[0]);
+  for (i = 1; i < nworkers; i++) {
+    if (workers[i].thread) {
+      apr_thread_join(&rv, workers[i].thread);
+    }
+  }
+
+  for (i = 0; i < job.nchunks; i++) {
+    sqltpl_buf_append(out, job.chunks[i].data, job.chunks[i].len);
+  }
+
+  for (i = 0; i < nworkers; i++) {
+    if (workers[i].pool && workers[i].pool != block->pool) {
+      apr_pool_destroy(workers[i].pool);
+    }
+  }
+}
+
+#endif /* APR_HAS_THREADS */
+
+/* the connection a block queries: that of its Connection= option, else
+   that of the enclosing section, else the default one of the server.
+   connections are opened when first needed.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_block_connection(sqltpl_ctx_t *ctx,
+                                           sqltpl_block_t *block,
+                                           sqltpl_dbinfo_t **pdbinfo)
+{
+  sqltpl_dbinfo_t *dbinfo;
+  const char *errmsg;
+
+  if (block->connection) {
+    dbinfo = ctx->dbinfo->named
+           ? apr_hash_get(ctx->dbinfo->named, block->connection, APR_HASH_KEY_STRING)
+           : NULL;
+    if (!dbinfo) {
+      return apr_psprintf(block->pool, "%s: no SQLTemplateDBConnection named \"%s\"",
+          block->where, block->connection);
+    }
+  } else if (block->depth) {
+    dbinfo = ctx->db[block->depth - 1];
+  } else if (ctx->dbinfo->replica) {
+    dbinfo = ctx->dbinfo->replica;
+  } else {
+    dbinfo = ctx->dbinfo;
+  }
+
+  // acquire DB connection
+  if ((errmsg = sqltemplate_db_connect(ctx->conn_pool, ctx->server, dbinfo)) != NULL) {
+    ctx->db_failed = 1;
+    return apr_pstrcat(block->pool, "Database error: ", errmsg, NULL);
+  }
+  debug(3, fprintf(stderr, "DBINFO: %p %p\n", dbinfo->driver, dbinfo->handle));
+
+  *pdbinfo = dbinfo;
+  return NULL;
+}
+
+/* the time by which a query starting now must be done: after its own
+   timeout, or at the end of the budget if that comes first. 0 for none.
+*/
+static apr_time_t sqltpl_deadline(const sqltpl_dbinfo_t *conf)
+{
+  apr_time_t deadline = conf->budget_end;
+
+  if (conf->query_timeout) {
+    apr_time_t end = apr_time_now() + conf->query_timeout;
+    if (!deadline || end < deadline) deadline = end;
+  }
+  return deadline;
+}
+
+/* returns an error message if the deadline of a query has passed.
+*/
+static const char *sqltpl_timed_out(sqltpl_ctx_t *ctx, sqltpl_block_t *block,
+                                    apr_time_t deadline)
+{
+  if (!deadline || apr_time_now() <= deadline) {
+    return NULL;
+  }
+  ctx->db_failed = 1;
+  if (deadline == ctx->dbinfo->budget_end) {
+    return apr_psprintf(block->pool, "%s: SQLTemplateTotalBudget of %" APR_INT64_T_FMT
+        " ms used up", block->where, (apr_int64_t)apr_time_as_msec(ctx->dbinfo->budget));
+  }
+  return apr_psprintf(block->pool, "%s: query took longer than SQLTemplateQueryTimeout (%"
+      APR_INT64_T_FMT " ms)", block->where, (apr_int64_t)apr_time_as_msec(ctx->dbinfo->query_timeout));
+}
+
+/* what a block carries from one row of its results to the next.
+*/
+typedef struct {
+  const char **words;            /* the opening line, rendered */
+  int ncols;
+  int keycol;                    /* SQLGroup: index of the key column */
+  sqltpl_buf_t *sets;            /* SQLCatSet: values so far, per column */
+  int items;                     /* SQLCatSet: rows in them */
+  sqltpl_buf_t line;             /* SQLCatSet: the body rendered, to measure */
+  const char **joined;           /* SQLCatSet: the values it is rendered with */
+  apr_size_t *lens;              /* SQLCatSet: of the sets before this row */
+  const char **group_values;     /* SQLGroup: the first row of the group */
+  sqltpl_buf_t *out;
+} sqltpl_run_t;
+
+/* SQLTemplateShard: whether a row, by the value of its ShardBy= column,
+   belongs to this node. the value is hashed with 32-bit FNV-1a, which
+   is stable across builds and platforms, for the share of the other
+   nodes and of the load balancer to be the same.
+*/
+static int sqltpl_shard_mine(const sqltpl_dbinfo_t *conf, const char *value)
+{
+  apr_uint32_t hash = 2166136261U;
+
+  for (; *value; value++) {
+    hash ^= (unsigned char)*value;
+    hash *= 16777619U;
+  }
+  return hash % (apr_uint32_t)conf->shard_count == (apr_uint32_t)conf->shard_index;
+}
+
+/* SQLCatSet: render the body with the values concatenated so far, and
+   start over with none.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_catset_flush(sqltpl_ctx_t *ctx,
+                                       sqltpl_block_t *block,
+                                       sqltpl_run_t *run)
+{
+  const char **rtab = apr_palloc(block->pool, run->ncols * sizeof(char *));
+  int i;
+
+  for (i = 0; i < run->ncols; i++) {
+    rtab[i] = run->sets[i].data;
+  }
+  ctx->frames[block->depth] = rtab;
+  could_error(sqltpl_render(ctx, run->out, block->tpl[0]));
+
+  for (i = 0; i < run->ncols; i++) {
+    run->sets[i].len = 0;
+    *run->sets[i].data = '\0';
+  }
+  run->items = 0;
+  return NULL;
+}
+
+/* expand a block for one row of its results.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_block_row(sqltpl_ctx_t *ctx,
+                                    sqltpl_block_t *block,
+                                    sqltpl_run_t *run,
+                                    const char **rtab)
+{
+  int i;
+
+  ctx->frames[block->depth] = rtab;
+
+  switch (block->type) {
+    case SQLTPL_BLOCK_REPEAT:
+      could_error(sqltpl_render(ctx, run->out, block->tpl[0]));
+      break;
+
+    case SQLTPL_BLOCK_CATSET:
+      /* MaxItems= and MaxBytes= cut the values into several lines.
+         MaxBytes bounds the body as rendered with them, which is
+         measured with the values of this row in: if they do not fit,
+         they start the next line. a row too long on its own still gets
+         a line of its own */
+      if (run->items && block->max_items && run->items >= block->max_items) {
+        could_error(sqltpl_catset_flush(ctx, block, run));
+        ctx->frames[block->depth] = rtab;
+      }
+      if (run->items && block->max_bytes) {
+        for (i = 0; i < run->ncols; i++) {
+          run->lens[i] = run->sets[i].len;
+          sqltpl_buf_append(&run->sets[i], run->words[0], strlen(run->words[0]));
+          sqltpl_buf_append(&run->sets[i], rtab[i], strlen(rtab[i]));
+          run->joined[i] = run->sets[i].data;
+        }
+        ctx->frames[block->depth] = run->joined;
+        run->line.len = 0;
+        could_error(sqltpl_render(ctx, &run->line, block->tpl[0]));
+        ctx->frames[block->depth] = rtab;
+        if (run->line.len <= block->max_bytes) {
+          run->items++;
+          break;
+        }
+        for (i = 0; i < run->ncols; i++) {
+          run->sets[i].len = run->lens[i];
+          run->sets[i].data[run->lens[i]] = '\0';
+        }
+        could_error(sqltpl_catset_flush(ctx, block, run));
+        ctx->frames[block->depth] = rtab;
+      }
+      run->items++;
+      for (i = 0; i < run->ncols; i++) {
+        if (run->sets[i].len) {
+          sqltpl_buf_append(&run->sets[i], run->words[0], strlen(run->words[0]));
+        }
+        sqltpl_buf_append(&run->sets[i], rtab[i], strlen(rtab[i]));
+      }
+      break;
+
+    case SQLTPL_BLOCK_GROUP:
+      if (!run->group_values || strcmp(run->group_values[run->keycol], rtab[run->keycol])) {
+        // key changed: close the previous group, open a new one
+        if (run->group_values) {
+          ctx->frames[block->depth] = run->group_values;
+          could_error(sqltpl_render(ctx, run->out, block->tpl[2]));
+        }
+
+        apr_pool_clear(block->group_pool);
+        run->group_values = apr_palloc(block->group_pool, run->ncols * sizeof(char *));
+        for (i = 0; i < run->ncols; i++) {
+          run->group_values[i] = apr_pstrdup(block->group_pool, rtab[i]);
+        }
+
+        debug(3, fprintf(stderr, "New group: \"%s\"\n", run->group_values[run->keycol]));
+        ctx->frames[block->depth] = run->group_values;
+        could_error(sqltpl_render(ctx, run->out, block->tpl[0]));
+        ctx->frames[block->depth] = rtab;
+      }
+      could_error(sqltpl_render(ctx, run->out, block->tpl[1]));
+      break;
+  }
+
+  return NULL;
+}
+
+/* render the words of the opening line of a block, for the rows of the
+   enclosing sections.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_block_words(sqltpl_ctx_t *ctx,
+                                      sqltpl_block_t *block,
+                                      apr_pool_t *p,
+                                      const char ***pwords)
+{
+  apr_array_header_t *header = block->header;
+  int nwords = sqltpl_sections[block->type].nwords;
+  sqltpl_buf_t word;
+  const char **words;
+  int i;
+
+  words = apr_palloc(p, header->nelts * sizeof(char *));
+  for (i = 0; i < header->nelts; i++) {
+    sqltpl_buf_init(&word, p, 0);
+    could_error(sqltpl_render(ctx, &word, APR_ARRAY_IDX(header, i, sqltpl_template_t *)));
+    words[i] = word.data;
+  }
+
+  if (empty_string_p(words[nwords - 1]) ||
+      (block->type == SQLTPL_BLOCK_GROUP && empty_string_p(words[0]))) {
+    return apr_psprintf(p, "%s: %s", block->where, sqltpl_sections[block->type].missing);
+  }
+
+  *pwords = words;
+  return NULL;
+}
+
+/* statements showing how the server runs a query, for the drivers that
+   have one: put before the query, with the same arguments.
+*/
+static const struct {
+  const char *driver;
+  const char *prefix;
+} sqltpl_explain_statements[] = {
+  { "pgsql",   "EXPLAIN " },
+  { "mysql",   "EXPLAIN " },
+  { "sqlite3", "EXPLAIN QUERY PLAN " },
+  { NULL, NULL }
+};
+
+/* SQLTemplateSlowQuery: log a query that took too long, with its
+   arguments, the rows it returned and its plan, asked for on the same
+   connection.
+*/
+static void sqltpl_slow_query(sqltpl_ctx_t *ctx, sqltpl_block_t *block,
+                              sqltpl_dbinfo_t *dbinfo, const char *query,
+                              int nargs, const char **args, int rows,
+                              apr_interval_time_t took)
+{
+  apr_dbd_prepared_t *stmt = NULL;
+  apr_dbd_results_t *res = NULL;
+  apr_dbd_row_t *row = NULL;
+  sqltpl_buf_t text;
+  const char *entry;
+  int i, ncols;
+
+  sqltpl_buf_init(&text, block->pool, 0);
+  for (i = 0; i < nargs; i++) {
+    sqltpl_buf_puts(&text, i ? ", " : " with ");
+    sqltpl_buf_json(&text, args[i]);
+  }
+  ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ctx->server,
+      "%s: slow query, %" APR_INT64_T_FMT " ms, %d rows: %s%s", block->where,
+      (apr_int64_t)apr_time_as_msec(took), rows, query, text.data);
+
+  for (i = 0; sqltpl_explain_statements[i].driver; i++) {
+    if (!strcasecmp(dbinfo->driver_name, sqltpl_explain_statements[i].driver)) break;
+  }
+  if (!sqltpl_explain_statements[i].driver ||
+      sqltpl_dbquery(apr_pstrcat(block->pool, sqltpl_explain_statements[i].prefix, query, NULL),
+                     nargs, args, &stmt, block->pool, 1, block->pool, ctx->server, dbinfo,
+                     &res, NULL)) {
+    return;
+  }
+
+  ncols = apr_dbd_num_cols(dbinfo->driver, res);
+  while (apr_dbd_get_row(dbinfo->driver, block->pool, res, &row, -1) == 0) {
+    sqltpl_buf_init(&text, block->pool, 0);
+    for (i = 0; i < ncols; i++) {
+      entry = apr_dbd_get_entry(dbinfo->driver, row, i);
+      if (i) sqltpl_buf_puts(&text, " ");
+      sqltpl_buf_puts(&text, entry ? entry : "");
+    }
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ctx->server, "%s: plan: %s",
+        block->where, text.data);
+  }
+}
+
+/* PartitionBy=column Partitions=N on a <SQLRepeat>: its query is cut into
+   N ranges of an integer key, between the MIN and MAX the server finds
+   for it, and the ranges are fetched at the same time, each on a
+   connection of its own. the rows are put back together in key order:
+   the query must end in ORDER BY that column, so that it gives them in
+   the same order when it is not cut. rows whose key is NULL come first
+   on every driver, whether it is cut or not.
+*/
+struct sqltpl_part_t {
+  server_rec *server;
+  sqltpl_block_t *block;
+  sqltpl_dbinfo_t *dbinfo;
+  const char *query;
+  int nargs;
+  const char **args;
+  apr_pool_t *pool;              /* its rows, kept until the block runs again */
+  apr_array_header_t *columns;
+  apr_array_header_t *rows;
+  const char *error;
+#if APR_HAS_THREADS
+  apr_thread_t *thread;
+#endif
+};
+
+static const char *sqltpl_part_fetch(sqltpl_part_t *part)
+{
+  apr_dbd_prepared_t *stmt = NULL;
+  apr_dbd_results_t *res = NULL;
+  apr_dbd_row_t *row = NULL;
+  apr_array_header_t *values;
+  sqltpl_intern_t interned;
+  apr_time_t traced = sqltpl_trace_start();
+  int rv;
+
+  could_error(sqltpl_dbquery(part->query, part->nargs, part->args, &stmt, part->pool, 0,
+      part->pool, part->server, part->dbinfo, &res, part->columns));
+  sqltpl_trace_span("query", part->block->where, part->block->depth, traced);
+  traced = sqltpl_trace_start();
+
+  values = apr_array_make(part->pool, part->columns->nelts, sizeof(char *));
+  sqltpl_intern_init(&interned, part->pool, part->columns->nelts);
+
+  for (rv = apr_dbd_get_row(part->dbinfo->driver, part->pool, res, &row, -1);
+       rv != -1;
+       rv = apr_dbd_get_row(part->dbinfo->driver, part->pool, res, &row, -1)) {
+    if (rv != 0) {
+      ap_log_error(APLOG_MARK, APLOG_ERR, rv, part->server, "Error retrieving results from database");
+      return "Error retrieving results";
+    }
+    sqltpl_fetch_entries(part->dbinfo, row, part->columns->nelts, values);
+    *(const char ***)apr_array_push(part->rows) =
+        sqltpl_intern_row(&interned, (const char **)values->elts, part->columns->nelts);
+  }
+  sqltpl_trace_span("rows", part->block->where, part->block->depth, traced);
+  return NULL;
+}
+
+/* each fetch allocates from a pool of its own, with an allocator of its
+   own, for the fetches on other threads not to share one.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_part_pool(server_rec *s, apr_pool_t *parent, apr_pool_t **pool)
+{
+  apr_allocator_t *allocator;
+  apr_status_t rv;
+
+  rv = apr_allocator_create(&allocator);
+  if (rv == APR_SUCCESS) {
+    rv = apr_pool_create_ex(pool, parent, NULL, allocator);
+    if (rv == APR_SUCCESS) {
+      apr_allocator_owner_set(allocator, *pool);
+    } else {
+      apr_allocator_destroy(allocator);
+    }
+  }
+  if (rv != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "SQLTemplate: Failed to create memory pool");
+    return "Memory error";
+  }
+  return NULL;
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC sqltpl_part_worker(apr_thread_t *thread, void *data)
+{
+  sqltpl_part_t *part = data;
+  part->error = sqltpl_part_fetch(part);
+  apr_thread_exit(thread, APR_SUCCESS);
+  return NULL;
+}
+#endif
+
+/* the first key of range i of the n cut from span keys above min. the
+   first span % n ranges get one key more than the others. the sums are
+   unsigned, so that wide ranges wrap rather than overflow.
+*/
+static apr_int64_t sqltpl_part_start(apr_int64_t min, apr_uint64_t span, int n, int i)
+{
+  apr_uint64_t k = (apr_uint64_t)i, rest = span % (apr_uint64_t)n;
+
+  return (apr_int64_t)((apr_uint64_t)min + span / (apr_uint64_t)n * k + (k < rest ? k : rest));
+}
+
+/* the last word of query before *end, which is moved back to its start */
+static const char *sqltpl_last_word(const char *query, const char **end, apr_size_t *len)
+{
+  const char *word;
+
+  while (*end > query && apr_isspace((*end)[-1])) (*end)--;
+  for (word = *end; word > query && !apr_isspace(word[-1]); word--);
+  *len = *end - word;
+  *end = word;
+  return word;
+}
+
+static int sqltpl_word_is(const char *word, apr_size_t len, const char *expected)
+{
+  return strlen(expected) == len && !strncasecmp(word, expected, len);
+}
+
+/* whether query ends in ORDER BY col, ASC or not: a partitioned query
+   must give its rows in the order the ranges put them back in.
+*/
+static int sqltpl_ordered_by(const char *query, const char *col)
+{
+  const char *end = query + strlen(query), *word;
+  apr_size_t len;
+
+  word = sqltpl_last_word(query, &end, &len);
+  if (sqltpl_word_is(word, len, "ASC")) {
+    word = sqltpl_last_word(query, &end, &len);
+  }
+  if (!sqltpl_word_is(word, len, col)) return 0;
+  word = sqltpl_last_word(query, &end, &len);
+  if (!sqltpl_word_is(word, len, "BY")) return 0;
+  word = sqltpl_last_word(query, &end, &len);
+  return sqltpl_word_is(word, len, "ORDER");
+}
+
+/* the query of a partitioned block when it is not cut into ranges: its
+   rows in the same order as when it is, with NULL keys first, which
+   pgsql otherwise puts last.
+*/
+static const char *sqltpl_partition_order(apr_pool_t *p, const char *query, const char *col)
+{
+  return apr_psprintf(p, "SELECT * FROM (%s) sqltpl_part ORDER BY (%s IS NULL) DESC, %s",
+                      query, col, col);
+}
+
+/* fetch the rows of a partitioned block into *prows, and its column
+   names into columns. *prows is left NULL when the key is not an
+   integer, or there is nothing to cut: the query then runs as usual,
+   as sqltpl_partition_order gives it.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_partitioned(sqltpl_ctx_t *ctx,
+                                      sqltpl_block_t *block,
+                                      sqltpl_dbinfo_t *dbinfo,
+                                      const char *query,
+                                      const char **words,
+                                      apr_array_header_t *columns,
+                                      apr_array_header_t **prows)
+{
+  int nwords = sqltpl_sections[block->type].nwords;
+  int nargs = block->header->nelts - nwords, n = block->partitions, i, j;
+  const char *col = block->partition_by, *bounds[2], *where, *order;
+  apr_dbd_prepared_t *stmt = NULL;
+  apr_dbd_results_t *res = NULL;
+  apr_dbd_row_t *row = NULL;
+  apr_int64_t min, max, lo, hi;
+  apr_uint64_t span;
+  apr_array_header_t *rows;
+  sqltpl_part_t *parts;
+  apr_status_t rv;
+  apr_time_t traced;
+  char *end;
+
+  *prows = NULL;
+
+  traced = sqltpl_trace_start();
+  could_error(sqltpl_dbquery(apr_psprintf(block->pool,
+      "SELECT MIN(%s), MAX(%s) FROM (%s) sqltpl_part", col, col, query),
+      nargs, words + nwords, &stmt, block->pool, 0, block->pool, ctx->server, dbinfo,
+      &res, NULL));
+  if (apr_dbd_get_row(dbinfo->driver, block->pool, res, &row, -1) != 0) {
+    return "Error retrieving results";
+  }
+  for (i = 0; i < 2; i++) {
+    bounds[i] = apr_dbd_get_entry(dbinfo->driver, row, i);
+  }
+  /* drivers want their results read to the end */
+  while (apr_dbd_get_row(dbinfo->driver, block->pool, res, &row, -1) == 0);
+  ctx->queries++;
+  sqltpl_trace_span("bounds", block->where, block->depth, traced);
+
+  if (empty_string_p(bounds[0]) || empty_string_p(bounds[1])) {
+    return NULL;
+  }
+  min = apr_strtoi64(bounds[0], &end, 10);
+  if (*end) bounds[0] = NULL;
+  max = apr_strtoi64(bounds[1], &end, 10);
+  if (*end || !bounds[0]) {
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, ctx->server,
+        "%s: PartitionBy column %s is not an integer, not partitioned", block->where, col);
+    return NULL;
+  }
+
+  span = (apr_uint64_t)max - (apr_uint64_t)min + 1;
+  if (!span) {
+    /* all 2^64 keys: one short, which the last range, open above,
+       makes up for */
+    span = ~(apr_uint64_t)0;
+  }
+  if (span < (apr_uint64_t)n) {
+    n = (int)span;
+  }
+  if (n < 2) {
+    return NULL;
+  }
+
+  parts = apr_pcalloc(block->pool, n * sizeof(sqltpl_part_t));
+  for (i = 0; i < n; i++) {
+    sqltpl_part_t *part = &parts[i];
+
+    lo = sqltpl_part_start(min, span, n, i);
+    j  = i + 1;
+    hi = sqltpl_part_start(min, span, n, j);
+    where = j < n
+          ? apr_psprintf(block->pool, "%s >= %" APR_INT64_T_FMT " AND %s < %" APR_INT64_T_FMT,
+                         col, lo, col, hi)
+          : apr_psprintf(block->pool, "%s >= %" APR_INT64_T_FMT, col, lo);
+    if (i == 0) {
+      where = apr_psprintf(block->pool, "(%s) OR %s IS NULL", where, col);
+    }
+    /* NULL keys first whatever the server's default: pgsql sorts them
+       last */
+    order = i == 0 ? apr_psprintf(block->pool, "(%s IS NULL) DESC, %s", col, col) : col;
+    part->query  = apr_psprintf(block->pool, "SELECT * FROM (%s) sqltpl_part WHERE %s ORDER BY %s",
+                                query, where, order);
+    part->server = ctx->server;
+    part->block  = block;
+    part->nargs  = nargs;
+    part->args   = words + nwords;
+
+    /* the first range on the block's connection, the others on their
+       own, kept across passes like any other */
+    if (i == 0) {
+      part->dbinfo = dbinfo;
+    } else {
+      part->dbinfo = apr_pmemdup(block->pool, dbinfo, sizeof(sqltpl_dbinfo_t));
+      part->dbinfo->handle = NULL;
+      part->dbinfo->name = apr_psprintf(ctx->pool, "%s#%d", dbinfo->name ? dbinfo->name : "", i);
+      could_error_msg(block->pool, "Database error: ",
+          sqltemplate_db_connect(ctx->conn_pool, ctx->server, part->dbinfo));
+    }
+
+    could_error(sqltpl_part_pool(ctx->server, block->pool, &part->pool));
+    part->columns = apr_array_make(part->pool, 8, sizeof(char *));
+    part->rows    = apr_array_make(part->pool, 64, sizeof(const char **));
+  }
+
+  debug(1, fprintf(stderr, "%s: %s from %" APR_INT64_T_FMT " to %" APR_INT64_T_FMT
+      " in %d partitions\n", block->where, col, min, max, n));
+
+#if APR_HAS_THREADS
+  for (i = 1; i < n; i++) {
+    if (apr_thread_create(&parts[i].thread, NULL, sqltpl_part_worker, &parts[i],
+                          block->pool) != APR_SUCCESS) {
+      /* fetched on this thread instead */
+      parts[i].thread = NULL;
+    }
+  }
+#endif
+
+  for (i = 0; i < n; i++) {
+#if APR_HAS_THREADS
+    if (parts[i].thread) {
+      apr_thread_join(&rv, parts[i].thread);
+      continue;
+    }
+#endif
+    parts[i].error = sqltpl_part_fetch(&parts[i]);
+  }
+  ctx->queries += n - 1;
+
+  for (i = 0; i < n; i++) {
+    if (parts[i].error) {
+      return parts[i].error;
+    }
+  }
+
+  rows = apr_array_make(block->pool, 64, sizeof(const char **));
+  for (i = 0; i < n; i++) {
+    apr_array_cat(rows, parts[i].rows);
+  }
+  apr_array_cat(columns, parts[0].columns);
+
+  ap_log_error(APLOG_MARK, APLOG_INFO, 0, ctx->server,
+      "%s: %d rows in %d partitions of %s", block->where, rows->nelts, n, col);
+
+  *prows = rows;
+  return NULL;
+}
+
+#if APR_HAS_THREADS
+/* the inner sections of a body do not depend on one another, only on
+   the rows of the enclosing ones: when they query different
+   connections, with Connection=, their queries are run at the same
+   time, one thread per connection, before the body is rendered for a
+   row. each then takes its rows from there when it comes to run.
+   sections partitioned, sent ahead, or on a connection already taken
+   by one before them run as usual.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_fetch_siblings(sqltpl_ctx_t *ctx,
+                                         const sqltpl_template_t *tpl)
+{
+  sqltpl_block_t *block, *other;
+  sqltpl_dbinfo_t *dbinfo;
+  sqltpl_part_t *part;
+  const char **words;
+  apr_time_t deadline = sqltpl_deadline(ctx->dbinfo);
+  apr_status_t rv;
+  int nwords, i, j;
+
+  for (i = 0; i < tpl->siblings->nelts; i++) {
+    block = APR_ARRAY_IDX(tpl->siblings, i, sqltpl_block_t *);
+    block->fetched = NULL;
+    if (block->partitions
+#ifdef SQLTPL_HAVE_LIBPQ
+        || block->ahead
+#endif
+       ) {
+      continue;
+    }
+    could_error(sqltpl_block_connection(ctx, block, &dbinfo));
+    for (j = 0; j < i; j++) {
+      other = APR_ARRAY_IDX(tpl->siblings, j, sqltpl_block_t *);
+      if (other->fetched && other->fetched->dbinfo == dbinfo) break;
+    }
+    if (j < i) {
+      continue;
+    }
+
+    if (block->fetch_pool) {
+      apr_pool_clear(block->fetch_pool);
+    } else {
+      could_error(sqltpl_part_pool(ctx->server, apr_pool_parent_get(block->pool),
+                                   &block->fetch_pool));
+    }
+    could_error(sqltpl_block_words(ctx, block, block->fetch_pool, &words));
+    nwords = sqltpl_sections[block->type].nwords;
+
+    part = apr_pcalloc(block->fetch_pool, sizeof(sqltpl_part_t));
+    part->server  = ctx->server;
+    part->block   = block;
+    part->dbinfo  = dbinfo;
+    part->query   = words[nwords - 1];
+    part->nargs   = block->header->nelts - nwords;
+    part->args    = words + nwords;
+    part->pool    = block->fetch_pool;
+    part->columns = apr_array_make(part->pool, 8, sizeof(char *));
+    part->rows    = apr_array_make(part->pool, 64, sizeof(const char **));
+    block->fetched = part;
+  }
+
+  for (i = 0; i < tpl->siblings->nelts; i++) {
+    part = APR_ARRAY_IDX(tpl->siblings, i, sqltpl_block_t *)->fetched;
+    if (part && apr_thread_create(&part->thread, NULL, sqltpl_part_worker, part,
+                                  part->pool) != APR_SUCCESS) {
+      /* fetched on this thread instead */
+      part->thread = NULL;
+    }
+  }
+  for (i = 0; i < tpl->siblings->nelts; i++) {
+    part = APR_ARRAY_IDX(tpl->siblings, i, sqltpl_block_t *)->fetched;
+    if (!part) {
+      continue;
+    }
+    if (part->thread) {
+      apr_thread_join(&rv, part->thread);
+    } else {
+      part->error = sqltpl_part_fetch(part);
+    }
+  }
+
+  for (i = 0; i < tpl->siblings->nelts; i++) {
+    block = APR_ARRAY_IDX(tpl->siblings, i, sqltpl_block_t *);
+    if (block->fetched) {
+      could_error(sqltpl_timed_out(ctx, block, deadline));
+    }
+  }
+  return NULL;
+}
+#endif
+
+#ifdef SQLTPL_HAVE_LIBPQ
+
+/* queries sent ahead. when a <SQLRepeat> has inner sections on a pgsql
+   connection, their queries are sent for all its rows at once, over
+   SQLTemplateAsyncConnections libpq connections in non-blocking mode,
+   and waited for together: the round trips overlap instead of adding
+   up. the inner sections then pick their results up as they are
+   expanded, in the usual order. other drivers keep using apr_dbd.
+*/
+
+/* the libpq connections for one set of parameters, kept in the process
+   pool across passes over the configuration like the apr_dbd ones.
+*/
+typedef struct {
+  PGconn **conns;
+  int nconns;
+  apr_interval_time_t query_timeout;   /* statement_timeout applied */
+} sqltpl_pq_t;
+
+static apr_status_t sqltpl_pq_close(void *data)
+{
+  sqltpl_pq_t *pq = data;
+  int i;
+
+  for (i = 0; i < pq->nconns; i++) {
+    if (pq->conns[i]) {
+      PQfinish(pq->conns[i]);
+      pq->conns[i] = NULL;
+    }
+  }
+  return APR_SUCCESS;
+}
+
+/* get n connections for params, opening the missing or broken ones.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_pq_connect(sqltpl_ctx_t *ctx, const char *params,
+                                     int n, sqltpl_pq_t **ppq)
+{
+  apr_pool_t *ppool = ctx->server->process->pool;
+  const char *key = apr_pstrcat(ctx->pool, "mod_sqltemplate_pq:", params, NULL);
+  sqltpl_pq_t *pq = NULL;
+  PGconn **conns;
+  PGresult *res;
+  int i;
+
+  apr_pool_userdata_get((void **)&pq, key, ppool);
+  if (!pq) {
+    pq  = apr_pcalloc(ppool, sizeof(sqltpl_pq_t));
+    key = apr_pstrdup(ppool, key);
+    apr_pool_userdata_setn(pq, key, NULL, ppool);
+    apr_hash_set(sqltpl_acct(ctx->server)->pq, key, APR_HASH_KEY_STRING, pq);
+    apr_pool_cleanup_register(ppool, pq, sqltpl_pq_close, apr_pool_cleanup_null);
+  }
+  if (pq->nconns < n) {
+    conns = apr_pcalloc(ppool, n * sizeof(PGconn *));
+    if (pq->nconns) {
+      memcpy(conns, pq->conns, pq->nconns * sizeof(PGconn *));
+    }
+    pq->conns  = conns;
+    pq->nconns = n;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (pq->conns[i] && PQstatus(pq->conns[i]) == CONNECTION_OK) {
+      continue;
+    }
+    if (pq->conns[i]) {
+      PQfinish(pq->conns[i]);
+    }
+    pq->conns[i] = PQconnectdb(params);
+    if (PQstatus(pq->conns[i]) != CONNECTION_OK) {
+      ap_log_error(APLOG_MARK, APLOG_ERR, 0, ctx->server,
+          "mod_sqltemplate: Can't connect to pgsql: %s", PQerrorMessage(pq->conns[i]));
+      PQfinish(pq->conns[i]);
+      pq->conns[i] = NULL;
+      return "mod_sqltemplate: Can't connect to pgsql";
+    }
+    if (pq->query_timeout) {
+      pq->query_timeout = -1;    /* a new one has the default */
+    }
+  }
+
+  /* the same timeout as the apr_dbd connections */
+  if (pq->query_timeout != ctx->dbinfo->query_timeout) {
+    for (i = 0; i < pq->nconns; i++) {
+      if (!pq->conns[i]) continue;
+      res = PQexec(pq->conns[i], apr_psprintf(ctx->pool, "SET statement_timeout = %"
+                   APR_INT64_T_FMT, (apr_int64_t)apr_time_as_msec(ctx->dbinfo->query_timeout)));
+      PQclear(res);
+    }
+    pq->query_timeout = ctx->dbinfo->query_timeout;
+  }
+
+  for (i = 0; i < n; i++) {
+    PQsetnonblocking(pq->conns[i], 1);
+  }
+
+  *ppq = pq;
+  return NULL;
+}
+
+static apr_status_t sqltpl_pq_clear(void *data)
+{
+  sqltpl_block_t *block = data;
+  int i;
+
+  for (i = 0; i < block->nahead; i++) {
+    if (block->ahead[i]) {
+      PQclear(block->ahead[i]);
+    }
+  }
+  block->ahead  = NULL;
+  block->nahead = 0;
+  return APR_SUCCESS;
+}
+
+/* the inner sections of a block whose queries can be sent ahead, or NULL.
+*/
+static apr_array_header_t *sqltpl_pq_children(sqltpl_ctx_t *ctx,
+                                              sqltpl_block_t *block)
+{
+  const sqltpl_segment_t *segs;
+  apr_array_header_t *children = NULL;
+  sqltpl_dbinfo_t *dbinfo;
+  int i;
+
+  if (!ctx->dbinfo->async || block->type != SQLTPL_BLOCK_REPEAT) {
+    return NULL;
+  }
+
+  segs = (const sqltpl_segment_t *)block->tpl[0]->segments->elts;
+  for (i = 0; i < block->tpl[0]->segments->nelts; i++) {
+    if (segs[i].type != SQLTPL_SEG_BLOCK ||
+        sqltpl_block_connection(ctx, segs[i].block, &dbinfo) ||
+        strcasecmp(dbinfo->driver_name, "pgsql")) {
+      continue;
+    }
+    if (!children) {
+      children = apr_array_make(block->pool, 2, sizeof(sqltpl_block_t *));
+    }
+    *(sqltpl_block_t **)apr_array_push(children) = segs[i].block;
+  }
+
+  return children;
+}
+
+/* send the query of an inner section for all the rows of a block over
+   n connections, and wait for the results.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_pq_batch(sqltpl_ctx_t *ctx,
+                                   sqltpl_block_t *block,
+                                   sqltpl_block_t *child,
+                                   sqltpl_pq_t *pq, int n,
+                                   apr_array_header_t *rows)
+{
+  int nwords = sqltpl_sections[child->type].nwords;
+  apr_socket_t **socks;
+  apr_pollfd_t *pfds;
+  apr_os_sock_t fd;
+  apr_time_t deadline;
+  apr_interval_time_t wait;
+  apr_int32_t nready;
+  apr_status_t rv;
+  PGresult *res;
+  const char **words, *query;
+  int *busy;
+  int i, next, done, npoll;
+
+  busy  = apr_palloc(block->pool, n * sizeof(int));
+  socks = apr_pcalloc(block->pool, n * sizeof(apr_socket_t *));
+  pfds  = apr_pcalloc(block->pool, n * sizeof(apr_pollfd_t));
+  for (i = 0; i < n; i++) {
+    busy[i] = -1;
+    fd = PQsocket(pq->conns[i]);
+    apr_os_sock_put(&socks[i], &fd, block->pool);
+  }
+
+  deadline = sqltpl_deadline(ctx->dbinfo);
+  next = done = 0;
+  while (done < rows->nelts) {
+    /* keep every connection busy */
+    for (i = 0; i < n && next < rows->nelts; i++) {
+      if (busy[i] >= 0) continue;
+
+      ctx->frames[block->depth] = APR_ARRAY_IDX(rows, next, const char **);
+      could_error(sqltpl_block_words(ctx, child, block->pool, &words));
+      query = sqltpl_placeholders(block->pool, words[nwords - 1], 1);
+      if (!PQsendQueryParams(pq->conns[i], query, child->header->nelts - nwords,
+                             NULL, words + nwords, NULL, NULL, 0)) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ctx->server, "Failed to send query: %s: %s",
+            words[nwords - 1], PQerrorMessage(pq->conns[i]));
+        return "Failed to execute query";
+      }
+      busy[i] = next++;
+    }
+
+    /* wait for any of them to have something */
+    npoll = 0;
+    for (i = 0; i < n; i++) {
+      if (busy[i] < 0) continue;
+      pfds[npoll].p         = block->pool;
+      pfds[npoll].desc_type = APR_POLL_SOCKET;
+      pfds[npoll].desc.s    = socks[i];
+      pfds[npoll].reqevents = APR_POLLIN | (PQflush(pq->conns[i]) ? APR_POLLOUT : 0);
+      npoll++;
+    }
+    wait = deadline ? deadline - apr_time_now() : -1;
+    if (deadline && wait < 0) wait = 0;
+    rv = apr_poll(pfds, npoll, &nready, wait);
+    if (APR_STATUS_IS_TIMEUP(rv)) {
+      could_error(sqltpl_timed_out(ctx, child, deadline));
+    }
+
+    for (i = 0; i < n; i++) {
+      if (busy[i] < 0) continue;
+      if (!PQconsumeInput(pq->conns[i])) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ctx->server, "Error retrieving results from database: %s",
+            PQerrorMessage(pq->conns[i]));
+        return "Error retrieving results";
+      }
+      while (!PQisBusy(pq->conns[i])) {
+        if (!(res = PQgetResult(pq->conns[i]))) {
+          busy[i] = -1;
+          done++;
+          break;
+        }
+        if (child->ahead[busy[i]]) {
+          PQclear(res);
+        } else {
+          child->ahead[busy[i]] = res;
+        }
+      }
+    }
+  }
+
+  debug(1, fprintf(stderr, "%s: %d queries sent ahead on %d connections\n",
+      child->where, rows->nelts, n));
+  return NULL;
+}
+
+/* send the queries of the inner sections of a block for all its rows.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_pq_send_ahead(sqltpl_ctx_t *ctx,
+                                        sqltpl_block_t *block,
+                                        apr_array_header_t *children,
+                                        apr_array_header_t *rows)
+{
+  sqltpl_block_t *child;
+  sqltpl_dbinfo_t *dbinfo;
+  sqltpl_pq_t *pq;
+  const char *errmsg;
+  int c, i, n;
+
+  for (c = 0; c < children->nelts; c++) {
+    child = APR_ARRAY_IDX(children, c, sqltpl_block_t *);
+
+    could_error(sqltpl_block_connection(ctx, child, &dbinfo));
+    n = ctx->dbinfo->async < rows->nelts ? ctx->dbinfo->async : rows->nelts;
+    could_error(sqltpl_pq_connect(ctx, dbinfo->params, n, &pq));
+
+    child->ahead  = apr_pcalloc(block->pool, rows->nelts * sizeof(PGresult *));
+    child->nahead = rows->nelts;
+    apr_pool_cleanup_register(block->pool, child, sqltpl_pq_clear, apr_pool_cleanup_null);
+
+    errmsg = sqltpl_pq_batch(ctx, block, child, pq, n, rows);
+    if (errmsg) {
+      /* drop the connections with a query still going */
+      for (i = 0; i < n; i++) {
+        if (PQtransactionStatus(pq->conns[i]) == PQTRANS_ACTIVE) {
+          PQfinish(pq->conns[i]);
+          pq->conns[i] = NULL;
+        }
+      }
+      return errmsg;
+    }
+  }
+
+  return NULL;
+}
+
+/* the columns and rows of a query sent ahead, for the current row of
+   the enclosing block. they point into the libpq result.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_pq_results(sqltpl_ctx_t *ctx,
+                                     sqltpl_block_t *block,
+                                     apr_array_header_t *columns,
+                                     apr_array_header_t **prows)
+{
+  PGresult *res = block->ahead[ctx->rowno[block->depth - 1]];
+  apr_array_header_t *rows;
+  const char **rtab;
+  int i, j, nrows, ncols;
+
+  if (!res || PQresultStatus(res) != PGRES_TUPLES_OK) {
+    ap_log_error(APLOG_MARK, APLOG_ERR, 0, ctx->server, "%s: Failed to execute query: %s",
+        block->where, res ? PQresultErrorMessage(res) : "no result");
+    return "Failed to execute query";
+  }
+
+  nrows = PQntuples(res);
+  ncols = PQnfields(res);
+  for (i = 0; i < ncols; i++) {
+    *(const char **)apr_array_push(columns) = PQfname(res, i);
+  }
+
+  rows = apr_array_make(block->pool, nrows ? nrows : 1, sizeof(const char **));
+  for (i = 0; i < nrows; i++) {
+    rtab = apr_palloc(block->pool, ncols * sizeof(char *));
+    for (j = 0; j < ncols; j++) {
+      /* NULLs are empty strings already */
+      rtab[j] = PQgetvalue(res, i, j);
+    }
+    *(const char ***)apr_array_push(rows) = rtab;
+  }
+
+  *prows = rows;
+  return NULL;
+}
+
+#endif /* SQLTPL_HAVE_LIBPQ */
+
+/* save the output of a section or the results of a query, through a
+   temporary file so that a crash never leaves half of it behind. what
+   is saved is read back as configuration, so only its owner may read
+   or write it, whatever mode apr_file_mktemp gave the file.
+*/
+static void sqltpl_file_save(apr_pool_t *p, server_rec *s,
+                             const char *path, const sqltpl_buf_t *output)
+{
+  char *tmp = apr_pstrcat(p, path, ".XXXXXX", NULL);
+  apr_file_t *file;
+  apr_status_t rv;
+
+  rv = apr_file_mktemp(&file, tmp, APR_FOPEN_CREATE | APR_FOPEN_WRITE | APR_FOPEN_EXCL, p);
+  if (rv == APR_SUCCESS) {
+    rv = apr_file_perms_set(tmp, APR_FPROT_UREAD | APR_FPROT_UWRITE);
+    if (rv == APR_SUCCESS || APR_STATUS_IS_ENOTIMPL(rv)) {
+      rv = apr_file_write_full(file, output->data, output->len, NULL);
+    }
+    apr_file_close(file);
+    if (rv == APR_SUCCESS) {
+      rv = apr_file_rename(tmp, path, p);
+    }
+    if (rv != APR_SUCCESS) {
+      apr_file_remove(tmp, p);
+    }
+  }
+  if (rv != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "mod_sqltemplate: Can't save %s", path);
+  }
+}
+
+/* SQLTemplateSharedCache: results of queries kept in files, for the
+   httpd instances of a host to run each query once between them. a
+   file is named after a hash of the connection, query and arguments,
+   and used while younger than the age given. the instance that finds
+   none runs the query under a lock on the file, while the others wait
+   for it and read what it wrote. a file holds a magic string, the
+   number of columns and rows, then the column names and the values,
+   each as a length and the NUL-terminated bytes, which are used in
+   place once read back.
+
+   only the outermost sections use it: the inner ones run once for each
+   row around them, and would leave as many files. the rows of a query
+   are all kept in memory to be written out, rather than expanded as
+   they come from the database. what the files hold is expanded as
+   configuration, so sqltemplate_shared_cache wants a directory only
+   the user reading the configuration can write to.
+*/
+#define SQLTPL_SHARED_MAGIC "SQLTPLR1"
+
+static const char *sqltpl_shared_path(apr_pool_t *p, const char *dir,
+                                      const sqltpl_dbinfo_t *dbinfo,
+                                      const char *query, int nargs,
+                                      const char **args)
+{
+  apr_md5_ctx_t md5;
+  unsigned char digest[APR_MD5_DIGESTSIZE];
+  char hex[2 * APR_MD5_DIGESTSIZE + 1];
+  int i;
+
+  apr_md5_init(&md5);
+  apr_md5_update(&md5, dbinfo->driver_name, strlen(dbinfo->driver_name) + 1);
+  apr_md5_update(&md5, dbinfo->params, strlen(dbinfo->params) + 1);
+  apr_md5_update(&md5, query, strlen(query) + 1);
+  for (i = 0; i < nargs; i++) {
+    apr_md5_update(&md5, args[i], strlen(args[i]) + 1);
+  }
+  apr_md5_final(digest, &md5);
+  ap_bin2hex(digest, APR_MD5_DIGESTSIZE, hex);
+
+  return apr_pstrcat(p, dir, "/sqltemplate-", hex, ".rows", NULL);
+}
+
+static void sqltpl_shared_put(sqltpl_buf_t *buf, const char *value)
+{
+  apr_uint32_t len = (apr_uint32_t)strlen(value);
+
+  sqltpl_buf_append(buf, (const char *)&len, sizeof(len));
+  sqltpl_buf_append(buf, value, len + 1);
+}
+
+static const char *sqltpl_shared_get(const char **pos, const char *end)
+{
+  const char *value;
+  apr_uint32_t len;
+
+  if (end - *pos < (long)sizeof(len)) return NULL;
+  memcpy(&len, *pos, sizeof(len));
+  value = *pos + sizeof(len);
+  if (end - value < (long)len + 1 || value[len]) return NULL;
+  *pos = value + len + 1;
+  return value;
+}
+
+/* read the results kept in path into columns and rows, if it is there,
+   young enough and whole.
+*/
+static apr_status_t sqltpl_shared_load(apr_pool_t *p, const char *path,
+                                       apr_interval_time_t age,
+                                       apr_array_header_t *columns,
+                                       apr_array_header_t **prows)
+{
+  apr_file_t *file;
+  apr_finfo_t finfo;
+  apr_status_t rv;
+  apr_array_header_t *rows;
+  apr_uint32_t counts[2], i, j;
+  const char *pos, *end, **row;
+  char *data;
+
+  rv = apr_file_open(&file, path, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT, p);
+  if (rv != APR_SUCCESS) {
+    return rv;
+  }
+  rv = apr_file_info_get(&finfo, APR_FINFO_SIZE | APR_FINFO_MTIME, file);
+  if (rv == APR_SUCCESS && apr_time_now() - finfo.mtime > age) {
+    rv = APR_EOF;
+  }
+  if (rv == APR_SUCCESS) {
+    data = apr_palloc(p, (apr_size_t)finfo.size + 1);
+    rv = apr_file_read_full(file, data, (apr_size_t)finfo.size, NULL);
+  }
+  apr_file_close(file);
+  if (rv != APR_SUCCESS) {
+    return rv;
+  }
+
+  pos = data;
+  end = data + finfo.size;
+  if (finfo.size < (apr_off_t)(sizeof(SQLTPL_SHARED_MAGIC) - 1 + sizeof(counts)) ||
+      memcmp(pos, SQLTPL_SHARED_MAGIC, sizeof(SQLTPL_SHARED_MAGIC) - 1)) {
+    return APR_EOF;
+  }
+  pos += sizeof(SQLTPL_SHARED_MAGIC) - 1;
+  memcpy(counts, pos, sizeof(counts));
+  pos += sizeof(counts);
+
+  for (i = 0; i < counts[0]; i++) {
+    if (!(*(const char **)apr_array_push(columns) = sqltpl_shared_get(&pos, end))) {
+      return APR_EOF;
+    }
+  }
+  rows = apr_array_make(p, counts[1] ? counts[1] : 1, sizeof(const char **));
+  for (i = 0; i < counts[1]; i++) {
+    row = apr_palloc(p, counts[0] * sizeof(char *));
+    for (j = 0; j < counts[0]; j++) {
+      if (!(row[j] = sqltpl_shared_get(&pos, end))) {
+        return APR_EOF;
+      }
+    }
+    *(const char ***)apr_array_push(rows) = row;
+  }
+
+  *prows = rows;
+  return APR_SUCCESS;
+}
+
+/* fetch the results of the query of a block into columns and *prows,
+   from the file of another instance, or else from the database, then
+   leaving a file for the others.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_shared_fetch(sqltpl_ctx_t *ctx,
+                                       sqltpl_block_t *block,
+                                       sqltpl_dbinfo_t *dbinfo,
+                                       const char **words,
+                                       apr_array_header_t *columns,
+                                       apr_array_header_t **prows)
+{
+  sqltpl_dbinfo_t *conf = ctx->dbinfo;
+  int nwords = sqltpl_sections[block->type].nwords;
+  int nargs = block->header->nelts - nwords, i, rv;
+  const char *query = words[nwords - 1], *path, *lockpath, *errmsg;
+  apr_dbd_results_t *res = NULL;
+  apr_dbd_row_t *row = NULL;
+  apr_array_header_t *rows, *values;
+  apr_file_t *lock = NULL;
+  apr_uint32_t counts[2];
+  sqltpl_intern_t interned;
+  sqltpl_buf_t out;
+
+  path = sqltpl_shared_path(block->pool, conf->shared_cache, dbinfo, query, nargs, words + nwords);
+  if (sqltpl_shared_load(block->pool, path, conf->shared_age, columns, prows) == APR_SUCCESS) {
+    return NULL;
+  }
+  apr_array_clear(columns);
+
+  /* one instance queries, the others wait for its results */
+  lockpath = apr_pstrcat(block->pool, path, ".lock", NULL);
+  if (apr_file_open(&lock, lockpath, APR_FOPEN_CREATE | APR_FOPEN_WRITE,
+                    APR_FPROT_UREAD | APR_FPROT_UWRITE, block->pool) == APR_SUCCESS) {
+    if (apr_file_lock(lock, APR_FLOCK_EXCLUSIVE) != APR_SUCCESS) {
+      apr_file_close(lock);
+      lock = NULL;
+    } else if (sqltpl_shared_load(block->pool, path, conf->shared_age, columns, prows) == APR_SUCCESS) {
+      apr_file_close(lock);
+      return NULL;
+    } else {
+      apr_array_clear(columns);
+    }
+  }
+
+  errmsg = sqltpl_dbquery(query, nargs, words + nwords, &block->stmt,
+      block->const_query ? ctx->pool : block->pool, 0, block->pool, ctx->server, dbinfo,
+      &res, columns);
+
+  rows = apr_array_make(block->pool, 64, sizeof(const char **));
+  values = apr_array_make(block->pool, columns->nelts, sizeof(char *));
+  sqltpl_intern_init(&interned, block->pool, columns->nelts);
+  for (rv = errmsg ? -1 : apr_dbd_get_row(dbinfo->driver, block->pool, res, &row, -1);
+       rv != -1;
+       rv = apr_dbd_get_row(dbinfo->driver, block->pool, res, &row, -1)) {
+    if (rv != 0) {
+      ap_log_error(APLOG_MARK, APLOG_ERR, rv, ctx->server, "Error retrieving results from database");
+      errmsg = "Error retrieving results";
+      break;
+    }
+    sqltpl_fetch_entries(dbinfo, row, columns->nelts, values);
+    *(const char ***)apr_array_push(rows) =
+        sqltpl_intern_row(&interned, (const char **)values->elts, columns->nelts);
+  }
+
+  if (!errmsg) {
+    sqltpl_buf_init(&out, block->pool, 0);
+    sqltpl_buf_puts(&out, SQLTPL_SHARED_MAGIC);
+    counts[0] = columns->nelts;
+    counts[1] = rows->nelts;
+    sqltpl_buf_append(&out, (const char *)counts, sizeof(counts));
+    for (i = 0; i < columns->nelts; i++) {
+      sqltpl_shared_put(&out, APR_ARRAY_IDX(columns, i, char *));
+    }
+    for (rv = 0; rv < rows->nelts; rv++) {
+      for (i = 0; i < columns->nelts; i++) {
+        sqltpl_shared_put(&out, APR_ARRAY_IDX(rows, rv, const char **)[i]);
+      }
+    }
+    sqltpl_file_save(block->pool, ctx->server, path, &out);
+    *prows = rows;
+  }
+
+  if (lock) {
+    /* those waiting on it read the results once it goes, the others
+       find them without it */
+    apr_file_remove(lockpath, block->pool);
+    apr_file_close(lock);
+  }
+  return errmsg;
+}
+
+/* SQLTemplateExport: the rows of the sections given Name=, kept in the
+   configuration pool for other modules, see mod_sqltemplate.h.
+*/
+typedef struct {
+  sqltemplate_table_t table;
+  apr_array_header_t *rows;      /* const char **, what table.rows shows */
+} sqltpl_export_t;
+
+/* by Name=, when SQLTemplateExport is on */
+static apr_hash_t *sqltpl_exports;
+
+static apr_status_t sqltpl_exports_reset(void *data)
+{
+  sqltpl_exports = NULL;
+  return APR_SUCCESS;
+}
+
+/* the table the rows of a named block go to, made on its first run, or
+   NULL if another section with the same name filled it with other
+   columns.
+*/
+static sqltpl_export_t *sqltpl_export_table(sqltpl_ctx_t *ctx,
+                                            sqltpl_block_t *block,
+                                            const apr_array_header_t *columns)
+{
+  apr_pool_t *p = apr_hash_pool_get(sqltpl_exports);
+  sqltpl_export_t *export = apr_hash_get(sqltpl_exports, block->name, APR_HASH_KEY_STRING);
+  const char **names;
+  int i;
+
+  if (export) {
+    for (i = 0; i < columns->nelts && export->table.ncols == columns->nelts; i++) {
+      if (strcmp(export->table.columns[i], APR_ARRAY_IDX(columns, i, char *))) break;
+    }
+    if (i < columns->nelts || export->table.ncols != columns->nelts) {
+      ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ctx->server,
+          "%s: Name=%s was exported with other columns, these rows are not",
+          block->where, block->name);
+      return NULL;
+    }
+    return export;
+  }
+
+  export = apr_pcalloc(p, sizeof(sqltpl_export_t));
+  export->table.name  = apr_pstrdup(p, block->name);
+  export->table.ncols = columns->nelts;
+  names = apr_palloc(p, (columns->nelts + 1) * sizeof(char *));
+  for (i = 0; i < columns->nelts; i++) {
+    names[i] = apr_pstrdup(p, APR_ARRAY_IDX(columns, i, char *));
+  }
+  export->table.columns = names;
+  export->table.index = apr_hash_make(p);
+  export->rows = apr_array_make(p, 64, sizeof(const char **));
+  apr_hash_set(sqltpl_exports, export->table.name, APR_HASH_KEY_STRING, export);
+
+  return export;
+}
+
+static void sqltpl_export_row(sqltpl_export_t *export, const char * const *rtab)
+{
+  apr_pool_t *p = apr_hash_pool_get(sqltpl_exports);
+  const char **row = apr_palloc(p, (export->table.ncols + 1) * sizeof(char *));
+  int i;
+
+  for (i = 0; i < export->table.ncols; i++) {
+    row[i] = apr_pstrdup(p, rtab[i]);
+  }
+  *(const char ***)apr_array_push(export->rows) = row;
+
+  /* the array may have moved */
+  export->table.rows  = (const char * const * const *)export->rows->elts;
+  export->table.nrows = export->rows->nelts;
+
+  if (export->table.ncols && !apr_hash_get(export->table.index, row[0], APR_HASH_KEY_STRING)) {
+    apr_hash_set(export->table.index, row[0], APR_HASH_KEY_STRING, row);
+  }
+}
+
+static const sqltemplate_table_t *sqltemplate_table(const char *name)
+{
+  sqltpl_export_t *export = sqltpl_exports
+                          ? apr_hash_get(sqltpl_exports, name, APR_HASH_KEY_STRING) : NULL;
+
+  return export ? &export->table : NULL;
+}
+
+static const char * const *sqltemplate_lookup(const char *name, const char *key)
+{
+  const sqltemplate_table_t *table = sqltemplate_table(name);
+
+  return table ? apr_hash_get(table->index, key, APR_HASH_KEY_STRING) : NULL;
+}
+
+/* run the query of a block for the current rows of the enclosing
+   sections, and expand its body for the results, appending to out.
+   rows are expanded as they come, or kept in memory first when they are
+   to be rendered on several threads or when the queries of inner
+   sections are sent ahead for all of them.
+   returns an error message or NULL.
+*/
+static const char *sqltpl_block_run(sqltpl_ctx_t *ctx,
+                                    sqltpl_block_t *block,
+                                    sqltpl_buf_t *out)
+{
+  sqltpl_dbinfo_t *dbinfo;
+  apr_array_header_t *header = block->header, *columns, *values, *rows = NULL;
+  apr_dbd_results_t *res = NULL;
+  apr_dbd_row_t *row = NULL;
+  sqltpl_intern_t interned;
+  sqltpl_run_t run;
+  const char **words, **rtab, *query = NULL;
+  int nwords = sqltpl_sections[block->type].nwords;
+  int i, rv, random, parallel = 0, rowcount = 0, shardcol;
+  sqltpl_export_t *export = NULL;
+  apr_time_t deadline, traced, queried = 0;
+  apr_interval_time_t took = 0;
+#ifdef SQLTPL_HAVE_LIBPQ
+  apr_array_header_t *ahead = NULL;
+#endif
+
+  apr_pool_clear(block->pool);
+
+  could_error(sqltpl_block_words(ctx, block, block->pool, &words));
+
+  debug(2, fprintf(stderr, "%s query: %s\n", block->where, words[nwords - 1]));
+
+  could_error(sqltpl_block_connection(ctx, block, &dbinfo));
+  ctx->db[block->depth] = dbinfo;
+
+  if (!block->const_query) {
+    block->stmt = NULL;
+  }
+
+  random = 0;
+  for (i = 0; i < 3 && block->parts[i]; i++) {
+    random |= sqltpl_has_sections(block->parts[i]);
+  }
+
+#if APR_HAS_THREADS
+  /* without inner sections, rows can be rendered on other threads */
+  parallel = block->type == SQLTPL_BLOCK_REPEAT && !random && ctx->dbinfo->threads > 1;
+#endif
+
+  columns = apr_array_make(block->pool, 8, sizeof(char *));
+  deadline = sqltpl_deadline(ctx->dbinfo);
+#if APR_HAS_THREADS
+  if (block->fetched) {
+    /* fetched along with the sections next to it */
+    sqltpl_part_t *part = block->fetched;
+
+    block->fetched = NULL;
+    could_fail_db(ctx, part->error);
+    apr_array_cat(columns, part->columns);
+    rows = part->rows;
+  } else
+#endif
+#ifdef SQLTPL_HAVE_LIBPQ
+  if (block->ahead) {
+    /* the enclosing section sent the query already */
+    could_fail_db(ctx, sqltpl_pq_results(ctx, block, columns, &rows));
+  } else
+#endif
+  if (block->partition_by) {
+    const char *end = words[nwords - 1] + strlen(words[nwords - 1]);
+
+    /* it goes in a subquery: no closing semicolon */
+    while (end > words[nwords - 1] && (apr_isspace(end[-1]) || end[-1] == ';')) end--;
+    query = apr_pstrmemdup(block->pool, words[nwords - 1], end - words[nwords - 1]);
+    if (!sqltpl_ordered_by(query, block->partition_by)) {
+      return apr_psprintf(block->pool, "%s: with PartitionBy=%s, the query must end in "
+          "ORDER BY %s", block->where, block->partition_by, block->partition_by);
+    }
+    /* the order the ranges give, whichever way the rows come */
+    words[nwords - 1] = sqltpl_partition_order(block->pool, query, block->partition_by);
+  }
+  if (ctx->dbinfo->shared_cache && block->depth == 0) {
+    could_fail_db(ctx, sqltpl_shared_fetch(ctx, block, dbinfo, words, columns, &rows));
+    could_error(sqltpl_timed_out(ctx, block, deadline));
+  } else if (block->partitions > 1) {
+    could_fail_db(ctx, sqltpl_partitioned(ctx, block, dbinfo, query, words, columns, &rows));
+    could_error(sqltpl_timed_out(ctx, block, deadline));
+  }
+  if (!rows) {
+    traced = sqltpl_trace_start();
+    if (ctx->dbinfo->slow_query) {
+      queried = apr_time_now();
+    }
+    could_fail_db(ctx, sqltpl_dbquery(words[nwords - 1], header->nelts - nwords, words + nwords,
+        &block->stmt, block->const_query ? ctx->pool : block->pool, random,
+        block->pool, ctx->server, dbinfo, &res, columns));
+    sqltpl_trace_span("query", block->where, block->depth, traced);
+    /* with inner sections, all the rows come with the query, and the
+       loop below expands them */
+    if (queried && random) {
+      took = apr_time_now() - queried;
+    }
+    could_error(sqltpl_timed_out(ctx, block, deadline));
+  }
+
+  // compile the contents once, now that the column names are known
+  if (!block->columns || !sqltpl_same_columns(block->columns, columns)) {
+    could_error(sqltpl_block_compile(ctx, block, columns));
+  }
+  ctx->columns[block->depth] = block->columns;
+  ctx->names[block->depth]   = block->name;
+
+  memset(&run, 0, sizeof(run));
+  run.words = words;
+  run.ncols = columns->nelts;
+  run.out   = out;
+
+  if (block->type == SQLTPL_BLOCK_GROUP) {
+    for (run.keycol = 0; run.keycol < columns->nelts; run.keycol++) {
+      if (!strcmp(words[0], APR_ARRAY_IDX(columns, run.keycol, char *))) break;
+    }
+    if (run.keycol == columns->nelts) {
+      return apr_psprintf(block->pool, "%s: key column \"%s\" is not in the query results",
+          block->where, words[0]);
+    }
+  }
+
+  shardcol = -1;
+  if (block->shard_by && ctx->dbinfo->shard_count > 1) {
+    for (shardcol = 0; shardcol < columns->nelts; shardcol++) {
+      if (!strcmp(block->shard_by, APR_ARRAY_IDX(columns, shardcol, char *))) break;
+    }
+    if (shardcol == columns->nelts) {
+      return apr_psprintf(block->pool, "%s: ShardBy column \"%s\" is not in the query results",
+          block->where, block->shard_by);
+    }
+  }
+
+  if (block->name && sqltpl_exports) {
+    export = sqltpl_export_table(ctx, block, columns);
+  }
+
+  if (block->type == SQLTPL_BLOCK_CATSET) {
+    run.sets = apr_palloc(block->pool, columns->nelts * sizeof(sqltpl_buf_t));
+    for (i = 0; i < columns->nelts; i++) {
+      sqltpl_buf_init(&run.sets[i], block->pool, 0);
+    }
+    if (block->max_bytes) {
+      /* measuring a line renders it: it must not run queries */
+      for (i = 0; i < block->tpl[0]->segments->nelts; i++) {
+        if (APR_ARRAY_IDX(block->tpl[0]->segments, i, sqltpl_segment_t).type == SQLTPL_SEG_BLOCK) {
+          return apr_psprintf(block->pool, "%s: MaxBytes is for a body without SQL sections",
+              block->where);
+        }
+      }
+      sqltpl_buf_init(&run.line, block->pool, 0);
+      run.joined = apr_palloc(block->pool, columns->nelts * sizeof(char *));
+      run.lens   = apr_palloc(block->pool, columns->nelts * sizeof(apr_size_t));
+    }
+  }
+
+#ifdef SQLTPL_HAVE_LIBPQ
+  ahead = sqltpl_pq_children(ctx, block);
+#endif
+
+  values = apr_array_make(block->pool, columns->nelts, sizeof(char *));
+  if (!rows && (parallel
+#ifdef SQLTPL_HAVE_LIBPQ
+                || ahead
+#endif
+               )) {
+    rows = apr_array_make(block->pool, 64, sizeof(const char **));
+    sqltpl_intern_init(&interned, block->pool, columns->nelts);
+  } else if (rows) {
+    /* fetched already: keep this node's share */
+    if (shardcol >= 0) {
+      for (i = rowcount = 0; i < rows->nelts; i++) {
+        rtab = APR_ARRAY_IDX(rows, i, const char **);
+        if (sqltpl_shard_mine(ctx->dbinfo, rtab[shardcol])) {
+          APR_ARRAY_IDX(rows, rowcount++, const char **) = rtab;
+        }
+      }
+      rows->nelts = rowcount;
+    }
+    rowcount = rows->nelts;
+    for (i = 0; export && i < rows->nelts; i++) {
+      sqltpl_export_row(export, APR_ARRAY_IDX(rows, i, const char **));
+    }
+  }
+
+  /* rows expanded as they come are rendered within this span */
+  traced = sqltpl_trace_start();
+  for (rv = res ? apr_dbd_get_row(dbinfo->driver, block->pool, res, &row, -1) : -1;
+       rv != -1;
+       rv = apr_dbd_get_row(dbinfo->driver, block->pool, res, &row, -1)) {
+
+    if (rv != 0) {
+      ap_log_error(APLOG_MARK, APLOG_ERR, rv, ctx->server, "Error retrieving results from database");
+      ctx->db_failed = 1;
+      return "Error retrieving results";
+    }
+
+    /* rows still coming from the server count against the query */
+    if (!random && !(rowcount % 64)) {
+      could_error(sqltpl_timed_out(ctx, block, deadline));
+    }
+
+    sqltpl_fetch_entries(dbinfo, row, columns->nelts, values);
+    rtab = (const char **)values->elts;
+
+    /* rows of the other nodes are neither kept nor expanded */
+    if (shardcol >= 0 && !sqltpl_shard_mine(ctx->dbinfo, rtab[shardcol])) {
+      continue;
+    }
+
+    debug(3, display_array(values));
+
+    if (export) {
+      sqltpl_export_row(export, rtab);
+    }
+
+    if (rows) {
+      /* keep a copy for later, drivers may reuse their row buffers */
+      *(const char ***)apr_array_push(rows) =
+          sqltpl_intern_row(&interned, rtab, columns->nelts);
+    } else {
+      could_error(sqltpl_block_row(ctx, block, &run, rtab));
+    }
+
+    rowcount++;
+  }
+  if (res) {
+    sqltpl_trace_span("rows", block->where, block->depth, traced);
+  }
+  if (queried && !random) {
+    took = apr_time_now() - queried;
+  }
+  if (queried && took > ctx->dbinfo->slow_query) {
+    sqltpl_slow_query(ctx, block, dbinfo, words[nwords - 1], header->nelts - nwords,
+                      words + nwords, rowcount, took);
+  }
+
+  ctx->queries++;
+  ctx->rows += rowcount;
+
+  if (!rowcount) {
+    debug(1, fprintf(stderr, "%s: [no query results]\n", block->where));
+    return NULL;
+  }
+
+  if (rows && res) {
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, ctx->server,
+        "%s: %d rows kept, %d of %d values shared, %" APR_SIZE_T_FMT " bytes saved",
+        block->where, rows->nelts, interned.shared, rows->nelts * columns->nelts,
+        interned.saved);
+  }
+
+#ifdef SQLTPL_HAVE_LIBPQ
+  if (ahead) {
+    traced = sqltpl_trace_start();
+    could_fail_db(ctx, sqltpl_pq_send_ahead(ctx, block, ahead, rows));
+    sqltpl_trace_span("send ahead", block->where, block->depth, traced);
+  }
+#endif
+
+  traced = sqltpl_trace_start();
+
+#if APR_HAS_THREADS
+  if (parallel) {
+    sqltpl_render_parallel(ctx, block, rows, out);
+  } else
+#endif
+  if (rows) {
+    for (i = 0; i < rows->nelts; i++) {
+#ifdef SQLTPL_HAVE_LIBPQ
+      ctx->rowno[block->depth] = i;
+#endif
+      could_error(sqltpl_block_row(ctx, block, &run, APR_ARRAY_IDX(rows, i, const char **)));
+    }
+  }
+  if (rows) {
+    sqltpl_trace_span("render", block->where, block->depth, traced);
+  }
+
+  switch (block->type) {
+    case SQLTPL_BLOCK_CATSET:
+      could_error(sqltpl_catset_flush(ctx, block, &run));
+      break;
+
+    case SQLTPL_BLOCK_GROUP:
+      ctx->frames[block->depth] = run.group_values;
+      could_error(sqltpl_render(ctx, out, block->tpl[2]));
+      break;
+
+    default:
+      break;
+  }
+
+  return NULL;
+}
+
+
+/* a column name as the server gives it, quoted for sqlite3.
+*/
+static const char *sqltpl_sqlite_name(apr_pool_t *p, const char *name)
+{
+  sqltpl_buf_t quoted;
+
+  sqltpl_buf_init(&quoted, p, strlen(name) + 3);
+  sqltpl_buf_append(&quoted, "\"", 1);
+  for (; *name; name++) {
+    sqltpl_buf_append(&quoted, name, 1);
+    if (*name == '"') sqltpl_buf_append(&quoted, name, 1);
+  }
+  sqltpl_buf_append(&quoted, "\"", 1);
+  return quoted.data;
+}
+
+/* SQLTemplateReplica keeps a sqlite3 copy of the tables named with
+   SQLTemplateReplicaTable, which the sections without a Connection=
+   then query instead of the server. the copy is brought up to date on
+   the first section of each pass: with the rows whose change column went
+   past the highest value seen so far, or else with the whole table. when
+   the server cannot be reached, the copy is used as it is. the columns
+   of the copy have numeric affinity, for numbers to compare and sort as
+   on the server.
+*/
+static const char *sqltpl_replica_copy(apr_pool_t *p, server_rec *s,
+                                       sqltpl_dbinfo_t *conf,
+                                       const sqltpl_replica_table_t *tbl)
+{
+  sqltpl_dbinfo_t *local = conf->replica;
+  apr_dbd_prepared_t *stmt = NULL, *insert = NULL;
+  apr_dbd_results_t *res = NULL;
+  apr_dbd_row_t *row = NULL;
+  apr_array_header_t *columns = apr_array_make(p, 8, sizeof(char *));
+  const char *table = tbl->table, *mark = NULL, *query, **values, *errmsg = NULL;
+  sqltpl_buf_t create, cols, marks, last;
+  apr_pool_t *rowp;
+  int i, n, rv, changecol = -1, nrows = 0;
+
+  if (tbl->change) {
+    if (!sqltpl_dbquery("SELECT mark FROM sqltpl_replica WHERE tbl = ?", 1, &table, &stmt,
+                        p, 1, p, s, local, &res, NULL)) {
+      while (apr_dbd_get_row(local->driver, p, res, &row, -1) == 0) {
+        mark = apr_pstrdup(p, apr_dbd_get_entry(local->driver, row, 0));
+      }
+    }
+    query = mark ? apr_psprintf(p, "SELECT * FROM %s WHERE %s > ? ORDER BY %s",
+                                tbl->table, tbl->change, tbl->change)
+                 : apr_psprintf(p, "SELECT * FROM %s ORDER BY %s", tbl->table, tbl->change);
+  } else {
+    query = apr_psprintf(p, "SELECT * FROM %s", tbl->table);
+  }
+
+  stmt = NULL;
+  could_error(sqltpl_dbquery(query, mark ? 1 : 0, &mark, &stmt, p, 0, p, s, conf, &res, columns));
+
+  sqltpl_buf_init(&create, p, 0);
+  sqltpl_buf_init(&cols, p, 0);
+  sqltpl_buf_init(&marks, p, 0);
+  for (i = 0; i < columns->nelts; i++) {
+    const char *col = APR_ARRAY_IDX(columns, i, char *);
+    const char *quoted = sqltpl_sqlite_name(p, col);
+    sqltpl_buf_puts(&create, apr_psprintf(p, "%s NUMERIC, ", quoted));
+    sqltpl_buf_puts(&cols, i ? ", " : "");
+    sqltpl_buf_puts(&cols, quoted);
+    sqltpl_buf_puts(&marks, i ? ", ?" : "?");
+    if (tbl->change && !strcmp(col, tbl->change)) changecol = i;
+  }
+  if (tbl->change && changecol < 0) {
+    return apr_psprintf(p, "change column %s is not in %s", tbl->change, tbl->table);
+  }
+
+  if (apr_dbd_query(local->driver, local->handle, &n, "BEGIN")) {
+    return "Can't start a transaction on the replica";
+  }
+  if (apr_dbd_query(local->driver, local->handle, &n,
+          apr_psprintf(p, "CREATE TABLE IF NOT EXISTS %s (%sPRIMARY KEY (%s))",
+                       tbl->table, create.data, tbl->key)) ||
+      (!tbl->change && apr_dbd_query(local->driver, local->handle, &n,
+          apr_psprintf(p, "DELETE FROM %s", tbl->table))) ||
+      apr_dbd_prepare(local->driver, p, local->handle,
+          sqltpl_placeholders(p, apr_psprintf(p, "INSERT OR REPLACE INTO %s (%s) VALUES (%s)",
+                                              tbl->table, cols.data, marks.data), 0),
+          NULL, &insert)) {
+    errmsg = apr_dbd_error(local->driver, local->handle, 0);
+  }
+
+  /* the rows of a whole table can be many, each is let go once copied */
+  apr_pool_create(&rowp, p);
+  values = apr_palloc(p, columns->nelts * sizeof(char *));
+  sqltpl_buf_init(&last, p, 0);
+  for (rv = errmsg ? -1 : apr_dbd_get_row(conf->driver, rowp, res, &row, -1);
+       rv != -1;
+       apr_pool_clear(rowp), rv = apr_dbd_get_row(conf->driver, rowp, res, &row, -1)) {
+    if (rv != 0) {
+      errmsg = "Error retrieving results";
+      break;
+    }
+    for (i = 0; i < columns->nelts; i++) {
+      values[i] = apr_dbd_get_entry(conf->driver, row, i);
+    }
+    if (apr_dbd_pquery(local->driver, rowp, local->handle, &n, insert, columns->nelts, values)) {
+      errmsg = apr_dbd_error(local->driver, local->handle, 0);
+      break;
+    }
+    if (changecol >= 0 && values[changecol]) {
+      last.len = 0;
+      sqltpl_buf_puts(&last, values[changecol]);
+    }
+    nrows++;
+  }
+  /* drivers want their results read to the end */
+  if (rv != -1 && res) {
+    while (apr_dbd_get_row(conf->driver, rowp, res, &row, -1) == 0);
+  }
+  apr_pool_destroy(rowp);
+
+  if (!errmsg && last.len) {
+    const char *args[2];
+    args[0] = tbl->table;
+    args[1] = last.data;
+    stmt = NULL;
+    if (apr_dbd_prepare(local->driver, p, local->handle,
+            "INSERT OR REPLACE INTO sqltpl_replica (tbl, mark) VALUES (%s, %s)", NULL, &stmt) ||
+        apr_dbd_pquery(local->driver, p, local->handle, &n, stmt, 2, args)) {
+      errmsg = apr_dbd_error(local->driver, local->handle, 0);
+    }
+  }
+
+  if (apr_dbd_query(local->driver, local->handle, &n, errmsg ? "ROLLBACK" : "COMMIT") && !errmsg) {
+    errmsg = apr_dbd_error(local->driver, local->handle, 0);
+  }
+  if (errmsg) {
+    return errmsg;
+  }
+
+  ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "SQLTemplateReplica: %d rows of %s copied%s",
+      nrows, tbl->table, tbl->change ? "" : " in full");
+  return NULL;
+}
+
+/* bring the replica up to date, once per pass.
+   returns an error message if it cannot be opened, or NULL.
+*/
+static const char *sqltpl_replica_sync(apr_pool_t *p, server_rec *s, sqltpl_dbinfo_t *conf)
+{
+  sqltpl_dbinfo_t *local = conf->replica;
+  const char *errmsg;
+  int i, n;
+
+  conf->replica_synced = 1;
+
+  could_error_msg(p, "SQLTemplateReplica: ", sqltemplate_db_connect(p, s, local));
+  if (apr_dbd_query(local->driver, local->handle, &n,
+          "CREATE TABLE IF NOT EXISTS sqltpl_replica (tbl TEXT PRIMARY KEY, mark TEXT)")) {
+    return apr_psprintf(p, "SQLTemplateReplica: %s: %s", local->params,
+        apr_dbd_error(local->driver, local->handle, 0));
+  }
+
+  if ((errmsg = sqltemplate_db_connect(p, s, conf)) != NULL) {
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+        "SQLTemplateReplica: %s; expanding from %s as it is", errmsg, local->params);
+    return NULL;
+  }
+
+  for (i = 0; conf->replica_tables && i < conf->replica_tables->nelts; i++) {
+    const sqltpl_replica_table_t *tbl = &APR_ARRAY_IDX(conf->replica_tables, i, sqltpl_replica_table_t);
+    if ((errmsg = sqltpl_replica_copy(p, s, conf, tbl)) != NULL) {
+      ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+          "SQLTemplateReplica: %s: %s; its copy is left as it is", tbl->table, errmsg);
+    }
+  }
+  return NULL;
+}
+
+/* SQLTemplateFallbackDir keeps the last good output of each section in
+   a file named after a hash of its opening line and contents, so that an
+   edited section never gets the output of its former self.
+*/
+static const char *sqltpl_fallback_path(apr_pool_t *p, const char *dir,
+                                        sqltpl_block_type_t type,
+                                        const char *arg,
+                                        const apr_array_header_t *contents)
+{
+  apr_md5_ctx_t md5;
+  unsigned char digest[APR_MD5_DIGESTSIZE];
+  char hex[2 * APR_MD5_DIGESTSIZE + 1];
+  int i;
+
+  apr_md5_init(&md5);
+  apr_md5_update(&md5, sqltpl_sections[type].begin, strlen(sqltpl_sections[type].begin));
+  apr_md5_update(&md5, arg, strlen(arg) + 1);
+  for (i = 0; i < contents->nelts; i++) {
+    const char *line = APR_ARRAY_IDX(contents, i, const char *);
+    apr_md5_update(&md5, line, strlen(line) + 1);
+  }
+  apr_md5_final(digest, &md5);
+  ap_bin2hex(digest, APR_MD5_DIGESTSIZE, hex);
+
+  return apr_pstrcat(p, dir, "/sqltemplate-", hex, ".conf", NULL);
+}
+
+/* read the saved output of a section into output.
+*/
+static apr_status_t sqltpl_fallback_load(apr_pool_t *p, const char *path,
+                                         sqltpl_buf_t *output)
+{
+  apr_file_t *file;
+  apr_finfo_t finfo;
+  apr_status_t rv;
+
+  rv = apr_file_open(&file, path, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT, p);
+  if (rv != APR_SUCCESS) {
+    return rv;
+  }
+  rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+  if (rv == APR_SUCCESS) {
+    sqltpl_buf_init(output, p, (apr_size_t)finfo.size + 1);
+    rv = apr_file_read_full(file, output->data, (apr_size_t)finfo.size, &output->len);
+    output->data[output->len] = '\0';
+  }
+  apr_file_close(file);
+  return rv;
+}
+
+/* a section read by httpd: capture its contents, expand it along with
+   the sections nested in it, and hand the result back to httpd, either
+   as a single string for it to read, or with SQLTemplateBuildTree as
+   directive nodes in *mconfig, the way <IfDefine> does.
+*/
+static const char *sqltpl_section(cmd_parms *cmd,
+                                  void *mconfig,
+                                  sqltpl_block_type_t type,
+                                  const char *arg)
+{
+  const char *begin = sqltpl_sections[type].begin, *where, *errmsg, *saved = NULL;
+  apr_array_header_t *contents = NULL;
+  apr_pool_t *prepared_pool;
+  sqltpl_block_t *block;
+  sqltpl_buf_t output;
+  sqltpl_acct_t *acct;
+  sqltpl_ctx_t ctx;
+  apr_status_t rv;
+  apr_time_t started = apr_time_now(), traced;
+
+  could_error(sqltpl_sec_open_check(cmd, arg));
+
+  where = apr_psprintf(cmd->temp_pool, "%s at %s:%d", begin + 1,
+                       cmd->config_file->name, cmd->config_file->line_number);
+
+  debug(1, fprintf(stderr, "%s:\n", where));
+
+  traced = sqltpl_trace_start();
+  could_error(get_lines_till_end_token(cmd->temp_pool, cmd->config_file,
+      sqltpl_sections[type].end, begin, where, &contents));
+  sqltpl_trace_span("capture", where, 0, traced);
+
+  debug(2, display_contents(contents));
+
+  could_error(sqltpl_block_make(cmd->temp_pool, type, arg, contents, NULL, 0, where, &block));
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.server    = cmd->server;
+  ctx.dbinfo    = get_dbinfo(cmd->pool, cmd->server);
+  ctx.pool      = cmd->temp_pool;
+  ctx.conn_pool = cmd->pool;
+
+  if (ctx.dbinfo->budget && !ctx.dbinfo->budget_end) {
+    ctx.dbinfo->budget_end = apr_time_now() + ctx.dbinfo->budget;
+  }
+  if (ctx.dbinfo->replica && !ctx.dbinfo->replica_synced) {
+    could_error(sqltpl_replica_sync(cmd->temp_pool, cmd->server, ctx.dbinfo));
+  }
+  if (ctx.dbinfo->fallback_dir) {
+    saved = sqltpl_fallback_path(cmd->temp_pool, ctx.dbinfo->fallback_dir, type, arg,
+                                 block->define ? block->define->contents : contents);
+  }
+
+  // set up a sub-pool
+  rv = apr_pool_create(&prepared_pool, cmd->pool);
+  if (rv != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, cmd->server, "SQLTemplate: Failed to create memory pool");
+    return "Memory error";
+  }
+
+  /* the buffer doubles as it grows: rendered aside, so that only the
+     final text is kept for the generation */
+  sqltpl_buf_init(&output, cmd->temp_pool, 0);
+  traced = sqltpl_trace_start();
+  errmsg = sqltpl_block_run(&ctx, block, &output);
+  sqltpl_trace_span("expand", where, 0, traced);
+  /* only for the database failing: other errors come from the
+     configuration itself, which must not go unnoticed */
+  if (errmsg && ctx.db_failed && saved && sqltpl_fallback_load(cmd->temp_pool, saved, &output) == APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, cmd->server,
+        "mod_sqltemplate: %s; using the output saved in %s", errmsg, saved);
+  } else if (errmsg) {
+    apr_pool_destroy(prepared_pool);
+    return errmsg;
+  } else {
+    /* for keeping an eye on the cost of sections, with httpd -t -e info */
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, cmd->server,
+        "%s: %d queries, %" APR_SIZE_T_FMT " rows, %" APR_SIZE_T_FMT " bytes in %"
+        APR_INT64_T_FMT " ms", where, ctx.queries, ctx.rows, output.len,
+        (apr_int64_t)apr_time_as_msec(apr_time_now() - started));
+    if (saved) {
+      sqltpl_file_save(cmd->temp_pool, cmd->server, saved, &output);
+    }
+  }
+  if (output.len) {
+    output.data = apr_pstrmemdup(prepared_pool, output.data, output.len);
+  }
+  acct = sqltpl_acct(cmd->server);
+  acct->sections[type]++;
+  acct->bytes[type] += output.len;
+
+  traced = sqltpl_trace_start();
+  if (output.len && ctx.dbinfo->build_tree &&
+      sqltpl_tree_ok(cmd->temp_pool, output.data)) {
+    *(ap_directive_t **)mconfig = sqltpl_build_tree(prepared_pool, output.data,
+        apr_pstrdup(prepared_pool, where));
+    debug(1, fprintf(stderr, "%s: built directive tree\n", where));
+  } else if (output.len) {
+    apr_array_header_t *finalcontents = apr_array_make(cmd->temp_pool, 1, sizeof(char*));
+    *(char **)apr_array_push(finalcontents) = output.data;
+
+    debug(1, fprintf(stderr, "Final "));
+    debug(1, display_contents(finalcontents));
+
+    /* fix??? why is it wrong? should I -- the new one? */
+    cmd->config_file->line_number++;
+
+    cmd->config_file = make_array_config
+        (prepared_pool, finalcontents, where, cmd->config_file, &cmd->config_file);
+  } else {
+    apr_pool_destroy(prepared_pool);
+  }
+  sqltpl_trace_span("handoff", where, 0, traced);
+
+  return NULL;
+}
+
+
+/* handles: <SQLRepeat "SQL statement" [arguments]>
+*/
+static const char *sqltemplate_rpt_section(cmd_parms * cmd,
+    void * dummy,
+    const char * arg)
+{
+  return sqltpl_section(cmd, dummy, SQLTPL_BLOCK_REPEAT, arg);
+}
+
+
+/* handles: <SQLCatSet "separator" "SQL statement" [arguments]>
+*/
+static const char *sqltemplate_catset_section(cmd_parms * cmd,
+    void * dummy,
+    const char * arg)
+{
+  return sqltpl_section(cmd, dummy, SQLTPL_BLOCK_CATSET, arg);
+}
+
+
+/* handles: <SQLGroup "key column" "SQL statement" [arguments]>
+ *
+ * the query is expected to be ordered by the key column, typically a
+ * JOIN of parent and child tables. the contents outside <SQLGroupRows>
+ * are emitted once per run of rows sharing the same key, with the values
+ * of the first row of the run, and the contents inside it once per row.
+ * everything is done in a single pass over the results.
+ */
+static const char *sqltemplate_group_section(cmd_parms * cmd,
+    void * dummy,
+    const char * arg)
+{
+  return sqltpl_section(cmd, dummy, SQLTPL_BLOCK_GROUP, arg);
+}
+
+
+/* handles: <SQLTemplateDefine name>
+ *
+ * the body is only kept, for the sections given Use=name further on.
+ */
+static const char *sqltemplate_define_section(cmd_parms * cmd,
+    void * dummy,
+    const char * arg)
+{
+  sqltpl_define_t *define, *other;
+  const char *name;
+
+  could_error(sqltpl_sec_open_check(cmd, arg));
+  name = ap_getword_conf(cmd->temp_pool, &arg);
+  if (!*name || *arg) {
+    return BEGIN_SQLDEFINE "> takes one name";
+  }
 
-  debug(1, fprintf(stderr, "%s:\n", where));
-  debug(2, fprintf(stderr, "SQLCatSet seperator: \"%s\"\n", sep));
-  debug(2, fprintf(stderr, "SQLCatSet query: %s\n", query));
+  define = apr_pcalloc(cmd->temp_pool, sizeof(sqltpl_define_t));
+  define->where = apr_psprintf(cmd->temp_pool, "%s %s> at %s:%d", BEGIN_SQLDEFINE, name,
+                               cmd->config_file->name, cmd->config_file->line_number);
+  define->compiled = apr_array_make(cmd->temp_pool, 2, sizeof(sqltpl_compiled_t));
+  could_error(get_lines_till_end_token(cmd->temp_pool, cmd->config_file,
+      END_SQLDEFINE, BEGIN_SQLDEFINE, define->where, &define->contents));
+
+  /* the bodies go with the configuration read */
+  if (!sqltpl_defines) {
+    sqltpl_defines = apr_hash_make(cmd->temp_pool);
+    apr_pool_cleanup_register(cmd->temp_pool, NULL, sqltpl_defines_reset, apr_pool_cleanup_null);
+  }
+  if ((other = apr_hash_get(sqltpl_defines, name, APR_HASH_KEY_STRING)) != NULL) {
+    return apr_pstrcat(cmd->pool, define->where, ": already defined at ", other->where, NULL);
+  }
+  apr_hash_set(sqltpl_defines, name, APR_HASH_KEY_STRING, define);
 
-  apr_array_header_t * query_arguments = get_arguments(cmd->temp_pool, arg);
-  apr_array_header_t * contents=NULL;
+  return NULL;
+}
 
-  could_error(get_lines_till_end_token(cmd->temp_pool, cmd->config_file, END_SQLCATSET, BEGIN_SQLCATSET, where, &contents));
 
-  debug(2, display_contents(contents));
+/* load the driver named in dbinfo.
+*/
+static const char *sqltpl_load_driver(cmd_parms *cmd, sqltpl_dbinfo_t *dbinfo)
+{
+  switch (apr_dbd_get_driver(cmd->temp_pool, dbinfo->driver_name, &dbinfo->driver)) {
+    case APR_ENOTIMPL:
+        return apr_psprintf(cmd->temp_pool, "mod_sqltemplate: Driver loading is not supported by APR");
+    case APR_EDSOOPEN:
+        return apr_psprintf(cmd->temp_pool,
+#ifdef NETWARE
+                            "mod_sqltemplate: Can't load driver dbd%s.nlm -- please ensure that support for %s has been compiled into apr-util.",
+#else
+                            "mod_sqltemplate: Can't load driver apr_dbd_%s.so -- please ensure that support for %s has been compiled into apr-util.",
+#endif
+                            dbinfo->driver_name, dbinfo->driver_name);
+    case APR_ESYMNOTFOUND:
+        return apr_psprintf(cmd->temp_pool,
+                            "mod_sqltemplate: Failed to load driver apr_dbd_%s_driver",
+                            dbinfo->driver_name);
+  }
+  return NULL;
+}
 
+static const char *sqltemplate_db_param(cmd_parms *cmd, void *dconf, const char *val)
+{
+  sqltpl_dbinfo_t *dbinfo = get_dbinfo(cmd->pool, cmd->server);
 
-  // acquire DB connection
-  could_error_msg(cmd->temp_pool, "Database error: ", sqltemplate_db_connect(cmd->pool, cmd->server));
+  switch ((long) cmd->info) {
+    case 0:
+      dbinfo->driver_name = val;
+      could_error(sqltpl_load_driver(cmd, dbinfo));
+      break;
+    case 1:
+      dbinfo->params = val;
+      break;
+  }
+  /* the sections after it use another connection */
+  dbinfo->handle = NULL;
+
+  return NULL;
+}
 
+/* handles: SQLTemplateDBConnection name driver params
+   a connection for the sections with a Connection=name option, opened
+   when one of them first runs.
+*/
+static const char *sqltemplate_db_connection(cmd_parms *cmd, void *dconf,
+                                             const char *name,
+                                             const char *driver,
+                                             const char *params)
+{
   sqltpl_dbinfo_t *dbinfo = get_dbinfo(cmd->pool, cmd->server);
-  debug(3, fprintf(stderr, "DBINFO: %p %p\n", dbinfo->driver, dbinfo->handle));
+  sqltpl_dbinfo_t *conn;
+
+  if (!dbinfo->named) {
+    dbinfo->named = apr_hash_make(cmd->pool);
+  }
+  if (apr_hash_get(dbinfo->named, name, APR_HASH_KEY_STRING)) {
+    return apr_psprintf(cmd->temp_pool, "SQLTemplateDBConnection %s is already defined", name);
+  }
+
+  conn = apr_pcalloc(cmd->pool, sizeof(sqltpl_dbinfo_t));
+  conn->name        = apr_pstrdup(cmd->pool, name);
+  conn->driver_name = apr_pstrdup(cmd->pool, driver);
+  conn->params      = apr_pstrdup(cmd->pool, params);
+  could_error(sqltpl_load_driver(cmd, conn));
+
+  apr_hash_set(dbinfo->named, apr_pstrdup(cmd->pool, name), APR_HASH_KEY_STRING, conn);
+  return NULL;
+}
+
+/* handles: SQLTemplateSharedCache dir [age]. the files in dir are
+   expanded as configuration, so dir must belong to the user reading it,
+   and be writable by no one else. the sections using it no longer
+   stream their rows, see sqltpl_shared_fetch.
+*/
+static const char *sqltemplate_shared_cache(cmd_parms *cmd, void *dconf,
+                                            const char *dir, const char *age)
+{
+  sqltpl_dbinfo_t *dbinfo = get_dbinfo(cmd->pool, cmd->server);
+  apr_finfo_t finfo;
+  apr_uid_t uid;
+  apr_gid_t gid;
   apr_status_t rv;
 
-  // prepare the query
+  dbinfo->shared_cache = ap_server_root_relative(cmd->pool, dir);
+  if (!dbinfo->shared_cache) {
+    return apr_pstrcat(cmd->pool, "SQLTemplateSharedCache: invalid path ", dir, NULL);
+  }
+  rv = apr_stat(&finfo, dbinfo->shared_cache, APR_FINFO_TYPE | APR_FINFO_USER | APR_FINFO_PROT,
+                cmd->temp_pool);
+  if ((rv != APR_SUCCESS && !APR_STATUS_IS_INCOMPLETE(rv)) || finfo.filetype != APR_DIR) {
+    return apr_pstrcat(cmd->pool, "SQLTemplateSharedCache: ", dbinfo->shared_cache,
+                       " is not a directory", NULL);
+  }
+  if ((finfo.valid & APR_FINFO_PROT) && (finfo.protection & (APR_FPROT_GWRITE | APR_FPROT_WWRITE))) {
+    return apr_pstrcat(cmd->pool, "SQLTemplateSharedCache: ", dbinfo->shared_cache,
+                       " is writable by other users, who could change the configuration", NULL);
+  }
+  if ((finfo.valid & APR_FINFO_USER) && apr_uid_current(&uid, &gid, cmd->temp_pool) == APR_SUCCESS
+      && apr_uid_compare(finfo.user, uid) != APR_SUCCESS) {
+    return apr_pstrcat(cmd->pool, "SQLTemplateSharedCache: ", dbinfo->shared_cache,
+                       " belongs to another user, who could change the configuration", NULL);
+  }
+  dbinfo->shared_age = apr_time_from_sec(60);
+  if (age && (ap_timeout_parameter_parse(age, &dbinfo->shared_age, "s") != APR_SUCCESS ||
+              dbinfo->shared_age < 0)) {
+    return "SQLTemplateSharedCache: the age must be a duration, such as 60 or 500ms";
+  }
+  return NULL;
+}
+
+static const char *sqltemplate_replica(cmd_parms *cmd, void *dconf, const char *val)
+{
+  sqltpl_dbinfo_t *dbinfo = get_dbinfo(cmd->pool, cmd->server);
+  sqltpl_dbinfo_t *replica = apr_pcalloc(cmd->pool, sizeof(sqltpl_dbinfo_t));
 
-  debug(3, fprintf(stderr, "Preparing sub-pool...\n  %s\n", query));
-  // set up a sub-pool
-  apr_pool_t *prepared_pool;
-  rv = apr_pool_create(&prepared_pool, cmd->pool);
-  if (rv != APR_SUCCESS) {
-    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, cmd->server, "SQLTemplate: Failed to create memory pool");
-    return "Memory error";
+  replica->name        = "SQLTemplateReplica";
+  replica->driver_name = "sqlite3";
+  replica->params      = ap_server_root_relative(cmd->pool, val);
+  if (!replica->params) {
+    return apr_pstrcat(cmd->pool, "SQLTemplateReplica: invalid path ", val, NULL);
   }
+  could_error(sqltpl_load_driver(cmd, replica));
 
+  dbinfo->replica = replica;
+  return NULL;
+}
 
-  apr_array_header_t *query_fields, *replacements, *newcontents;
-  query_fields = apr_array_make(prepared_pool, 1, sizeof(char*));
+/* whether names is a name, or with list a comma-separated list of them,
+   of letters, digits, '_' and '.' only: they go unquoted into the
+   statements of the replica, on the server and in sqlite3.
+*/
+static int sqltpl_plain_names(const char *names, int list)
+{
+  const char *start = names;
 
-  apr_dbd_results_t *res = NULL;
-  apr_dbd_row_t *row = NULL;
+  for (; *names; names++) {
+    if (*names == ',' && list && names > start && names[-1] != ',') continue;
+    if (!apr_isalnum(*names) && *names != '_' && *names != '.') return 0;
+  }
+  return names > start && names[-1] != ',';
+}
 
-  do {
-    const char *errmsg = sqltpl_dbquery(query, query_arguments, prepared_pool, cmd->server, dbinfo, &res, query_fields);
-    if (errmsg) {
-      apr_pool_destroy(prepared_pool);
-      return errmsg;
-    }
-  } while (0);
+/* handles: SQLTemplateReplicaTable table key[,key...] [change]
+*/
+static const char *sqltemplate_replica_table(cmd_parms *cmd, void *dconf, const char *table,
+                                             const char *key, const char *change)
+{
+  sqltpl_dbinfo_t *dbinfo = get_dbinfo(cmd->pool, cmd->server);
+  sqltpl_replica_table_t *tbl;
 
-  // this is going to eat memory. Optimal way: find out which fields are actually used, and just allocate for those
-  replacements = apr_array_make(prepared_pool, query_fields->nelts, sizeof(char*));
-  int i;
-  for (i=0; i<query_fields->nelts; i++) {
-    ((char **)replacements->elts)[i] = apr_pstrdup(cmd->temp_pool, "");
+  if (!sqltpl_plain_names(table, 0) || !sqltpl_plain_names(key, 1) ||
+      (change && !sqltpl_plain_names(change, 0))) {
+    return "SQLTemplateReplicaTable: the table, key and change column names "
+           "can only have letters, digits, '_' and '.', keys separated by commas";
+  }
+  if (!dbinfo->replica_tables) {
+    dbinfo->replica_tables = apr_array_make(cmd->pool, 4, sizeof(sqltpl_replica_table_t));
   }
+  tbl = apr_array_push(dbinfo->replica_tables);
+  tbl->table  = table;
+  tbl->key    = key;
+  tbl->change = change;
+  return NULL;
+}
 
-  int rowcount=0;
+/* handles: SQLTemplateQueryTimeout and SQLTemplateTotalBudget, in seconds
+   or with a unit (ms, s, mi, h).
+*/
+static const char *sqltemplate_timeout(cmd_parms *cmd, void *dconf, const char *val)
+{
+  sqltpl_dbinfo_t *dbinfo = get_dbinfo(cmd->pool, cmd->server);
+  apr_interval_time_t timeout;
 
-  for (rv = apr_dbd_get_row(dbinfo->driver, prepared_pool, res, &row, -1);
-       rv != -1;
-       rv = apr_dbd_get_row(dbinfo->driver, prepared_pool, res, &row, -1)) {
+  if (ap_timeout_parameter_parse(val, &timeout, (long) cmd->info == 2 ? "ms" : "s") != APR_SUCCESS ||
+      timeout < 0) {
+    return apr_pstrcat(cmd->pool, cmd->cmd->name, " must be a duration, such as 30 or 500ms", NULL);
+  }
 
-    if (rv != 0) {
-      ap_log_error(APLOG_MARK, APLOG_ERR, rv, cmd->server, "Error retrieving results from database");
-      apr_pool_destroy(prepared_pool);
-      return "Error retrieving results";
-    }
+  switch ((long) cmd->info) {
+    case 0:
+      dbinfo->query_timeout = timeout;
+      break;
+    case 1:
+      dbinfo->budget = timeout;
+      break;
+    default:
+      dbinfo->slow_query = timeout;
+      break;
+  }
+  return NULL;
+}
 
-    debug(3, fprintf(stderr, "Clearing replacements\n"));
-#if (APU_MAJOR_VERSION < 1) || (APU_MAJOR_VERSION == 1 && APU_MINOR_VERSION < 3)
-    replacements->nelts = 0;
-#else
-    apr_array_clear(replacements);
-#endif
+static const char *sqltemplate_fallback_dir(cmd_parms *cmd, void *dconf, const char *val)
+{
+  sqltpl_dbinfo_t *dbinfo = get_dbinfo(cmd->pool, cmd->server);
 
-    debug(2, fprintf(stderr, "Fetching entries\n"));
-    const char *ent;
-    char **rtab=(char**)replacements->elts;
-    for (i=0; i < query_fields->nelts; i++) {
-      ent = apr_dbd_get_entry(dbinfo->driver, row, i);
-      if (!ent) {
-        ent = "";
-      }
-      if (*rtab[i]) {
-        debug(3, fprintf(stderr, "Appending \"%s%s\" to set\n", sep, ent));
-        rtab[i] = apr_pstrcat(cmd->temp_pool, rtab[i], sep, ent, NULL);
-      } else {
-        debug(3, fprintf(stderr, "Appending \"%s\" to set\n", ent));
-        rtab[i] = apr_pstrcat(cmd->temp_pool, rtab[i], ent, NULL);
-      }
-    }
+  dbinfo->fallback_dir = ap_server_root_relative(cmd->pool, val);
+  if (!dbinfo->fallback_dir) {
+    return apr_pstrcat(cmd->pool, "SQLTemplateFallbackDir: invalid path ", val, NULL);
+  }
+  return NULL;
+}
 
-    debug(3, display_array(replacements));
-    rowcount++;
+static const char *sqltemplate_shard(cmd_parms *cmd, void *dconf, const char *val)
+{
+  sqltpl_dbinfo_t *dbinfo = get_dbinfo(cmd->pool, cmd->server);
+  char *end;
+
+  dbinfo->shard_index = (int)strtol(val, &end, 10);
+  if (end == val || *end != '/') {
+    return "SQLTemplateShard must be index/count, such as 0/4";
+  }
+  val = end + 1;
+  dbinfo->shard_count = (int)strtol(val, &end, 10);
+  if (end == val || *end || dbinfo->shard_count < 1 ||
+      dbinfo->shard_index < 0 || dbinfo->shard_index >= dbinfo->shard_count) {
+    return "SQLTemplateShard must be index/count, such as 0/4, with index below count";
   }
+  return NULL;
+}
 
-  debug(2, fprintf(stderr, "Before "));
-  debug(2, display_contents(contents));
+static const char *sqltemplate_threads(cmd_parms *cmd, void *dconf, const char *val)
+{
+  sqltpl_dbinfo_t *dbinfo = get_dbinfo(cmd->pool, cmd->server);
+  int threads = atoi(val);
 
-  debug(3, fprintf(stderr, "Processing...\n"));
+  if (threads < 1) {
+    return "SQLTemplateThreads must be a positive number";
+  }
+#if !APR_HAS_THREADS
+  if (threads > 1) {
+    return "SQLTemplateThreads: APR was built without thread support";
+  }
+#endif
 
-  could_error_msg(cmd->temp_pool, "Error while substituting: ", process_content(prepared_pool, contents, query_fields, replacements, NULL, &newcontents, where));
+  dbinfo->threads = threads;
+  return NULL;
+}
 
-  if (rowcount) {
-    debug(1, fprintf(stderr, "Final "));
-    debug(1, display_contents(newcontents));
+static const char *sqltemplate_async(cmd_parms *cmd, void *dconf, const char *val)
+{
+  sqltpl_dbinfo_t *dbinfo = get_dbinfo(cmd->pool, cmd->server);
+  int async = atoi(val);
 
-    /* fix??? why is it wrong? should I -- the new one? */
-    cmd->config_file->line_number++;
+  if (async < 0 || (!async && strcmp(val, "0"))) {
+    return "SQLTemplateAsyncConnections must be a number";
+  }
+#ifndef SQLTPL_HAVE_LIBPQ
+  if (async) {
+    return "SQLTemplateAsyncConnections: mod_sqltemplate was built without libpq";
+  }
+#endif
 
-    cmd->config_file = make_array_config
-        (prepared_pool, newcontents, where, cmd->config_file, &cmd->config_file);
-  } else {
-    debug(1, fprintf(stderr, "[no query results]\n"));
+  dbinfo->async = async;
+  return NULL;
+}
+
+static const char *sqltemplate_build_tree(cmd_parms *cmd, void *dconf, int flag)
+{
+  sqltpl_dbinfo_t *dbinfo = get_dbinfo(cmd->pool, cmd->server);
+
+  dbinfo->build_tree = flag;
+  return NULL;
+}
+
+static const char *sqltemplate_trace_file(cmd_parms *cmd, void *dconf, const char *val)
+{
+  sqltpl_trace_t *trace = apr_pcalloc(cmd->pool, sizeof(sqltpl_trace_t));
+
+  trace->path = ap_server_root_relative(cmd->pool, val);
+  if (!trace->path) {
+    return apr_pstrcat(cmd->pool, "SQLTemplateTraceFile: invalid path ", val, NULL);
   }
+  trace->spans = apr_palloc(cmd->pool, SQLTPL_TRACE_SPANS * sizeof(sqltpl_span_t));
 
+  /* spans are taken from here on, until the next pass */
+  if (!sqltpl_trace) {
+    apr_pool_cleanup_register(cmd->pool, NULL, sqltpl_trace_reset, apr_pool_cleanup_null);
+  }
+  sqltpl_trace = trace;
   return NULL;
 }
 
+static const char *sqltemplate_export(cmd_parms *cmd, void *dconf, int flag)
+{
+  if (cmd->server->is_virtual) {
+    return "SQLTemplateExport belongs to the main server";
+  }
 
-static const char *sqltemplate_db_param(cmd_parms *cmd, void *dconf, const char *val)
+  /* the sections read from here on, until the next pass */
+  if (flag && !sqltpl_exports) {
+    sqltpl_exports = apr_hash_make(cmd->pool);
+    apr_pool_cleanup_register(cmd->pool, NULL, sqltpl_exports_reset, apr_pool_cleanup_null);
+  } else if (!flag) {
+    sqltpl_exports = NULL;
+  }
+  return NULL;
+}
+
+static const char *sqltemplate_vhost_index(cmd_parms *cmd, void *dconf, int flag)
 {
   sqltpl_dbinfo_t *dbinfo = get_dbinfo(cmd->pool, cmd->server);
 
-  switch ((long) cmd->info) {
-    case 0:
-      dbinfo->driver_name = val;
-      switch (apr_dbd_get_driver(cmd->temp_pool, dbinfo->driver_name, &dbinfo->driver)) {
-        case APR_ENOTIMPL:
-            return apr_psprintf(cmd->temp_pool, "mod_sqltemplate: Driver loading is not supported by APR");
-        case APR_EDSOOPEN:
-            return apr_psprintf(cmd->temp_pool,
-#ifdef NETWARE
-                                "mod_sqltemplate: Can't load driver dbd%s.nlm -- please ensure that support for %s has been compiled into apr-util.",
-#else
-                                "mod_sqltemplate: Can't load driver apr_dbd_%s.so -- please ensure that support for %s has been compiled into apr-util.",
-#endif
-                                dbinfo->driver_name, dbinfo->driver_name);
-        case APR_ESYMNOTFOUND:
-            return apr_psprintf(cmd->temp_pool,
-                                "mod_sqltemplate: Failed to load driver apr_dbd_%s_driver",
-                                dbinfo->driver_name);
-      }
-      break;
-    case 1:
-      dbinfo->params = val;
-      break;
+  if (cmd->server->is_virtual) {
+    return "SQLTemplateVhostIndex belongs to the main server";
   }
-
+  dbinfo->vhost_index = flag;
   return NULL;
 }
 
@@ -1285,16 +5504,357 @@ static const command_rec sqltemplate_cmds[] =
       "DBD driver to use"),
   AP_INIT_TAKE1("SQLTemplateDBParams", sqltemplate_db_param, (void*)1, EXEC_ON_READ | OR_ALL,
       "DBD driver parameters"),
+  AP_INIT_TAKE3("SQLTemplateDBConnection", sqltemplate_db_connection, NULL, EXEC_ON_READ | OR_ALL,
+      "Named DBD connection: name, driver and parameters, for Connection=name"),
+  AP_INIT_TAKE1("SQLTemplateReplica", sqltemplate_replica, NULL, EXEC_ON_READ | OR_ALL,
+      "sqlite3 file keeping a copy of the SQLTemplateReplicaTable tables, queried instead of the server"),
+  AP_INIT_TAKE23("SQLTemplateReplicaTable", sqltemplate_replica_table, NULL, EXEC_ON_READ | OR_ALL,
+      "Table copied to SQLTemplateReplica: name, primary key column(s) and optionally a change column"),
+  AP_INIT_TAKE1("SQLTemplateQueryTimeout", sqltemplate_timeout, (void*)0, EXEC_ON_READ | OR_ALL,
+      "Time a query may take while expanding sections (default none)"),
+  AP_INIT_TAKE1("SQLTemplateTotalBudget", sqltemplate_timeout, (void*)1, EXEC_ON_READ | OR_ALL,
+      "Time all the queries of a pass over the configuration may take (default none)"),
+  AP_INIT_TAKE1("SQLTemplateSlowQuery", sqltemplate_timeout, (void*)2, EXEC_ON_READ | OR_ALL,
+      "Time in milliseconds over which a query is logged, with its plan (default none)"),
+  AP_INIT_TAKE1("SQLTemplateFallbackDir", sqltemplate_fallback_dir, NULL, EXEC_ON_READ | OR_ALL,
+      "Directory keeping the last good output of each section, used when its queries fail"),
+  AP_INIT_TAKE12("SQLTemplateSharedCache", sqltemplate_shared_cache, NULL, EXEC_ON_READ | OR_ALL,
+      "Directory of query results shared by the httpd instances of a host, and their age (default 60s)"),
+  AP_INIT_TAKE1("SQLTemplateShard", sqltemplate_shard, NULL, EXEC_ON_READ | OR_ALL,
+      "Share of the rows of ShardBy= sections this server expands, as index/count (default all)"),
+  AP_INIT_TAKE1("SQLTemplateThreads", sqltemplate_threads, NULL, EXEC_ON_READ | OR_ALL,
+      "Number of threads rendering the rows of sections without inner sections (default 1)"),
+  AP_INIT_TAKE1("SQLTemplateAsyncConnections", sqltemplate_async, NULL, EXEC_ON_READ | OR_ALL,
+      "Number of libpq connections sending the queries of inner pgsql sections ahead (default 0, off)"),
+  AP_INIT_FLAG("SQLTemplateBuildTree", sqltemplate_build_tree, NULL, EXEC_ON_READ | OR_ALL,
+      "Hand expanded sections back to httpd as directive nodes rather than text (default Off)"),
+  AP_INIT_FLAG("SQLTemplateExport", sqltemplate_export, NULL, EXEC_ON_READ | RSRC_CONF,
+      "Keep the rows of sections given Name= for other modules, see mod_sqltemplate.h"),
+  AP_INIT_FLAG("SQLTemplateVhostIndex", sqltemplate_vhost_index, NULL, RSRC_CONF,
+      "Pick name-based virtual hosts from a hash of their names (default Off)"),
+  AP_INIT_TAKE1("SQLTemplateTraceFile", sqltemplate_trace_file, NULL, EXEC_ON_READ | RSRC_CONF,
+      "File the time spent expanding sections is written to, as Chrome trace events"),
+  AP_INIT_RAW_ARGS(BEGIN_SQLDEFINE, sqltemplate_define_section, NULL, EXEC_ON_READ | OR_ALL,
+      "Body of SQL sections given Use=, till " END_SQLDEFINE),
   AP_INIT_RAW_ARGS(BEGIN_SQLRPT, sqltemplate_rpt_section, NULL, EXEC_ON_READ | OR_ALL,
       "Beginning of a SQL repeating template section."),
   AP_INIT_RAW_ARGS(BEGIN_SQLCATSET, sqltemplate_catset_section, NULL, EXEC_ON_READ | OR_ALL,
       "Beginning of a SQL concatenated set template section."),
+  AP_INIT_RAW_ARGS(BEGIN_SQLGROUP, sqltemplate_group_section, NULL, EXEC_ON_READ | OR_ALL,
+      "Beginning of a SQL grouped template section."),
+  AP_INIT_RAW_ARGS(BEGIN_SQLIF, sqltemplate_if_section, NULL, EXEC_ON_READ | OR_ALL,
+      "Beginning of a conditional-include section."),
   AP_INIT_RAW_ARGS(BEGIN_SQLSIMPLEIF, sqltemplate_simpleif_section, NULL, EXEC_ON_READ | OR_ALL,
       "Beginning of a simple conditional-include section."),
 
   { NULL }
 };
 
+/* SQLTemplateVhostIndex: with thousands of generated name-based vhosts,
+   httpd compares the Host: of every request with the names of each of
+   them in turn. the names are hashed instead once the configuration is
+   read, and the vhost picked from the hash before httpd walks its list.
+   httpd does the walk only when the connection has a list of vhosts to
+   walk, so that list is put aside while a request is read, and given
+   back afterwards for httpd to fall back on: for unknown names, names
+   given to more than one vhost, or matched by the wildcard alias of a
+   vhost httpd would try first, and ServerPath.
+
+   httpd walks the vhosts of the port the connection came in on, those
+   of *:* when no vhost names that port, so there is a hash per port.
+
+   make vhostbench checks the index against a model of that walk in
+   t/sqltpl_test.c, not against httpd itself: a copy of the parts of
+   vhost.c for vhosts on *, without ServerPath or address-based vhosts,
+   in which the fallback for unknown names is that same model.
+*/
+typedef struct {
+  apr_hash_t *names;             /* lower-case name to server_rec */
+  apr_array_header_t *wild;      /* the vhosts with wildcard aliases so far */
+} sqltpl_vhost_chain_t;
+
+/* port to sqltpl_vhost_chain_t, 0 for *:*, for the pass over the
+   configuration in use */
+static apr_hash_t *sqltpl_vhosts;
+
+/* a name left to httpd */
+static server_rec sqltpl_vhost_shared;
+
+static sqltpl_vhost_chain_t *sqltpl_vhost_chain(apr_pool_t *p, apr_port_t port)
+{
+  sqltpl_vhost_chain_t *chain = apr_hash_get(sqltpl_vhosts, &port, sizeof(port));
+
+  if (!chain) {
+    apr_port_t *key = apr_pmemdup(p, &port, sizeof(port));
+
+    chain = apr_pcalloc(p, sizeof(sqltpl_vhost_chain_t));
+    chain->names = apr_hash_make(p);
+    chain->wild  = apr_array_make(p, 4, sizeof(server_rec *));
+    apr_hash_set(sqltpl_vhosts, key, sizeof(port), chain);
+  }
+  return chain;
+}
+
+/* the vhosts are added in the order httpd walks them: httpd does not
+   give s a name already known, or matched by the wildcard alias of a
+   vhost before. the wildcards are tried against every name, which is
+   only cheap while there are few of them.
+*/
+static void sqltpl_vhost_add(apr_pool_t *p, sqltpl_vhost_chain_t *chain,
+                             const char *name, server_rec *s)
+{
+  char *key;
+  server_rec *known, *earlier;
+  int i, j;
+
+  if (!name) return;
+
+  key = apr_pstrdup(p, name);
+  ap_str_tolower(key);
+  known = apr_hash_get(chain->names, key, APR_HASH_KEY_STRING);
+  for (i = 0; !known && i < chain->wild->nelts; i++) {
+    earlier = APR_ARRAY_IDX(chain->wild, i, server_rec *);
+    for (j = 0; earlier != s && j < earlier->wild_names->nelts; j++) {
+      if (!ap_strcasecmp_match(key, APR_ARRAY_IDX(earlier->wild_names, j, char *))) {
+        known = &sqltpl_vhost_shared;
+        break;
+      }
+    }
+  }
+  apr_hash_set(chain->names, key, APR_HASH_KEY_STRING,
+               known && known != s ? &sqltpl_vhost_shared : s);
+}
+
+/* the database connections kept open by the module.
+*/
+static int sqltpl_acct_handles(sqltpl_acct_t *acct)
+{
+  apr_hash_index_t *hi;
+  sqltpl_dbinfo_t *kept;
+  int handles = 0;
+#ifdef SQLTPL_HAVE_LIBPQ
+  sqltpl_pq_t *pq;
+  int i;
+
+  for (hi = apr_hash_first(NULL, acct->pq); hi; hi = apr_hash_next(hi)) {
+    apr_hash_this(hi, NULL, NULL, (void **)&pq);
+    for (i = 0; i < pq->nconns; i++) {
+      handles += pq->conns[i] != NULL;
+    }
+  }
+#endif
+  for (hi = apr_hash_first(NULL, acct->kept); hi; hi = apr_hash_next(hi)) {
+    apr_hash_this(hi, NULL, NULL, (void **)&kept);
+    handles += kept->handle != NULL;
+  }
+  return handles;
+}
+
+/* close the kept connections the pass just made did not use: those of
+   a connection whose driver or parameters changed, or that is gone
+   from the configuration.
+*/
+static void sqltpl_db_sweep(sqltpl_acct_t *acct, server_rec *s)
+{
+  apr_hash_index_t *hi;
+  sqltpl_dbinfo_t *kept;
+
+  for (hi = apr_hash_first(NULL, acct->kept); hi; hi = apr_hash_next(hi)) {
+    apr_hash_this(hi, NULL, NULL, (void **)&kept);
+    if (kept->pool && kept->generation != acct->generation) {
+      ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "mod_sqltemplate: closing the unused "
+          "connection to %s", kept->driver_name);
+      apr_pool_destroy(kept->pool);  // closes the handle
+      kept->pool = NULL;
+    }
+  }
+}
+
+/* the connections kept in the process pool were opened by the parent,
+   whose sockets the children share. a child exiting, as they do at each
+   graceful restart, would otherwise close them in its cleanups, under
+   the parent reading the configuration again on them.
+*/
+static void sqltpl_child_init(apr_pool_t *pchild, server_rec *s)
+{
+  sqltpl_acct_t *acct = sqltpl_acct(s);
+  apr_hash_index_t *hi;
+  sqltpl_dbinfo_t *kept;
+#ifdef SQLTPL_HAVE_LIBPQ
+  sqltpl_pq_t *pq;
+
+  for (hi = apr_hash_first(pchild, acct->pq); hi; hi = apr_hash_next(hi)) {
+    apr_hash_this(hi, NULL, NULL, (void **)&pq);
+    apr_pool_cleanup_kill(s->process->pool, pq, sqltpl_pq_close);
+  }
+#endif
+  for (hi = apr_hash_first(pchild, acct->kept); hi; hi = apr_hash_next(hi)) {
+    apr_hash_this(hi, NULL, NULL, (void **)&kept);
+    if (kept->pool) {
+      apr_pool_cleanup_kill(kept->pool, kept, sqltpl_db_close);
+    }
+  }
+}
+
+/* log what the generation just read left behind, warning when more
+   database connections stay open than after the first one: a slow leak
+   would otherwise only ever be compared with itself.
+*/
+static void sqltpl_acct_log(server_rec *s)
+{
+  sqltpl_acct_t *acct = sqltpl_acct(s);
+  int handles, i;
+
+  acct->generation++;
+  sqltpl_db_sweep(acct, s);
+  handles = sqltpl_acct_handles(acct);
+  ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "mod_sqltemplate: generation %d: "
+      "%d SQLRepeat %" APR_SIZE_T_FMT " bytes, %d SQLCatSet %" APR_SIZE_T_FMT " bytes, "
+      "%d SQLGroup %" APR_SIZE_T_FMT " bytes, %d connections open",
+      acct->generation,
+      acct->sections[SQLTPL_BLOCK_REPEAT], acct->bytes[SQLTPL_BLOCK_REPEAT],
+      acct->sections[SQLTPL_BLOCK_CATSET], acct->bytes[SQLTPL_BLOCK_CATSET],
+      acct->sections[SQLTPL_BLOCK_GROUP],  acct->bytes[SQLTPL_BLOCK_GROUP],
+      handles);
+  if (acct->generation == 1) {
+    acct->first_handles = handles;
+  } else if (handles > acct->first_handles) {
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "mod_sqltemplate: %d connections open "
+        "after generation %d, %d after the first one", handles, acct->generation,
+        acct->first_handles);
+  }
+
+  for (i = 0; i < 3; i++) {
+    acct->sections[i] = 0;
+    acct->bytes[i] = 0;
+  }
+}
+
+static int sqltpl_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                              apr_pool_t *ptemp, server_rec *s)
+{
+  sqltpl_dbinfo_t *conf = get_dbinfo(pconf, s);
+  sqltpl_vhost_chain_t *chain;
+  apr_hash_index_t *hi;
+  server_rec *vs;
+  server_addr_rec *sar;
+  unsigned int names = 0;
+  int i;
+
+  if (sqltpl_trace) {
+    sqltpl_trace_write(ptemp, s);
+  }
+  sqltpl_acct_log(s);
+
+  sqltpl_vhosts = NULL;
+  if (!conf->vhost_index) {
+    return OK;
+  }
+
+  /* which vhosts httpd would consider depends on the address a request
+     came in on, the hash only knows about names */
+  for (vs = s->next; vs; vs = vs->next) {
+    for (sar = vs->addrs; sar; sar = sar->next) {
+      if (!apr_sockaddr_is_wildcard(sar->host_addr)) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+            "SQLTemplateVhostIndex: %s is bound to an address, no index used",
+            sar->virthost);
+        return OK;
+      }
+    }
+  }
+
+  sqltpl_vhosts = apr_hash_make(pconf);
+  for (vs = s->next; vs; vs = vs->next) {
+    for (sar = vs->addrs; sar; sar = sar->next) {
+      chain = sqltpl_vhost_chain(pconf, sar->host_port);
+      sqltpl_vhost_add(pconf, chain, vs->server_hostname, vs);
+      for (i = 0; vs->names && i < vs->names->nelts; i++) {
+        sqltpl_vhost_add(pconf, chain, APR_ARRAY_IDX(vs->names, i, char *), vs);
+      }
+      if (vs->wild_names && vs->wild_names->nelts
+          && (!chain->wild->nelts || APR_ARRAY_IDX(chain->wild, chain->wild->nelts - 1,
+                                                    server_rec *) != vs)) {
+        APR_ARRAY_PUSH(chain->wild, server_rec *) = vs;
+      }
+    }
+  }
+
+  for (hi = apr_hash_first(ptemp, sqltpl_vhosts); hi; hi = apr_hash_next(hi)) {
+    apr_hash_this(hi, NULL, NULL, (void **)&chain);
+    names += apr_hash_count(chain->names);
+  }
+  ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "SQLTemplateVhostIndex: %u names on %u ports",
+               names, apr_hash_count(sqltpl_vhosts));
+  return OK;
+}
+
+static void sqltpl_pre_read_request(request_rec *r, conn_rec *c)
+{
+  if (c->vhost_lookup_data && sqltpl_vhosts) {
+    ap_set_module_config(r->request_config, &sqltemplate_module, c->vhost_lookup_data);
+    c->vhost_lookup_data = NULL;
+  }
+}
+
+static int sqltpl_post_read_request(request_rec *r)
+{
+  conn_rec *c = r->connection;
+  void *chain = ap_get_module_config(r->request_config, &sqltemplate_module);
+  sqltpl_vhost_chain_t *vhosts;
+  server_rec *vs = NULL;
+  apr_port_t port = c->local_addr->port;
+
+  if (!chain) {
+    return DECLINED;
+  }
+  c->vhost_lookup_data = chain;
+
+  vhosts = apr_hash_get(sqltpl_vhosts, &port, sizeof(port));
+  if (!vhosts) {
+    port = 0;
+    vhosts = apr_hash_get(sqltpl_vhosts, &port, sizeof(port));
+  }
+  if (vhosts && r->hostname) {
+    vs = apr_hash_get(vhosts->names, r->hostname, APR_HASH_KEY_STRING);
+  }
+
+  if (vs && vs != &sqltpl_vhost_shared) {
+    if (vs->timeout != r->server->timeout) {
+      apr_socket_timeout_set(ap_get_conn_socket(c), vs->timeout);
+    }
+    r->server = vs;
+  } else {
+    ap_update_vhost_from_headers(r);
+  }
+  r->per_dir_config = r->server->lookup_defaults;
+  return DECLINED;
+}
+
+/* the trace of a pass is written once it has been read, or tested with
+   httpd -t.
+*/
+static void sqltpl_test_config(apr_pool_t *pconf, server_rec *s)
+{
+  if (sqltpl_trace) {
+    sqltpl_trace_write(pconf, s);
+  }
+  sqltpl_acct_log(s);
+}
+
+static void sqltpl_register_hooks(apr_pool_t *p)
+{
+  APR_REGISTER_OPTIONAL_FN(sqltemplate_table);
+  APR_REGISTER_OPTIONAL_FN(sqltemplate_lookup);
+
+  ap_hook_test_config(sqltpl_test_config, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_post_config(sqltpl_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_child_init(sqltpl_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_pre_read_request(sqltpl_pre_read_request, NULL, NULL, APR_HOOK_MIDDLE);
+  /* before other modules look at r->server */
+  ap_hook_post_read_request(sqltpl_post_read_request, NULL, NULL, APR_HOOK_REALLY_FIRST);
+}
+
 /* Dispatch list for API hooks */
 module AP_MODULE_DECLARE_DATA sqltemplate_module = {
   STANDARD20_MODULE_STUFF,
@@ -1303,6 +5863,6 @@ module AP_MODULE_DECLARE_DATA sqltemplate_module = {
   NULL,                  /* create per-server config structures */
   NULL,                  /* merge  per-server config structures */
   sqltemplate_cmds,      /* table of config file commands       */
-  NULL,                  /* register hooks                      */
+  sqltpl_register_hooks, /* register hooks                      */
 };
 
@@ -0,0 +1,43 @@
+/*
+ * mod_sqltemplate: functions for other modules.
+ *
+ * See mod_sqltemplate.c for the license.
+ */
+
+#ifndef MOD_SQLTEMPLATE_H
+#define MOD_SQLTEMPLATE_H
+
+#include "apr_hash.h"
+#include "apr_optional.h"
+
+/* the rows fetched at startup by the SQL sections given Name=, with
+   SQLTemplateExport On. they are kept in the configuration pool, so
+   child processes share them as they were when httpd forked, and must
+   only read them.
+
+   the rows of every run of a section are gathered, in order. values
+   are strings, NULLs being empty ones.
+*/
+typedef struct {
+  const char *name;               /* Name= of the sections */
+  int ncols;
+  int nrows;
+  const char * const *columns;    /* column names */
+  const char * const * const *rows;  /* rows[row][column] */
+  apr_hash_t *index;              /* value of the first column -> first row with it */
+} sqltemplate_table_t;
+
+/* the table of the sections with that Name=, or NULL.
+*/
+APR_DECLARE_OPTIONAL_FN(const sqltemplate_table_t *, sqltemplate_table,
+                        (const char *name));
+
+/* the first row of that table whose first column is key, or NULL. the
+   index covers the first column only, and keeps the first row for each
+   of its values: later rows with the same value, or a key in another
+   column, are only found by going through rows.
+*/
+APR_DECLARE_OPTIONAL_FN(const char * const *, sqltemplate_lookup,
+                        (const char *name, const char *key));
+
+#endif /* MOD_SQLTEMPLATE_H */
@@ -0,0 +1,59 @@
+#!/bin/sh
+# builds the sqlite3 database of make scaletest, with the tables of
+# 90_mod_sqltemplate.conf:
+#
+#   scale_fixture.sh db hosts aliases
+#
+# the rows follow from the counts alone, so that the expansion of a
+# given size is always the same. a database already of that size is
+# left as it is.
+
+db=$1
+hosts=$2
+aliases=$3
+
+if [ -z "$db" ] || [ -z "$hosts" ] || [ -z "$aliases" ]; then
+  echo "usage: $0 db hosts aliases" >&2
+  exit 2
+fi
+
+if [ -f "$db" ] &&
+   [ "`sqlite3 "$db" 'SELECT hosts, aliases FROM fixture' 2>/dev/null`" = "$hosts|$aliases" ]; then
+  exit 0
+fi
+
+rm -f "$db"
+sqlite3 "$db" >/dev/null <<SQL || exit 1
+PRAGMA journal_mode=OFF;
+PRAGMA synchronous=OFF;
+BEGIN;
+
+CREATE TABLE domains (id INTEGER PRIMARY KEY, name TEXT NOT NULL);
+CREATE TABLE apache_hosts (id INTEGER PRIMARY KEY, hostname TEXT NOT NULL,
+  htroot TEXT NOT NULL, domain_id INTEGER NOT NULL, state INTEGER NOT NULL);
+CREATE TABLE apache_host_aliases (apache_host_id INTEGER NOT NULL,
+  hostname TEXT NOT NULL);
+
+-- 100 domains, some of their names in capitals for |lower
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 100)
+INSERT INTO domains SELECT i, CASE WHEN i % 3 = 0 THEN 'Example' ELSE 'example' END || i || '.com' FROM n;
+
+-- every 7th host without a document root of its own, every 20th parked
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < $hosts)
+INSERT INTO apache_hosts
+  SELECT i, CASE WHEN i % 5 = 0 THEN 'Host' ELSE 'host' END || i,
+         CASE WHEN i % 7 = 0 THEN '' ELSE 'site' || i END,
+         1 + i % 100, CASE WHEN i % 20 = 0 THEN 0 ELSE 1 END
+  FROM n;
+
+-- spread over the hosts in turn, so that each has about the same number
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < $aliases)
+INSERT INTO apache_host_aliases
+  SELECT 1 + (i - 1) % $hosts, 'alias' || i || '.example.net' FROM n;
+
+CREATE INDEX apache_host_aliases_host ON apache_host_aliases (apache_host_id);
+
+CREATE TABLE fixture (hosts INTEGER, aliases INTEGER);
+INSERT INTO fixture VALUES ($hosts, $aliases);
+COMMIT;
+SQL
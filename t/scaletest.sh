@@ -0,0 +1,56 @@
+#!/bin/sh
+# make scaletest: expands t/scale.conf over fixtures of t/scale_fixture.sh,
+# and compares the output with the golden one, within a budget of wall
+# time and peak RSS.
+#
+#   SCALE_HOSTS, SCALE_ALIASES   rows of the large fixture (1000000, 3000000)
+#   SCALE_WALL_MS                wall time budget (60000)
+#   SCALE_RSS_KB                 peak RSS budget (2097152)
+#
+# the output of the small fixture is kept whole in t/scale-200-600.golden,
+# that of larger ones as its line and byte counts and MD5 digest in
+# t/scale-<hosts>-<aliases>.golden. the default budgets are about twice
+# what a single core takes; set them for the machine the test runs on.
+
+cd `dirname $0`/.. || exit 1
+
+hosts=${SCALE_HOSTS:-1000000}
+aliases=${SCALE_ALIASES:-3000000}
+wall=${SCALE_WALL_MS:-60000}
+rss=${SCALE_RSS_KB:-2097152}
+
+# the configuration for the database of that size
+scale_conf() {
+  sed "s|t/scale.db|t/scale-$1-$2.db|" t/scale.conf > t/scale-$1-$2.conf
+}
+
+scale_conf 200 600
+t/scale_fixture.sh t/scale-200-600.db 200 600 || exit 1
+t/sqltpl_test expand -o t/scale-200-600.out t/scale-200-600.conf || exit 1
+if ! cmp -s t/scale-200-600.golden t/scale-200-600.out; then
+  echo "scaletest: the output of 200 hosts differs from the golden one:"
+  diff -u t/scale-200-600.golden t/scale-200-600.out | head -40
+  exit 1
+fi
+echo "scaletest: 200 hosts, 600 aliases: ok"
+
+scale_conf $hosts $aliases
+t/scale_fixture.sh t/scale-$hosts-$aliases.db $hosts $aliases || exit 1
+t/sqltpl_test scale -w $wall -m $rss -o t/scale-$hosts-$aliases.out \
+  t/scale-$hosts-$aliases.conf || exit 1
+
+got="`wc -l < t/scale-$hosts-$aliases.out` `wc -c < t/scale-$hosts-$aliases.out` `md5sum < t/scale-$hosts-$aliases.out`"
+set -- $got
+got="$1 $2 $3"
+golden=t/scale-$hosts-$aliases.golden
+if [ ! -f $golden ]; then
+  echo "scaletest: no golden output for $hosts hosts, $aliases aliases; this one is: $got"
+  exit 1
+fi
+if [ "$got" != "`cat $golden`" ]; then
+  echo "scaletest: the output of $hosts hosts differs from the golden one:"
+  echo "  expected: `cat $golden`"
+  echo "  got:      $got"
+  exit 1
+fi
+echo "scaletest: $hosts hosts, $aliases aliases: ok"
@@ -0,0 +1,1118 @@
+/*
+ * sqltpl_test: the expansion engine of mod_sqltemplate, run outside of
+ * httpd for make scaletest, make generationtest and make vhostbench.
+ *
+ *   sqltpl_test expand [-o out] conf
+ *       write out what conf expands to.
+ *   sqltpl_test scale [-w ms] [-m kb] [-o out] conf
+ *       the same in a child process, failing if it takes longer than ms
+ *       milliseconds, or more than kb kilobytes at its peak.
+ *   sqltpl_test generations [-n count] [-s kb] conf
+ *       read conf count times over, as httpd does over restarts,
+ *       failing if the memory left once the configuration pool is
+ *       cleared grows by more than kb kilobytes, or if more database
+ *       connections or files stay open than after the first time.
+ *   sqltpl_test vhosts [-n count] [-r requests]
+ *       time the choice of a name-based vhost among count of them by
+ *       httpd's matching and by SQLTemplateVhostIndex, failing if they
+ *       choose differently.
+ *
+ * the module is compiled in, with the few functions of httpd it calls.
+ * the configuration is read as httpd's reader would: the directives of
+ * the module are run, the others written out as they come, one per line
+ * without indentation, sections being replaced by what they expand to.
+ * comments and empty lines are left out.
+ *
+ * the database is that of the configuration, so apr-util must have the
+ * driver it names.
+ */
+
+#include "../mod_sqltemplate.c"
+
+#include "apr_general.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <regex.h>
+#include <unistd.h>
+#include <dirent.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static int test_loglevel = APLOG_WARNING;
+static process_rec test_process;
+static server_rec test_server;
+
+/* httpd's side of things.
+*/
+
+AP_DECLARE_DATA module *ap_top_module = &sqltemplate_module;
+
+static void test_vlog(int level, apr_status_t status, const char *fmt, va_list ap)
+{
+  char buf[MAX_STRING_LEN];
+
+  if ((level & APLOG_LEVELMASK) > test_loglevel) {
+    return;
+  }
+  apr_vsnprintf(buf, sizeof(buf), fmt, ap);
+  if (status) {
+    fprintf(stderr, "sqltpl_test: %s (status %d)\n", buf, status);
+  } else {
+    fprintf(stderr, "sqltpl_test: %s\n", buf);
+  }
+}
+
+#ifdef ap_log_error
+AP_DECLARE(void) ap_log_error_(const char *file, int line, int module_index,
+                               int level, apr_status_t status,
+                               const server_rec *s, const char *fmt, ...)
+#else
+AP_DECLARE(void) ap_log_error(const char *file, int line, int level,
+                              apr_status_t status, const server_rec *s,
+                              const char *fmt, ...)
+#endif
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  test_vlog(level, status, fmt, ap);
+  va_end(ap);
+}
+
+AP_DECLARE(void) ap_log_assert(const char *szExp, const char *szFile, int nLine)
+{
+  fprintf(stderr, "sqltpl_test: %s:%d: assertion \"%s\" failed\n", szFile, nLine, szExp);
+  abort();
+}
+
+#ifndef ap_get_module_config
+AP_DECLARE(void *) ap_get_module_config(const ap_conf_vector_t *cv, const module *m)
+{
+  return ((void **)cv)[m->module_index];
+}
+
+AP_DECLARE(void) ap_set_module_config(ap_conf_vector_t *cv, const module *m, void *val)
+{
+  ((void **)cv)[m->module_index] = val;
+}
+#endif
+
+/* the module's commands are the only ones known.
+*/
+AP_DECLARE(const command_rec *) ap_find_command_in_modules(const char *cmd_name, module **mod)
+{
+  const command_rec *cmd;
+
+  for (cmd = sqltemplate_cmds; cmd->name; cmd++) {
+    if (!strcasecmp(cmd->name, cmd_name)) {
+      *mod = &sqltemplate_module;
+      return cmd;
+    }
+  }
+  return NULL;
+}
+
+/* as httpd: a backslash escapes the quote or another backslash.
+*/
+static char *test_substring_conf(apr_pool_t *p, const char *start, apr_size_t len, char quote)
+{
+  char *result = apr_palloc(p, len + 1), *resp = result;
+  apr_size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (start[i] == '\\' && (start[i+1] == '\\' || (quote && start[i+1] == quote))) {
+      *resp++ = start[++i];
+    } else {
+      *resp++ = start[i];
+    }
+  }
+  *resp = '\0';
+  return result;
+}
+
+AP_DECLARE(char *) ap_getword_conf(apr_pool_t *p, const char **line)
+{
+  const char *str = *line, *strend;
+  char *res, quote;
+
+  while (apr_isspace(*str)) {
+    str++;
+  }
+  if (!*str) {
+    *line = str;
+    return "";
+  }
+
+  if ((quote = *str) == '"' || quote == '\'') {
+    strend = str + 1;
+    while (*strend && *strend != quote) {
+      if (*strend == '\\' && (strend[1] == quote || strend[1] == '\\')) {
+        strend += 2;
+      } else {
+        strend++;
+      }
+    }
+    res = test_substring_conf(p, str + 1, strend - str - 1, quote);
+    if (*strend == quote) {
+      strend++;
+    }
+  } else {
+    strend = str;
+    while (*strend && !apr_isspace(*strend)) {
+      strend++;
+    }
+    res = test_substring_conf(p, str, strend - str, 0);
+  }
+
+  while (apr_isspace(*strend)) {
+    strend++;
+  }
+  *line = strend;
+  return res;
+}
+
+AP_DECLARE(ap_configfile_t *) ap_pcfg_open_custom(apr_pool_t *p, const char *descr,
+    void *param,
+    int (*getc_func) (void *param),
+    void *(*gets_func) (void *buf, size_t bufsiz, void *param),
+    int (*close_func) (void *param))
+{
+  ap_configfile_t *cfp = apr_pcalloc(p, sizeof(ap_configfile_t));
+
+  cfp->name   = descr;
+  cfp->param  = param;
+  cfp->getch  = getc_func;
+  cfp->getstr = gets_func;
+  cfp->close  = close_func;
+  return cfp;
+}
+
+/* a line without its leading and trailing blanks, those ending with a
+   backslash going on with the next one. 1 at the end of the file.
+*/
+AP_DECLARE(int) ap_cfg_getline(char *buf, size_t bufsize, ap_configfile_t *cfp)
+{
+  apr_size_t len = 0;
+  char *start;
+
+  for (;;) {
+    if (!cfp->getstr(buf + len, bufsize - len, cfp->param)) {
+      if (!len) {
+        return 1;
+      }
+      break;
+    }
+    cfp->line_number++;
+    len += strlen(buf + len);
+    while (len && apr_isspace(buf[len-1])) {
+      len--;
+    }
+    buf[len] = '\0';
+    if (!len || buf[len-1] != '\\' || len + 1 >= bufsize) {
+      break;
+    }
+    len--;
+  }
+
+  for (start = buf; apr_isspace(*start); start++);
+  memmove(buf, start, strlen(start) + 1);
+  return 0;
+}
+
+AP_DECLARE(const char *) ap_resolve_env(apr_pool_t *p, const char *word)
+{
+  const char *s = word, *end, *value;
+  sqltpl_buf_t out;
+
+  sqltpl_buf_init(&out, p, 0);
+  while ((end = strstr(s, "${")) != NULL) {
+    sqltpl_buf_append(&out, s, end - s);
+    s = ap_strchr_c(end, '}');
+    if (!s) {
+      s = end;
+      break;
+    }
+    value = getenv(apr_pstrmemdup(p, end + 2, s - end - 2));
+    if (value) {
+      sqltpl_buf_append(&out, value, strlen(value));
+    } else {
+      sqltpl_buf_append(&out, end, s + 1 - end);
+    }
+    s++;
+  }
+  sqltpl_buf_append(&out, s, strlen(s) + 1);
+  return out.data;
+}
+
+/* the server root is the current directory.
+*/
+AP_DECLARE(char *) ap_server_root_relative(apr_pool_t *p, const char *fname)
+{
+  return apr_pstrdup(p, fname);
+}
+
+AP_DECLARE(apr_status_t) ap_timeout_parameter_parse(const char *timeout_parameter,
+                                                    apr_interval_time_t *timeout,
+                                                    const char *default_time_unit)
+{
+  char *endp;
+  const char *time_str;
+  apr_int64_t tout;
+
+  errno = 0;
+  tout = apr_strtoi64(timeout_parameter, &endp, 10);
+  if (errno) {
+    return errno;
+  }
+  time_str = *endp ? endp : default_time_unit ? default_time_unit : "s";
+
+  switch (*time_str) {
+  case 's':
+    *timeout = apr_time_from_sec(tout);
+    break;
+  case 'h':
+    *timeout = apr_time_from_sec(tout * 3600);
+    break;
+  case 'm':
+    switch (time_str[1]) {
+    case 's':
+      *timeout = tout * 1000;
+      break;
+    case 'i':
+      *timeout = apr_time_from_sec(tout * 60);
+      break;
+    default:
+      return APR_EGENERAL;
+    }
+    break;
+  default:
+    return APR_EGENERAL;
+  }
+  return APR_SUCCESS;
+}
+
+/* regular expressions are POSIX ones here, which is enough for the
+   tests.
+*/
+static apr_status_t test_regfree(void *re)
+{
+  regfree(re);
+  return APR_SUCCESS;
+}
+
+AP_DECLARE(ap_regex_t *) ap_pregcomp(apr_pool_t *p, const char *pattern, int cflags)
+{
+  ap_regex_t *preg = apr_pcalloc(p, sizeof(ap_regex_t));
+  regex_t *re = apr_pcalloc(p, sizeof(regex_t));
+
+  if (regcomp(re, pattern, REG_EXTENDED | ((cflags & AP_REG_ICASE) ? REG_ICASE : 0))) {
+    return NULL;
+  }
+  apr_pool_cleanup_register(p, re, test_regfree, apr_pool_cleanup_null);
+  preg->re_pcre = re;
+  preg->re_nsub = re->re_nsub;
+  return preg;
+}
+
+AP_DECLARE(int) ap_regexec(const ap_regex_t *preg, const char *string,
+                           apr_size_t nmatch, ap_regmatch_t *pmatch, int eflags)
+{
+  regmatch_t match[10];
+  apr_size_t i;
+
+  if (nmatch > 10) {
+    nmatch = 10;
+  }
+  if (regexec(preg->re_pcre, string, pmatch ? nmatch : 0, match, 0)) {
+    return AP_REG_NOMATCH;
+  }
+  for (i = 0; pmatch && i < nmatch; i++) {
+    pmatch[i].rm_so = match[i].rm_so;
+    pmatch[i].rm_eo = match[i].rm_eo;
+  }
+  return 0;
+}
+
+AP_DECLARE(void) ap_str_tolower(char *s)
+{
+  for (; *s; s++) {
+    *s = apr_tolower(*s);
+  }
+}
+
+/* as httpd: * and ? match any characters and any one character. 0 for
+   a match, 1 for none, -1 when str runs out first.
+*/
+AP_DECLARE(int) ap_strcasecmp_match(const char *str, const char *expected)
+{
+  apr_size_t x, y;
+
+  for (x = 0, y = 0; expected[y]; ++y, ++x) {
+    if (!str[x] && expected[y] != '*') {
+      return -1;
+    }
+    if (expected[y] == '*') {
+      while (expected[++y] == '*');
+      if (!expected[y]) {
+        return 0;
+      }
+      while (str[x]) {
+        int ret;
+
+        if ((ret = ap_strcasecmp_match(&str[x++], &expected[y])) != 1) {
+          return ret;
+        }
+      }
+      return -1;
+    } else if (expected[y] != '?' && apr_tolower(str[x]) != apr_tolower(expected[y])) {
+      return 1;
+    }
+  }
+  return str[x] != '\0';
+}
+
+AP_DECLARE(void) ap_bin2hex(const void *src, apr_size_t srclen, char *dest)
+{
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *in = src;
+  apr_size_t i;
+
+  for (i = 0; i < srclen; i++) {
+    *dest++ = hex[in[i] >> 4];
+    *dest++ = hex[in[i] & 0xf];
+  }
+  *dest = '\0';
+}
+
+/* the hooks are called by hand.
+*/
+AP_DECLARE(void) ap_hook_post_config(ap_HOOK_post_config_t *pf, const char * const *pre,
+                                     const char * const *succ, int order)
+{
+}
+
+AP_DECLARE(void) ap_hook_child_init(ap_HOOK_child_init_t *pf, const char * const *pre,
+                                    const char * const *succ, int order)
+{
+}
+
+AP_DECLARE(void) ap_hook_test_config(ap_HOOK_test_config_t *pf, const char * const *pre,
+                                     const char * const *succ, int order)
+{
+}
+
+AP_DECLARE(void) ap_hook_pre_read_request(ap_HOOK_pre_read_request_t *pf, const char * const *pre,
+                                          const char * const *succ, int order)
+{
+}
+
+AP_DECLARE(void) ap_hook_post_read_request(ap_HOOK_post_read_request_t *pf, const char * const *pre,
+                                           const char * const *succ, int order)
+{
+}
+
+AP_DECLARE(apr_socket_t *) ap_get_conn_socket(conn_rec *c)
+{
+  return NULL;
+}
+
+/* a model of httpd's matching of name-based vhosts, as its vhost.c does
+   it for vhosts on *: the vhosts of the port a connection came in on,
+   or of *:* when none is on that port, tried in turn against the Host:
+   of a request. only what make vhostbench needs: no ServerPath, no
+   vhosts bound to addresses. the module falls back on this same walk
+   for the names it leaves to httpd, so those are only checked to come
+   back, not against httpd.
+*/
+typedef struct test_name_chain {
+  struct test_name_chain *next;
+  server_addr_rec *sar;
+  server_rec *server;
+} test_name_chain;
+
+typedef struct test_ipaddr_chain {
+  struct test_ipaddr_chain *next;
+  server_addr_rec *sar;
+  server_rec *server;
+  test_name_chain *names, *names_last;
+} test_ipaddr_chain;
+
+static test_ipaddr_chain *test_default_list;
+
+static test_ipaddr_chain *test_find_default_server(apr_port_t port)
+{
+  test_ipaddr_chain *trav, *wild_match = NULL;
+
+  for (trav = test_default_list; trav; trav = trav->next) {
+    if (trav->sar->host_port == port) {
+      return trav;
+    }
+    if (!wild_match && !trav->sar->host_port) {
+      wild_match = trav;
+    }
+  }
+  return wild_match;
+}
+
+static void test_fini_vhost_config(apr_pool_t *p, server_rec *main_s)
+{
+  test_ipaddr_chain *ic;
+  test_name_chain *nc;
+  server_addr_rec *sar;
+  server_rec *s;
+
+  test_default_list = NULL;
+  for (s = main_s->next; s; s = s->next) {
+    for (sar = s->addrs; sar; sar = sar->next) {
+      ic = test_find_default_server(sar->host_port);
+      if (!ic || ic->sar->host_port != sar->host_port) {
+        ic = apr_pcalloc(p, sizeof(test_ipaddr_chain));
+        ic->sar    = sar;
+        ic->server = s;
+        ic->next   = test_default_list;
+        test_default_list = ic;
+      }
+      nc = apr_pcalloc(p, sizeof(test_name_chain));
+      nc->sar    = sar;
+      nc->server = s;
+      if (ic->names) {
+        ic->names_last->next = nc;
+      } else {
+        ic->names = nc;
+      }
+      ic->names_last = nc;
+    }
+  }
+}
+
+static void test_update_vhost_given_ip(conn_rec *c)
+{
+  test_ipaddr_chain *ic = test_find_default_server(c->local_addr->port);
+
+  if (ic) {
+    c->vhost_lookup_data = ic->names;
+    c->base_server = ic->server;
+  } else {
+    c->vhost_lookup_data = NULL;
+    c->base_server = &test_server;
+  }
+}
+
+static int test_matches_aliases(server_rec *s, const char *host)
+{
+  int i;
+
+  if (!strcasecmp(host, s->server_hostname)) {
+    return 1;
+  }
+  for (i = 0; s->names && i < s->names->nelts; i++) {
+    if (!strcasecmp(host, APR_ARRAY_IDX(s->names, i, char *))) {
+      return 1;
+    }
+  }
+  for (i = 0; s->wild_names && i < s->wild_names->nelts; i++) {
+    if (!ap_strcasecmp_match(host, APR_ARRAY_IDX(s->wild_names, i, char *))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+AP_DECLARE(void) ap_update_vhost_from_headers(request_rec *r)
+{
+  apr_port_t port = r->connection->local_addr->port;
+  test_name_chain *nc;
+
+  if (!r->hostname) {
+    return;
+  }
+  for (nc = r->connection->vhost_lookup_data; nc; nc = nc->next) {
+    if (nc->sar->host_port && nc->sar->host_port != port) {
+      continue;
+    }
+    if (test_matches_aliases(nc->server, r->hostname)) {
+      r->server = nc->server;
+      return;
+    }
+  }
+}
+
+/* reading the configuration.
+*/
+
+static void *test_file_getstr(void *buf, size_t bufsize, void *param)
+{
+  return fgets(buf, bufsize, param);
+}
+
+static int test_file_close(void *param)
+{
+  return fclose(param);
+}
+
+static const char *test_open(apr_pool_t *p, const char *name, ap_configfile_t **cfp)
+{
+  FILE *fp = fopen(name, "r");
+
+  if (!fp) {
+    return apr_psprintf(p, "could not open %s: %s", name, strerror(errno));
+  }
+  *cfp = ap_pcfg_open_custom(p, name, fp, NULL, test_file_getstr, test_file_close);
+  return NULL;
+}
+
+/* as httpd's invoke_cmd(), for the kinds of arguments the module takes.
+*/
+static const char *test_invoke(cmd_parms *cmd, const command_rec *c,
+                               void *mconfig, const char *args)
+{
+  char *w, *w2, *w3;
+
+  cmd->info = c->cmd_data;
+  cmd->cmd  = c;
+
+  switch (c->args_how) {
+  case RAW_ARGS:
+    return c->AP_RAW_ARGS(cmd, mconfig, args);
+
+  case TAKE1:
+    w = ap_getword_conf(cmd->pool, &args);
+    if (!*w || *args) {
+      return apr_pstrcat(cmd->pool, c->name, " takes one argument", NULL);
+    }
+    return c->AP_TAKE1(cmd, mconfig, w);
+
+  case TAKE12:
+    w  = ap_getword_conf(cmd->pool, &args);
+    w2 = ap_getword_conf(cmd->pool, &args);
+    if (!*w || *args) {
+      return apr_pstrcat(cmd->pool, c->name, " takes 1-2 arguments", NULL);
+    }
+    return c->AP_TAKE2(cmd, mconfig, w, *w2 ? w2 : NULL);
+
+  case TAKE3:
+  case TAKE23:
+    w  = ap_getword_conf(cmd->pool, &args);
+    w2 = ap_getword_conf(cmd->pool, &args);
+    w3 = ap_getword_conf(cmd->pool, &args);
+    if (!*w || !*w2 || *args || (c->args_how == TAKE3 && !*w3)) {
+      return apr_pstrcat(cmd->pool, c->name, c->args_how == TAKE3
+                         ? " takes three arguments" : " takes two or three arguments", NULL);
+    }
+    return c->AP_TAKE3(cmd, mconfig, w, w2, *w3 ? w3 : NULL);
+
+  case FLAG:
+    w = ap_getword_conf(cmd->pool, &args);
+    if (*args || (strcasecmp(w, "on") && strcasecmp(w, "off"))) {
+      return apr_pstrcat(cmd->pool, c->name, " must be On or Off", NULL);
+    }
+    return c->AP_FLAG(cmd, mconfig, strcasecmp(w, "off") != 0);
+
+  default:
+    return apr_pstrcat(cmd->pool, c->name, ": kind of arguments not handled", NULL);
+  }
+}
+
+/* sections handed back as nodes are written as their text would be.
+*/
+static void test_write_tree(FILE *out, ap_directive_t *node)
+{
+  for (; node; node = node->next) {
+    fprintf(out, *node->args ? "%s %s\n" : "%s\n", node->directive, node->args);
+    if (node->first_child) {
+      test_write_tree(out, node->first_child);
+      fprintf(out, "</%s>\n", node->directive + 1);
+    }
+  }
+}
+
+/* read the configuration cmd is on to its end.
+*/
+static const char *test_read(cmd_parms *cmd, FILE *out)
+{
+  char line[MAX_STRING_LEN];
+  const command_rec *c;
+  ap_directive_t *tree;
+  const char *args, *errmsg;
+  module *mod;
+  char *name;
+
+  while (!ap_cfg_getline(line, sizeof(line), cmd->config_file)) {
+    if (!*line || *line == '#') {
+      continue;
+    }
+
+    args = line;
+    name = ap_getword_conf(cmd->temp_pool, &args);
+    mod  = ap_top_module;
+    if (!(c = ap_find_command_in_modules(name, &mod))) {
+      fprintf(out, "%s\n", line);
+      continue;
+    }
+
+    tree = NULL;
+    if ((errmsg = test_invoke(cmd, c, &tree, args)) != NULL) {
+      return apr_psprintf(cmd->pool, "line %d of %s: %s",
+          cmd->config_file->line_number, cmd->config_file->name, errmsg);
+    }
+    test_write_tree(out, tree);
+  }
+
+  return NULL;
+}
+
+/* one pass over the configuration, as httpd makes at each start: pconf
+   is cleared, the configuration read with a temporary pool of its own,
+   and the hooks run.
+*/
+static const char *test_generation(apr_pool_t *pconf, const char *conf, FILE *out,
+                                   sqltpl_acct_t *acct)
+{
+  ap_configfile_t *cfp = NULL;
+  apr_pool_t *ptemp;
+  cmd_parms cmd;
+  const char *errmsg;
+
+  apr_pool_clear(pconf);
+  apr_pool_create(&ptemp, pconf);
+  test_process.pconf = pconf;
+  test_server.module_config = apr_pcalloc(pconf, sizeof(void *));
+
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.pool      = pconf;
+  cmd.temp_pool = ptemp;
+  cmd.server    = &test_server;
+  cmd.override  = OR_ALL | ACCESS_CONF;
+  cmd.limited   = -1;
+
+  errmsg = test_open(pconf, conf, &cfp);
+  if (!errmsg) {
+    cmd.config_file = cfp;
+    errmsg = test_read(&cmd, out);
+    cfp->close(cfp->param);
+  }
+  if (!errmsg) {
+    /* as the hook leaves it for the next generation */
+    if (acct) {
+      *acct = *sqltpl_acct(&test_server);
+    }
+    sqltpl_post_config(pconf, ptemp, ptemp, &test_server);
+  }
+
+  apr_pool_destroy(ptemp);
+  return errmsg;
+}
+
+static int test_expand(apr_pool_t *p, const char *conf, const char *outname)
+{
+  FILE *out = stdout;
+  apr_pool_t *pconf;
+  const char *errmsg;
+
+  if (outname && !(out = fopen(outname, "w"))) {
+    fprintf(stderr, "sqltpl_test: %s: %s\n", outname, strerror(errno));
+    return 1;
+  }
+  setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+  apr_pool_create(&pconf, p);
+  errmsg = test_generation(pconf, conf, out, NULL);
+  if (errmsg) {
+    fprintf(stderr, "sqltpl_test: %s\n", errmsg);
+    return 1;
+  }
+  if (fclose(out)) {
+    fprintf(stderr, "sqltpl_test: %s: %s\n", outname ? outname : "stdout", strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+/* the expansion in a child, so that its peak RSS is that of the child
+   alone, as the kernel counts it.
+*/
+static int test_scale(apr_pool_t *p, const char *conf, const char *outname,
+                      long wall_budget, long rss_budget)
+{
+  apr_time_t started = apr_time_now();
+  struct rusage usage;
+  apr_int64_t wall;
+  int status, failed = 0;
+  pid_t pid;
+
+  fflush(stdout);
+  if ((pid = fork()) < 0) {
+    perror("sqltpl_test: fork");
+    return 1;
+  }
+  if (!pid) {
+    _exit(test_expand(p, conf, outname));
+  }
+
+  if (waitpid(pid, &status, 0) < 0 || getrusage(RUSAGE_CHILDREN, &usage)) {
+    perror("sqltpl_test: waitpid");
+    return 1;
+  }
+  wall = apr_time_as_msec(apr_time_now() - started);
+
+  printf("sqltpl_test: %s: %" APR_INT64_T_FMT " ms, peak RSS %ld KB\n",
+         conf, wall, (long)usage.ru_maxrss);
+  fflush(stdout);
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "sqltpl_test: the expansion of %s failed\n", conf);
+    return 1;
+  }
+  if (wall_budget && wall > wall_budget) {
+    fprintf(stderr, "sqltpl_test: over the wall time budget of %ld ms\n", wall_budget);
+    failed = 1;
+  }
+  if (rss_budget && usage.ru_maxrss > rss_budget) {
+    fprintf(stderr, "sqltpl_test: over the peak RSS budget of %ld KB\n", rss_budget);
+    failed = 1;
+  }
+  return failed;
+}
+
+/* the heap in use. with an allocator that keeps nothing aside, memory
+   freed by the pools goes back to malloc, so this is what they hold.
+*/
+static apr_size_t test_heap(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  struct mallinfo2 mi = mallinfo2();
+
+  return mi.uordblks + mi.hblkhd;
+#elif defined(__GLIBC__)
+  struct mallinfo mi = mallinfo();
+
+  return (unsigned)mi.uordblks + (unsigned)mi.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+/* the files open, -1 if they cannot be counted.
+*/
+static int test_files(void)
+{
+  DIR *dir = opendir("/proc/self/fd");
+  int files = 0;
+
+  if (!dir) {
+    return -1;
+  }
+  while (readdir(dir)) {
+    files++;
+  }
+  closedir(dir);
+  return files;
+}
+
+/* the restarts of a long running httpd: the configuration pool is
+   cleared and the configuration read again, count times. the first
+   generation opens the connections kept from then on, the second
+   settles what the allocator and the database library keep around, and
+   the following ones are held to it.
+*/
+static int test_generations(apr_pool_t *p, const char *conf, int count, apr_size_t slack)
+{
+  static const char * const names[3] = { "SQLRepeat", "SQLCatSet", "SQLGroup" };
+  apr_size_t kept, left, kept_base = 0, left_base = 0;
+  apr_size_t bytes[3] = { 0, 0, 0 };
+  long sections[3] = { 0, 0, 0 };
+  int handles, files, first_handles = 0, first_files = 0, failed = 0, g, i;
+  apr_allocator_t *allocator;
+  apr_pool_t *pconf;
+  sqltpl_acct_t acct;
+  const char *errmsg;
+  FILE *out;
+
+  if (!(out = fopen("/dev/null", "w"))) {
+    perror("sqltpl_test: /dev/null");
+    return 1;
+  }
+  apr_allocator_create(&allocator);
+  apr_allocator_max_free_set(allocator, 1);
+  apr_pool_create_ex(&pconf, p, NULL, allocator);
+  apr_allocator_owner_set(allocator, pconf);
+
+  for (g = 1; g <= count; g++) {
+    if ((errmsg = test_generation(pconf, conf, out, &acct)) != NULL) {
+      fprintf(stderr, "sqltpl_test: generation %d: %s\n", g, errmsg);
+      return 1;
+    }
+    kept = test_heap();
+    apr_pool_clear(pconf);
+    left = test_heap();
+    handles = sqltpl_acct_handles(sqltpl_acct(&test_server));
+    files = test_files();
+
+    for (i = 0; i < 3; i++) {
+      sections[i] += acct.sections[i];
+      bytes[i] += acct.bytes[i];
+    }
+    printf("generation %d: %" APR_SIZE_T_FMT " KB with the configuration, %"
+           APR_SIZE_T_FMT " KB once cleared, %d connections, %d files open\n",
+           g, kept / 1024, left / 1024, handles, files);
+
+    if (g == 1) {
+      first_handles = handles;
+      first_files = files;
+    } else if (g == 2) {
+      kept_base = kept;
+      left_base = left;
+    } else {
+      if (left > left_base + slack * 1024 || kept > kept_base + slack * 1024) {
+        fprintf(stderr, "sqltpl_test: generation %d: memory grew from %" APR_SIZE_T_FMT
+                " KB to %" APR_SIZE_T_FMT " KB once cleared, %" APR_SIZE_T_FMT " KB to %"
+                APR_SIZE_T_FMT " KB with the configuration\n", g, left_base / 1024,
+                left / 1024, kept_base / 1024, kept / 1024);
+        failed = 1;
+      }
+    }
+    if (g > 1 && (handles > first_handles || files > first_files)) {
+      fprintf(stderr, "sqltpl_test: generation %d: %d connections and %d files open, "
+              "%d and %d after the first one\n", g, handles, files, first_handles, first_files);
+      failed = 1;
+    }
+    if (failed) {
+      break;
+    }
+  }
+
+  for (i = 0; i < 3; i++) {
+    printf("%s: %ld sections, %" APR_SIZE_T_FMT " bytes per generation\n",
+           names[i], sections[i] / (g > count ? count : g),
+           bytes[i] / (g > count ? count : g));
+  }
+  fclose(out);
+  return failed;
+}
+
+/* a vhost on *:port, port 0 for *:*.
+*/
+static server_rec *test_vhost(apr_pool_t *p, apr_port_t port, const char *name)
+{
+  server_rec *s = apr_pcalloc(p, sizeof(server_rec));
+  server_addr_rec *sar = apr_pcalloc(p, sizeof(server_addr_rec));
+
+  apr_sockaddr_info_get(&sar->host_addr, NULL, APR_INET, port, 0, p);
+  sar->host_port = port;
+  sar->virthost  = port ? apr_psprintf(p, "*:%d", port) : "*:*";
+  s->process         = &test_process;
+  s->server_hostname = apr_pstrdup(p, name);
+  s->addrs           = sar;
+  s->names           = apr_array_make(p, 1, sizeof(char *));
+  s->wild_names      = apr_array_make(p, 1, sizeof(char *));
+  s->timeout         = test_server.timeout;
+  s->is_virtual      = 1;
+  return s;
+}
+
+/* count name-based vhosts, and requests for them picked by the model
+   of httpd's matching above and by SQLTemplateVhostIndex, which must
+   pick the same vhosts. vhost i is host<i>.example.com on *:80, with the alias
+   www.host<i>.example.com, but for:
+     every 10th, on *:443 with the name of the vhost 9 before it, and
+       the alias secure<i>.example.com;
+     every 100th, with the wildcard alias *.host<i+1>.example.com that
+       takes www.host<i+1>.example.com from the next one;
+   and a last vhost any.example.com on *:*, for the other ports. one
+   request in 20 is for a name no vhost has, one in 20 on port 8080, one
+   in 4 on port 443.
+*/
+static int test_vhosts(apr_pool_t *p, int count, int nrequests)
+{
+  server_rec **last = &test_server.next, *s, **chosen;
+  apr_time_t started, walk, indexed;
+  request_rec *requests, *r;
+  apr_pool_t *pconf, *ptemp;
+  conn_rec *conns;
+  int i, k, other = 0;
+
+  apr_pool_create(&pconf, p);
+  apr_pool_create(&ptemp, pconf);
+  test_process.pconf = pconf;
+  test_server.module_config = apr_pcalloc(pconf, sizeof(void *));
+
+  for (i = 0; i < count; i++) {
+    if (i % 10 == 9) {
+      s = test_vhost(pconf, 443, apr_psprintf(pconf, "host%d.example.com", i - 9));
+      APR_ARRAY_PUSH(s->names, char *) = apr_psprintf(pconf, "secure%d.example.com", i);
+    } else {
+      s = test_vhost(pconf, 80, apr_psprintf(pconf, "host%d.example.com", i));
+      APR_ARRAY_PUSH(s->names, char *) = apr_psprintf(pconf, "www.host%d.example.com", i);
+    }
+    if (i % 100 == 0) {
+      APR_ARRAY_PUSH(s->wild_names, char *) = apr_psprintf(pconf, "*.host%d.example.com", i + 1);
+    }
+    *last = s;
+    last = &s->next;
+  }
+  *last = test_vhost(pconf, 0, "any.example.com");
+
+  test_fini_vhost_config(pconf, &test_server);
+  ((sqltpl_dbinfo_t *)get_dbinfo(pconf, &test_server))->vhost_index = 1;
+  sqltpl_post_config(pconf, ptemp, ptemp, &test_server);
+
+  requests = apr_pcalloc(pconf, nrequests * sizeof(request_rec));
+  conns    = apr_pcalloc(pconf, nrequests * sizeof(conn_rec));
+  chosen   = apr_pcalloc(pconf, nrequests * sizeof(server_rec *));
+  srand(1);
+  for (i = 0; i < nrequests; i++) {
+    r = &requests[i];
+    r->connection = &conns[i];
+    r->request_config = apr_pcalloc(pconf, sizeof(void *));
+    conns[i].local_addr = apr_pcalloc(pconf, sizeof(apr_sockaddr_t));
+    conns[i].local_addr->port = 80;
+    k = rand() % count;
+    k -= k % 10 == 9;
+    switch (rand() % 20) {
+    case 0:
+      r->hostname = apr_psprintf(pconf, "unknown%d.example.net", k);
+      break;
+    case 1:
+      conns[i].local_addr->port = 8080;
+      r->hostname = "any.example.com";
+      break;
+    case 2: case 3:
+      conns[i].local_addr->port = 443;
+      r->hostname = apr_psprintf(pconf, "secure%d.example.com", k - k % 10 + 9);
+      break;
+    case 4:
+      conns[i].local_addr->port = 443;
+      r->hostname = apr_psprintf(pconf, "host%d.example.com", k - k % 10);
+      break;
+    case 5: case 6: case 7: case 8: case 9: case 10:
+      r->hostname = apr_psprintf(pconf, "www.host%d.example.com", k);
+      break;
+    default:
+      r->hostname = apr_psprintf(pconf, "host%d.example.com", k);
+    }
+  }
+
+  started = apr_time_now();
+  for (i = 0; i < nrequests; i++) {
+    r = &requests[i];
+    test_update_vhost_given_ip(r->connection);
+    r->server = r->connection->base_server;
+    ap_update_vhost_from_headers(r);
+    chosen[i] = r->server;
+  }
+  walk = apr_time_now() - started;
+
+  started = apr_time_now();
+  for (i = 0; i < nrequests; i++) {
+    r = &requests[i];
+    test_update_vhost_given_ip(r->connection);
+    r->server = r->connection->base_server;
+    sqltpl_pre_read_request(r, r->connection);
+    sqltpl_post_read_request(r);
+  }
+  indexed = apr_time_now() - started;
+
+  for (i = 0; i < nrequests; i++) {
+    r = &requests[i];
+    if (r->server != chosen[i]) {
+      if (!other++) {
+        fprintf(stderr, "sqltpl_test: %s on port %d: %s for httpd, %s with the index\n",
+                r->hostname, r->connection->local_addr->port,
+                chosen[i]->server_hostname, r->server->server_hostname);
+      }
+    }
+  }
+
+  printf("%d vhosts, %d requests: httpd (model) %" APR_INT64_T_FMT " ns per request, "
+         "SQLTemplateVhostIndex %" APR_INT64_T_FMT " ns per request\n", count, nrequests,
+         walk * 1000 / nrequests, indexed * 1000 / nrequests);
+  if (other) {
+    fprintf(stderr, "sqltpl_test: %d requests given another vhost than httpd's\n", other);
+  }
+  test_server.next = NULL;
+  apr_pool_destroy(pconf);
+  return other != 0;
+}
+
+static int test_usage(void)
+{
+  fprintf(stderr,
+      "usage: sqltpl_test expand [-o out] conf\n"
+      "       sqltpl_test scale [-w ms] [-m kb] [-o out] conf\n"
+      "       sqltpl_test generations [-n count] [-s kb] conf\n"
+      "       sqltpl_test vhosts [-n count] [-r requests]\n"
+      "the level of the messages logged is taken from SQLTPL_TEST_LOGLEVEL (%d)\n",
+      APLOG_WARNING);
+  return 2;
+}
+
+int main(int argc, const char * const *argv)
+{
+  const char *mode, *outname = NULL, *level;
+  long wall_budget = 0, rss_budget = 0, slack = 64;
+  int count = 0, nrequests = 100000;
+  apr_pool_t *pglobal;
+  int i;
+
+  if (argc < 2) {
+    return test_usage();
+  }
+  mode = argv[1];
+  for (i = 2; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+    if (!strcmp(argv[i], "-o")) {
+      outname = argv[i+1];
+    } else if (!strcmp(argv[i], "-w")) {
+      wall_budget = atol(argv[i+1]);
+    } else if (!strcmp(argv[i], "-m")) {
+      rss_budget = atol(argv[i+1]);
+    } else if (!strcmp(argv[i], "-n")) {
+      count = atoi(argv[i+1]);
+    } else if (!strcmp(argv[i], "-s")) {
+      slack = atol(argv[i+1]);
+    } else if (!strcmp(argv[i], "-r")) {
+      nrequests = atoi(argv[i+1]);
+    } else {
+      return test_usage();
+    }
+  }
+  if (i + 1 != argc && (i != argc || strcmp(mode, "vhosts"))) {
+    return test_usage();
+  }
+  if ((level = getenv("SQLTPL_TEST_LOGLEVEL")) != NULL) {
+    test_loglevel = atoi(level);
+  }
+
+  apr_initialize();
+  atexit(apr_terminate);
+  apr_pool_create(&pglobal, NULL);
+
+  /* the module is the only one */
+  sqltemplate_module.module_index = 0;
+  test_process.pool       = pglobal;
+  test_process.short_name = "sqltpl_test";
+  test_server.process         = &test_process;
+  test_server.server_hostname = "localhost";
+  test_server.timeout         = apr_time_from_sec(60);
+#ifdef ap_log_error
+  test_server.log.level = APLOG_TRACE8;
+#endif
+  sqltpl_register_hooks(pglobal);
+
+  if (!strcmp(mode, "expand")) {
+    return test_expand(pglobal, argv[i], outname);
+  }
+  if (!strcmp(mode, "scale")) {
+    return test_scale(pglobal, argv[i], outname, wall_budget, rss_budget);
+  }
+  if (!strcmp(mode, "generations") && count >= 0) {
+    return test_generations(pglobal, argv[i], count ? count : 200, (apr_size_t)slack);
+  }
+  if (!strcmp(mode, "vhosts") && i == argc && count >= 0 && nrequests > 0) {
+    return test_vhosts(pglobal, count ? count : 10000, nrequests);
+  }
+  return test_usage();
+}